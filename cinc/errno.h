@@ -1,6 +1,6 @@
 #pragma once
 
-// TODO: no one use this so far.
 enum {
-EINVAL = -1,
+EINVAL = -1, // TODO: no one use this so far.
+EAGAIN = -2, // nothing can be done without blocking. Try again later.
 };
@@ -0,0 +1,85 @@
+#pragma once
+
+/*
+ * Shared by the kernel and user programs for batched I/O.
+ *
+ * A process registers a struct ioring in its own memory with ioring_setup
+ * once. It then fills submission entries (sqes) and calls ioring_enter to have
+ * the kernel run a batch of them. The kernel posts one completion entry (cqe)
+ * per sqe in the same order.
+ *
+ * The heads and tails are free running counters. An entry lives in slot
+ * (counter & (IORING_NENTRIES - 1)). The process advances sq_tail and cq_head;
+ * the kernel advances sq_head and cq_tail.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+// must be a power of 2
+#define IORING_NENTRIES 256
+
+enum {
+  IORING_OP_NOP,
+  IORING_OP_READ, // fd, addr, len
+  IORING_OP_WRITE, // fd, addr, len
+  IORING_OP_OPEN, // path, flags
+  IORING_OP_CLOSE, // fd
+  IORING_OP_READDIR, // path, addr (struct dirent array), len (capacity), off
+};
+
+struct ioring_sqe {
+  uint32_t opcode;
+  int32_t fd;
+  uint32_t addr;
+  int32_t len;
+  uint32_t path;
+  int32_t flags;
+  int32_t off; // the first entry for readdir
+  uint32_t user_data; // copied to the cqe
+};
+
+struct ioring_cqe {
+  uint32_t user_data;
+  // what the corresponding syscall returns. A read from a pipe or the console
+  // that has nothing to return follows the same convention as the read
+  // syscall: 1 with a negative char in the buffer.
+  int32_t res;
+};
+
+struct ioring {
+  volatile uint32_t sq_head;
+  volatile uint32_t sq_tail;
+  volatile uint32_t cq_head;
+  volatile uint32_t cq_tail;
+  struct ioring_sqe sqes[IORING_NENTRIES];
+  struct ioring_cqe cqes[IORING_NENTRIES];
+};
+
+// return the next free sqe or nullptr if the submission queue is full. The
+// entry is submitted by ioring_advance_sq.
+static inline struct ioring_sqe* ioring_get_sqe(struct ioring* ring) {
+  if (ring->sq_tail - ring->sq_head >= IORING_NENTRIES) {
+    return nullptr;
+  }
+  struct ioring_sqe* sqe = &ring->sqes[ring->sq_tail & (IORING_NENTRIES - 1)];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static inline void ioring_advance_sq(struct ioring* ring) {
+  ring->sq_tail = ring->sq_tail + 1;
+}
+
+// return the oldest completion or nullptr if there is none. The entry is
+// consumed by ioring_advance_cq.
+static inline struct ioring_cqe* ioring_peek_cqe(struct ioring* ring) {
+  if (ring->cq_head == ring->cq_tail) {
+    return nullptr;
+  }
+  return &ring->cqes[ring->cq_head & (IORING_NENTRIES - 1)];
+}
+
+static inline void ioring_advance_cq(struct ioring* ring) {
+  ring->cq_head = ring->cq_head + 1;
+}
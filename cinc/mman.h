@@ -0,0 +1,14 @@
+#pragma once
+
+// shared by the kernel and user programs for the mmap syscall
+
+#define PROT_READ 1
+#define PROT_WRITE 2
+
+// writes through a MAP_SHARED mapping are not supported yet, so a shared
+// mapping must be read only
+#define MAP_SHARED 1
+// writes go to a private copy of the page
+#define MAP_PRIVATE 2
+
+#define MAP_FAILED ((void*) -1)
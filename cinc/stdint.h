@@ -15,6 +15,7 @@ typedef int int32_t;
 typedef unsigned int uint32_t;
 typedef long long int64_t;
 typedef unsigned long long uint64_t;
+typedef uint32_t uintptr_t;
 
 #include <assert.h>
 
@@ -26,6 +27,7 @@ static_assert(sizeof(int32_t) == 4);
 static_assert(sizeof(uint32_t) == 4);
 static_assert(sizeof(int64_t) == 8);
 static_assert(sizeof(uint64_t) == 8);
+static_assert(sizeof(uintptr_t) == sizeof(void*));
 
 #define NULL ((void*) 0)
 
@@ -9,6 +9,13 @@ int printf(const char* fmt, ...);
 int puts(const char *s);
 int putchar(int ch);
 
+// lseek whence
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+#define SEEK_DATA 3 // the next offset with data
+#define SEEK_HOLE 4 // the next offset in a hole. The end of a file counts.
+
 // this is only for user mode
 #define FILE void
 char* fgets(char* s, int size, FILE* stream);
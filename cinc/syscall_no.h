@@ -18,5 +18,14 @@ enum {
   SC_PIPE = 15,
   SC_UNLINK = 16,
   SC_RMDIR = 17,
+  SC_MMAP = 18,
+  SC_MUNMAP = 19,
+  SC_IORING_SETUP = 20,
+  SC_IORING_ENTER = 21,
+  SC_SENDFILE = 22,
+  SC_SPLICE = 23,
+  SC_LSEEK = 24,
+  SC_FSYNC = 25,
+  SC_SYNC = 26,
   NUM_SYS_CALL,
 };
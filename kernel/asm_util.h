@@ -11,6 +11,25 @@ static inline void asm_sti() {
   asm volatile("sti");
 }
 
+#define EFLAGS_IF (1 << 9)
+
+// disable interrupt and return the previous eflags
+static inline uint32_t asm_cli_save() {
+  uint32_t flags;
+  asm volatile("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+static inline void asm_restore_flags(uint32_t flags) {
+  asm volatile("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+// enable interrupt and halt until the next one. An interrupt can not sneak in
+// between the two instructions since sti takes effect after the next one.
+static inline void asm_sti_hlt() {
+  asm volatile("sti; hlt" : : : "memory");
+}
+
 uint32_t asm_get_cr3();
 void asm_set_cr3(uint32_t phys_addr);
 uint32_t asm_get_cr2();
@@ -0,0 +1,146 @@
+#include <kernel/blkbitmap.h>
+#include <kernel/simfs.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+
+void BlockBitmap::init(uint32_t start, uint32_t nblock, uint32_t tot_block, bool defer_reuse) {
+  assert(nblock > 0 && nblock <= BLKBITMAP_MAX_NBLOCK);
+  assert(nblock * BITS_PER_BLOCK >= tot_block);
+  start_ = start;
+  nblock_ = nblock;
+  tot_block_ = tot_block;
+  words_ = (uint32_t*) malloc(nblock * BLOCK_SIZE);
+  assert(words_);
+  for (int i = 0; i < nblock; ++i) {
+    SimFs::get().readBlock(start + i, (uint8_t*) words_ + i * BLOCK_SIZE);
+    dirty_[i] = false;
+  }
+  if (defer_reuse) {
+    pending_ = (uint32_t*) malloc(nblock * BLOCK_SIZE);
+    assert(pending_);
+    memset(pending_, 0, nblock * BLOCK_SIZE);
+    pending_dirty_ = false;
+  }
+  // the super block and the bitmap itself
+  assert(isset(0) && isset(start + nblock - 1));
+}
+
+uint32_t BlockBitmap::findFree(uint32_t from, uint32_t to) const {
+  uint32_t b = from;
+  while (b < to) {
+    if (b % 32 == 0 && busyWord(b / 32) == 0xFFFFFFFF) {
+      b += 32;
+    } else if (!busy(b)) {
+      return b;
+    } else {
+      ++b;
+    }
+  }
+  return to;
+}
+
+uint32_t BlockBitmap::findUsed(uint32_t from, uint32_t to) const {
+  uint32_t b = from;
+  while (b < to) {
+    if (b % 32 == 0 && busyWord(b / 32) == 0) {
+      b += 32;
+    } else if (busy(b)) {
+      return b;
+    } else {
+      ++b;
+    }
+  }
+  return to;
+}
+
+void BlockBitmap::setRange(uint32_t blkid, int n, bool used) {
+  assert(blkid + n <= tot_block_);
+  for (uint32_t b = blkid; b < blkid + n; ++b) {
+    assert(isset(b) != used);
+    if (used) {
+      words_[b / 32] |= (1U << (b % 32));
+    } else {
+      words_[b / 32] &= ~(1U << (b % 32));
+    }
+    dirty_[b / BITS_PER_BLOCK] = true;
+  }
+}
+
+uint32_t BlockBitmap::alloc(int n, uint32_t goal, int* pnalloc) {
+  assert(n > 0);
+  if (goal >= tot_block_) {
+    goal = 0;
+  }
+  // the first free run found. Used if there is no run of n free blocks.
+  uint32_t first_start = 0;
+  int first_len = 0;
+
+  // search [goal, tot_block_) first and then [0, goal)
+  for (int pass = 0; pass < 2; ++pass) {
+    uint32_t b = pass == 0 ? goal : 0;
+    uint32_t end = pass == 0 ? tot_block_ : goal;
+    while (b < end) {
+      uint32_t s = findFree(b, end);
+      if (s >= end) {
+        break;
+      }
+      uint32_t e = findUsed(s, min(tot_block_, s + n));
+      if (e - s == n) {
+        setRange(s, n, true);
+        *pnalloc = n;
+        return s;
+      }
+      if (first_len == 0) {
+        first_start = s;
+        first_len = e - s;
+      }
+      b = e;
+    }
+  }
+  *pnalloc = first_len;
+  if (first_len > 0) {
+    setRange(first_start, first_len, true);
+  }
+  return first_start;
+}
+
+void BlockBitmap::free(uint32_t blkid, int n) {
+  // the super block and the bitmap can never be freed
+  assert(blkid >= start_ + nblock_);
+  setRange(blkid, n, false);
+  if (pending_) {
+    for (uint32_t b = blkid; b < blkid + n; ++b) {
+      pending_[b / 32] |= (1U << (b % 32));
+    }
+    pending_dirty_ = true;
+  }
+}
+
+void BlockBitmap::releasePending() {
+  if (pending_ && pending_dirty_) {
+    memset(pending_, 0, nblock_ * BLOCK_SIZE);
+    pending_dirty_ = false;
+  }
+}
+
+void BlockBitmap::flush() {
+  for (int i = 0; i < nblock_; ++i) {
+    if (dirty_[i]) {
+      SimFs::get().writeBlock(start_ + i, (const uint8_t*) words_ + i * BLOCK_SIZE);
+      dirty_[i] = false;
+    }
+  }
+}
+
+int BlockBitmap::countFree() const {
+  int nfree = 0;
+  for (uint32_t b = 0; b < tot_block_; ++b) {
+    if (!isset(b)) {
+      ++nfree;
+    }
+  }
+  return nfree;
+}
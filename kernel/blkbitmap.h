@@ -0,0 +1,77 @@
+#pragma once
+
+/*
+ * The on-disk block allocation bitmap of SimFs.
+ *
+ * Bit i is set if physical block i is in use. The blocks for the super block
+ * and the bitmap itself are always marked as used. The whole bitmap is kept in
+ * memory (one physical page per bitmap block); changes are accumulated there
+ * and written to the buffer cache by flush(). Each bitmap block covers
+ * BLOCK_SIZE * 8 = 32768 blocks (128MB), so freeing even a huge file only
+ * dirties a few bitmap blocks.
+ *
+ * With the journal, a block freed by a transaction group that has not been
+ * committed yet must not be reused: the committed metadata on disk may still
+ * point to it and its new content could reach the disk before the group.
+ * Such blocks are marked free but kept in a second in-memory bitmap of
+ * pending blocks until releasePending() is called after the commit.
+ */
+
+#include <stdint.h>
+
+// at most 32 bitmap blocks, i.e. 1M blocks (4GB)
+#define BLKBITMAP_MAX_NBLOCK 32
+
+class BlockBitmap {
+ public:
+  // start is the first block of the bitmap. nblock is the number of bitmap
+  // blocks. Freed blocks are not reused until releasePending() if defer_reuse
+  // is true.
+  void init(uint32_t start, uint32_t nblock, uint32_t tot_block, bool defer_reuse = false);
+
+  // Allocate up to n contiguous blocks and return the first one. The number
+  // of blocks allocated is stored in *pnalloc.
+  //
+  // The search starts at goal and wraps around. The first run of n free
+  // blocks is preferred; if there is none, the first free run (which is
+  // shorter than n) is returned instead. Return 0 if the disk is full.
+  uint32_t alloc(int n, uint32_t goal, int* pnalloc);
+  void free(uint32_t blkid, int n = 1);
+
+  // write the changed bitmap blocks to the buffer cache
+  void flush();
+
+  // make the blocks freed so far available for allocation
+  void releasePending();
+
+  int countFree() const;
+ private:
+  bool isset(uint32_t blkid) const {
+    return words_[blkid / 32] & (1U << (blkid % 32));
+  }
+  // used or freed but still pending
+  uint32_t busyWord(uint32_t i) const {
+    return pending_ ? (words_[i] | pending_[i]) : words_[i];
+  }
+  bool busy(uint32_t blkid) const {
+    return busyWord(blkid / 32) & (1U << (blkid % 32));
+  }
+  void setRange(uint32_t blkid, int n, bool used);
+  // return the first free and not pending block in [from, to). Return to if
+  // not found.
+  uint32_t findFree(uint32_t from, uint32_t to) const;
+  // return the first used or pending block in [from, to). Return to if not
+  // found.
+  uint32_t findUsed(uint32_t from, uint32_t to) const;
+
+  uint32_t start_;
+  uint32_t nblock_;
+  uint32_t tot_block_;
+  // bitmap blocks are contiguous in memory
+  uint32_t* words_;
+  // blocks freed since the last releasePending(). nullptr if the reuse is not
+  // deferred.
+  uint32_t* pending_ = nullptr;
+  bool pending_dirty_;
+  bool dirty_[BLKBITMAP_MAX_NBLOCK];
+};
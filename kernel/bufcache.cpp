@@ -0,0 +1,368 @@
+#include <kernel/bufcache.h>
+#include <kernel/simfs.h>
+#include <kernel/phys_page.h>
+#include <kernel/idt.h>
+#include <cinc/algorithm.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+void BufCacheStats::print() const {
+  uint32_t tot = hits + misses;
+  uint32_t hit_rate = 0;
+  if (tot > 0) {
+    // avoid 64 bit division which requires libgcc
+    hit_rate = hits < (1U << 24) ? hits * 100 / tot : hits / (tot / 100);
+  }
+  printf("Buffer cache: %d hits, %d misses (hit rate %d%%), %d writebacks, %d evictions\n",
+    hits, misses, hit_rate, writebacks, evictions);
+  printf("  readahead: %d blocks in %d device commands\n", readahead_blocks, readahead_cmds);
+  printf("  write through: %d blocks in %d device commands\n", writethrough_blocks, writethrough_cmds);
+  printf("  direct read: %d blocks in %d device commands\n", direct_read_blocks, direct_read_cmds);
+  printf("  sync: %d blocks in %d device commands\n", sync_blocks, sync_cmds);
+}
+
+// gathers the blocks of a multi-block transfer of readahead and sync, whose
+// buffers are not contiguous
+static uint8_t io_buf[BUFCACHE_MAX_IO_BLOCKS * BLOCK_SIZE] __attribute__((aligned(4096)));
+
+void BufCache::init() {
+  assert(!initialized_);
+  lru_head_ = lru_tail_ = nullptr;
+  for (int i = 0; i < BUFCACHE_NBUCKET; ++i) {
+    buckets_[i] = nullptr;
+  }
+  for (int i = 0; i < BUFCACHE_NBUF; ++i) {
+    Buf* b = &bufs_[i];
+    b->blkid_ = 0;
+    b->valid_ = false;
+    b->dirty_ = false;
+    b->pinned_ = false;
+    b->data_ = (uint8_t*) alloc_phys_page();
+    b->hash_next_ = nullptr;
+    lruPushFront(b);
+  }
+  memset(&stats_, 0, sizeof(stats_));
+  busy_ = 0;
+  last_flush_tick_ = getTick();
+  initialized_ = true;
+}
+
+Buf* BufCache::lookup(uint32_t blkid) {
+  for (Buf* b = buckets_[bucketIdx(blkid)]; b; b = b->hash_next_) {
+    if (b->blkid_ == blkid) {
+      assert(b->valid_);
+      return b;
+    }
+  }
+  return nullptr;
+}
+
+void BufCache::hashInsert(Buf* b) {
+  assert(b->valid_);
+  Buf*& head = buckets_[bucketIdx(b->blkid_)];
+  b->hash_next_ = head;
+  head = b;
+}
+
+void BufCache::hashRemove(Buf* b) {
+  Buf** pnext = &buckets_[bucketIdx(b->blkid_)];
+  while (*pnext != b) {
+    assert(*pnext && "buffer not found in the hash chain");
+    pnext = &(*pnext)->hash_next_;
+  }
+  *pnext = b->hash_next_;
+  b->hash_next_ = nullptr;
+}
+
+void BufCache::lruRemove(Buf* b) {
+  if (b->lru_prev_) {
+    b->lru_prev_->lru_next_ = b->lru_next_;
+  } else {
+    lru_head_ = b->lru_next_;
+  }
+  if (b->lru_next_) {
+    b->lru_next_->lru_prev_ = b->lru_prev_;
+  } else {
+    lru_tail_ = b->lru_prev_;
+  }
+  b->lru_prev_ = b->lru_next_ = nullptr;
+}
+
+void BufCache::lruPushFront(Buf* b) {
+  b->lru_prev_ = nullptr;
+  b->lru_next_ = lru_head_;
+  if (lru_head_) {
+    lru_head_->lru_prev_ = b;
+  } else {
+    lru_tail_ = b;
+  }
+  lru_head_ = b;
+}
+
+void BufCache::writeback(Buf* b) {
+  assert(b->valid_ && b->dirty_);
+  SimFs::get().writeBlockToDev(b->blkid_, b->data_);
+  b->dirty_ = false;
+  ++stats_.writebacks;
+}
+
+Buf* BufCache::reclaim() {
+  Buf* b = lru_tail_;
+  while (b && b->pinned_) {
+    b = b->lru_prev_;
+  }
+  if (!b) {
+    // all buffers are pinned by the journal
+    return nullptr;
+  }
+  if (b->valid_) {
+    if (b->dirty_) {
+      writeback(b);
+    }
+    hashRemove(b);
+    b->valid_ = false;
+    ++stats_.evictions;
+  }
+  return b;
+}
+
+void BufCache::install(Buf* b, uint32_t blkid) {
+  b->blkid_ = blkid;
+  b->valid_ = true;
+  b->dirty_ = false;
+  b->pinned_ = false;
+  hashInsert(b);
+  lruRemove(b);
+  lruPushFront(b);
+}
+
+void BufCache::read(uint32_t blkid, uint8_t* buf) {
+  read(blkid, buf, 0, BLOCK_SIZE);
+}
+
+void BufCache::read(uint32_t blkid, uint8_t* buf, int off, int len) {
+  assert(initialized_);
+  assert(off >= 0 && len > 0 && off + len <= BLOCK_SIZE);
+  ++busy_;
+  Buf* b = lookup(blkid);
+  if (b) {
+    ++stats_.hits;
+    lruRemove(b);
+    lruPushFront(b);
+  } else {
+    ++stats_.misses;
+    b = reclaim();
+    if (!b) {
+      // the block is not cached so the device has the latest content
+      SimFs::get().readBlockFromDev(blkid, io_buf);
+      memmove(buf, io_buf + off, len);
+      --busy_;
+      return;
+    }
+    SimFs::get().readBlockFromDev(blkid, b->data_);
+    install(b, blkid);
+  }
+  memmove(buf, b->data_ + off, len);
+  --busy_;
+}
+
+void BufCache::readahead(uint32_t blkid, int n) {
+  assert(initialized_);
+  assert(n > 0);
+  // don't let a single readahead flush the whole cache
+  n = min(n, BUFCACHE_MAX_READAHEAD);
+  ++busy_;
+  uint32_t end = blkid + n;
+  uint32_t b = blkid;
+  while (b < end) {
+    if (lookup(b)) {
+      ++b;
+      continue;
+    }
+    // a run of blocks not cached yet
+    int cnt = 1;
+    while (b + cnt < end && cnt < BUFCACHE_MAX_IO_BLOCKS && !lookup(b + cnt)) {
+      ++cnt;
+    }
+    SimFs::get().readBlocksFromDev(b, cnt, io_buf);
+    for (int i = 0; i < cnt; ++i) {
+      Buf* buf = reclaim();
+      if (!buf) {
+        // no room. Readahead is only a hint.
+        --busy_;
+        return;
+      }
+      memmove(buf->data_, io_buf + i * BLOCK_SIZE, BLOCK_SIZE);
+      install(buf, b + i);
+    }
+    stats_.readahead_blocks += cnt;
+    ++stats_.readahead_cmds;
+    b += cnt;
+  }
+  --busy_;
+}
+
+void BufCache::readRun(uint32_t blkid, int n, uint8_t* buf) {
+  assert(initialized_);
+  assert(n > 0);
+  int max_cnt = SimFs::get().maxDevIOBlocks();
+  ++busy_;
+  int i = 0;
+  while (i < n) {
+    if (lookup(blkid + i)) {
+      // the cached copy may be newer than the device
+      read(blkid + i, buf + i * BLOCK_SIZE);
+      ++i;
+      continue;
+    }
+    // a run of blocks not cached
+    int cnt = 1;
+    while (i + cnt < n && cnt < max_cnt && !lookup(blkid + i + cnt)) {
+      ++cnt;
+    }
+    SimFs::get().readBlocksFromDev(blkid + i, cnt, buf + i * BLOCK_SIZE);
+    stats_.direct_read_blocks += cnt;
+    ++stats_.direct_read_cmds;
+    i += cnt;
+  }
+  --busy_;
+}
+
+int BufCache::write(uint32_t blkid, const uint8_t* buf) {
+  assert(initialized_);
+  ++busy_;
+  Buf* b = lookup(blkid);
+  if (b) {
+    ++stats_.hits;
+    lruRemove(b);
+    lruPushFront(b);
+  } else {
+    // the whole block is overriden. No need to read it from the device first.
+    ++stats_.misses;
+    b = reclaim();
+    if (!b) {
+      SimFs::get().writeBlockToDev(blkid, buf);
+      --busy_;
+      return -1;
+    }
+    install(b, blkid);
+  }
+  memmove(b->data_, buf, BLOCK_SIZE);
+  b->dirty_ = true;
+  --busy_;
+  return 0;
+}
+
+void BufCache::writeRun(uint32_t blkid, int n, const uint8_t* buf) {
+  assert(n > 0);
+  if (n < BUFCACHE_WRITE_THROUGH_MIN_BLOCKS) {
+    for (int i = 0; i < n; ++i) {
+      write(blkid + i, buf + i * BLOCK_SIZE);
+    }
+    return;
+  }
+  assert(initialized_);
+  int max_cnt = SimFs::get().maxDevIOBlocks();
+  ++busy_;
+  while (n > 0) {
+    int cnt = min(n, max_cnt);
+    SimFs::get().writeBlocksToDev(blkid, cnt, buf);
+    for (int i = 0; i < cnt; ++i) {
+      // keep a cached copy consistent with the device
+      Buf* b = lookup(blkid + i);
+      if (b) {
+        memmove(b->data_, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+        b->dirty_ = false;
+      }
+    }
+    stats_.writethrough_blocks += cnt;
+    ++stats_.writethrough_cmds;
+    blkid += cnt;
+    buf += cnt * BLOCK_SIZE;
+    n -= cnt;
+  }
+  --busy_;
+}
+
+void BufCache::sync() {
+  if (!initialized_) {
+    return;
+  }
+  ++busy_;
+  // write the dirty blocks in ascending order so that the device sees
+  // sequential runs. Physically contiguous blocks go out in a single command.
+  static uint32_t blkids[BUFCACHE_NBUF];
+  int n = 0;
+  for (int i = 0; i < BUFCACHE_NBUF; ++i) {
+    Buf* b = &bufs_[i];
+    if (b->valid_ && b->dirty_ && !b->pinned_) {
+      blkids[n++] = b->blkid_;
+    }
+  }
+  sort(blkids, blkids + n);
+  for (int i = 0; i < n; ) {
+    int cnt = 1;
+    while (i + cnt < n && cnt < BUFCACHE_MAX_IO_BLOCKS && blkids[i + cnt] == blkids[i] + cnt) {
+      ++cnt;
+    }
+    for (int j = 0; j < cnt; ++j) {
+      Buf* b = lookup(blkids[i + j]);
+      memmove(io_buf + j * BLOCK_SIZE, b->data_, BLOCK_SIZE);
+      b->dirty_ = false;
+    }
+    SimFs::get().writeBlocksToDev(blkids[i], cnt, io_buf);
+    stats_.writebacks += cnt;
+    stats_.sync_blocks += cnt;
+    ++stats_.sync_cmds;
+    i += cnt;
+  }
+  last_flush_tick_ = getTick();
+  --busy_;
+}
+
+bool BufCache::pinned(uint32_t blkid) {
+  Buf* b = lookup(blkid);
+  assert(b);
+  return b->pinned_;
+}
+
+void BufCache::pin(uint32_t blkid) {
+  Buf* b = lookup(blkid);
+  assert(b);
+  b->pinned_ = true;
+}
+
+void BufCache::copyOut(uint32_t blkid, uint8_t* buf) {
+  Buf* b = lookup(blkid);
+  assert(b);
+  memmove(buf, b->data_, BLOCK_SIZE);
+}
+
+void BufCache::checkpoint(uint32_t blkid) {
+  ++busy_;
+  Buf* b = lookup(blkid);
+  assert(b && b->pinned_);
+  b->pinned_ = false;
+  if (b->dirty_) {
+    writeback(b);
+  }
+  --busy_;
+}
+
+void BufCache::timerTick() {
+  auto& fs = SimFs::get();
+  if (!initialized_ || busy_ || fs.devBusy() || fs.journal().inTransaction()) {
+    return;
+  }
+  if (getTick() - last_flush_tick_ < BUFCACHE_FLUSH_INTERVAL_TICKS) {
+    return;
+  }
+  // commit the journal as well
+  fs.sync();
+}
+
+void bufcache_timer_tick() {
+  SimFs::get().bufCache().timerTick();
+}
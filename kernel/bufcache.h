@@ -0,0 +1,157 @@
+#pragma once
+
+/*
+ * A write-back buffer cache for filesystem blocks.
+ *
+ * Buffers are keyed by physical block id. Lookup goes through a hash table
+ * with chaining; buffers not in use are reclaimed following the LRU order.
+ * A write only updates the cached copy and marks it dirty. Dirty buffers are
+ * written back to the device when:
+ * 1. the buffer is evicted
+ * 2. the periodic flush triggered by the timer interrupt runs
+ * 3. someone calls sync explicitly.
+ * Buffers pinned by the journal are never written back. They go to the
+ * device when the journal commits them (check kernel/journal.h).
+ *
+ * Each buffer owns a physical page, so the device can DMA into it directly.
+ *
+ * readahead() fetches a run of physically contiguous blocks with a single
+ * device command into a staging buffer and distributes the content to
+ * individual buffers. Similarly writeRun() writes a long run of blocks to the
+ * device directly with a single command rather than dirtying a buffer for
+ * each block.
+ *
+ * readRun() and writeRun() transfer between the device and the caller's
+ * buffer directly. The buffer may be in user space and need not be
+ * physically contiguous.
+ */
+
+#include <stdint.h>
+
+#define BUFCACHE_NBUF 256
+// must be a power of 2
+#define BUFCACHE_NBUCKET 128
+// 1 tick == 10 ms. Flush dirty buffers every 5 seconds
+#define BUFCACHE_FLUSH_INTERVAL_TICKS 500
+// max number of blocks per device command issued by readahead
+#define BUFCACHE_MAX_IO_BLOCKS 16
+// max number of blocks a single readahead call can bring in
+#define BUFCACHE_MAX_READAHEAD (BUFCACHE_NBUF / 4)
+// writeRun bypasses the cache for runs of at least this many blocks
+#define BUFCACHE_WRITE_THROUGH_MIN_BLOCKS 4
+
+struct BufCacheStats {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t writebacks; // number of dirty blocks written back to the device
+  uint32_t evictions;
+  uint32_t readahead_blocks; // number of blocks brought in by readahead
+  uint32_t readahead_cmds; // number of device commands issued by readahead
+  uint32_t writethrough_blocks; // number of blocks written directly by writeRun
+  uint32_t writethrough_cmds; // number of device commands issued by writeRun
+  uint32_t direct_read_blocks; // number of blocks read by readRun bypassing the cache
+  uint32_t direct_read_cmds; // number of device commands issued by readRun
+  uint32_t sync_blocks; // number of blocks written back by sync
+  uint32_t sync_cmds; // number of device commands issued by sync
+
+  void print() const;
+};
+
+class Buf {
+ public:
+  uint32_t blkid_;
+  bool valid_; // blkid_ and data_ are meaningful
+  bool dirty_;
+  bool pinned_; // part of an uncommitted journal group
+  uint8_t* data_; // a physical page
+
+  Buf* hash_next_;
+  // LRU list. The head is the most recently used buffer.
+  Buf* lru_prev_;
+  Buf* lru_next_;
+};
+
+class BufCache {
+ public:
+  void init();
+
+  // the blkid here is a physical block id
+  void read(uint32_t blkid, uint8_t* buf);
+  // copy [off, off + len) of the block to buf
+  void read(uint32_t blkid, uint8_t* buf, int off, int len);
+  // return -1 if all buffers are pinned by the journal and the block is not
+  // cached. The block is written to the device right away in that case.
+  int write(uint32_t blkid, const uint8_t* buf);
+
+  // bring the blocks [blkid, blkid + n) into the cache if they are not cached
+  // yet. Each run of missing blocks is read with as few device commands as
+  // possible.
+  void readahead(uint32_t blkid, int n);
+
+  // read n blocks [blkid, blkid + n) into buf. Cached blocks are copied from
+  // the cache. Runs of blocks not cached are read from the device with as
+  // few commands as possible and are not added to the cache.
+  void readRun(uint32_t blkid, int n, uint8_t* buf);
+
+  // write n blocks [blkid, blkid + n) from buf. A run shorter than
+  // BUFCACHE_WRITE_THROUGH_MIN_BLOCKS goes through the cache like write().
+  // Otherwise it's written to the device right away with as few commands as
+  // possible; the cached copies are updated and become clean.
+  void writeRun(uint32_t blkid, int n, const uint8_t* buf);
+
+  // write back all dirty buffers except the pinned ones in ascending block
+  // order. Runs of contiguous blocks are written with as few device commands
+  // as possible.
+  void sync();
+
+  // the following are used by the journal. The block must be cached.
+  bool pinned(uint32_t blkid);
+  void pin(uint32_t blkid);
+  // copy the cached content out
+  void copyOut(uint32_t blkid, uint8_t* buf);
+  // unpin the buffer and write it back if it's dirty
+  void checkpoint(uint32_t blkid);
+
+  // called for each timer interrupt
+  void timerTick();
+  // an operation is in progress. Check busy_
+  bool busy() const {
+    return busy_ > 0;
+  }
+
+  const BufCacheStats& stats() const {
+    return stats_;
+  }
+ private:
+  Buf* lookup(uint32_t blkid);
+  // return a buffer not associated with any block id. Evict the least
+  // recently used one that is not pinned if needed. Return nullptr if all
+  // buffers are pinned.
+  Buf* reclaim();
+  void writeback(Buf* b);
+  // associate a reclaimed buffer with blkid and make it the most recently used
+  void install(Buf* b, uint32_t blkid);
+
+  void hashInsert(Buf* b);
+  void hashRemove(Buf* b);
+  void lruRemove(Buf* b);
+  void lruPushFront(Buf* b);
+  static uint32_t bucketIdx(uint32_t blkid) {
+    return blkid & (BUFCACHE_NBUCKET - 1);
+  }
+
+  Buf bufs_[BUFCACHE_NBUF];
+  Buf* buckets_[BUFCACHE_NBUCKET];
+  Buf* lru_head_;
+  Buf* lru_tail_;
+  bool initialized_ = false;
+  // non-zero when a cache operation is in progress. The timer interrupt can
+  // arrive in the middle of an operation if it's triggered from kshell which
+  // runs with interrupt enabled. Skip the periodic flush in that case.
+  int busy_ = 0;
+  int64_t last_flush_tick_ = 0;
+  BufCacheStats stats_;
+};
+
+// called by the timer interrupt handler
+void bufcache_timer_tick();
@@ -0,0 +1,206 @@
+#include <kernel/dcache.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+DentryCache DentryCache::instance_;
+
+void DentryCacheStats::print() const {
+  printf("Dentry cache: %d hits, %d negative hits, %d misses, %d evictions\n",
+    hits, negative_hits, misses, evictions);
+}
+
+void DentryCache::init() {
+  lru_head_ = lru_tail_ = nullptr;
+  for (int i = 0; i < DCACHE_NBUCKET; ++i) {
+    buckets_[i] = nullptr;
+  }
+  for (int i = 0; i < DCACHE_NENTRY; ++i) {
+    Dentry* d = &dentries_[i];
+    d->inuse_ = false;
+    d->parent_ = nullptr;
+    d->inode_ = nullptr;
+    d->nchild_ = 0;
+    d->hash_next_ = nullptr;
+    d->lru_prev_ = d->lru_next_ = nullptr;
+    // the root is not in the LRU list so it's never reclaimed
+    if (i > 0) {
+      lruPushFront(d);
+    }
+  }
+  Dentry* r = root();
+  r->inuse_ = true;
+  r->inode_ = InodeTable::get().root();
+  r->namelen_ = 0;
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+uint32_t DentryCache::hash(Dentry* parent, const char* name, int len) {
+  // FNV-1a
+  uint32_t h = 2166136261U ^ (uint32_t) (parent - dentries_);
+  for (int i = 0; i < len; ++i) {
+    h ^= (uint8_t) name[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+Dentry* DentryCache::lookup(Dentry* parent, const char* name, int len) {
+  uint32_t h = hash(parent, name, len);
+  for (Dentry* d = buckets_[h & (DCACHE_NBUCKET - 1)]; d; d = d->hash_next_) {
+    if (d->hash_ == h && d->parent_ == parent && d->namelen_ == len
+        && !strncmp(d->name_, name, len)) {
+      if (d->negative()) {
+        ++stats_.negative_hits;
+      } else {
+        ++stats_.hits;
+      }
+      lruRemove(d);
+      lruPushFront(d);
+      return d;
+    }
+  }
+  ++stats_.misses;
+  return nullptr;
+}
+
+Dentry* DentryCache::add(Dentry* parent, const char* name, int len, Inode* ino) {
+  assert(parent && !parent->negative() && parent->inode_->dirent_.isdir());
+  assert(len > 0 && len < NAME_BUF_SIZE);
+
+  uint32_t h = hash(parent, name, len);
+  Dentry* d = nullptr;
+  for (d = buckets_[h & (DCACHE_NBUCKET - 1)]; d; d = d->hash_next_) {
+    if (d->hash_ == h && d->parent_ == parent && d->namelen_ == len
+        && !strncmp(d->name_, name, len)) {
+      break;
+    }
+  }
+  if (ino) {
+    ino->incref();
+  }
+  if (d) {
+    // refresh an existing dentry
+    if (d->inode_ != ino) {
+      pruneChildren(d);
+    }
+    // ino has been increfed above so this does not free it even if it's
+    // the same inode
+    if (d->inode_) {
+      d->inode_->decref();
+    }
+  } else {
+    // pin the parent first so reclaim does not pick it
+    ++parent->nchild_;
+    d = reclaim();
+    d->inuse_ = true;
+    d->parent_ = parent;
+    d->namelen_ = len;
+    d->hash_ = h;
+    d->nchild_ = 0;
+    d->inode_ = nullptr;
+    memmove(d->name_, name, len);
+    d->name_[len] = '\0';
+    Dentry*& head = buckets_[h & (DCACHE_NBUCKET - 1)];
+    d->hash_next_ = head;
+    head = d;
+  }
+  d->inode_ = ino;
+  lruRemove(d);
+  lruPushFront(d);
+  return d;
+}
+
+void DentryCache::makeNegative(Dentry* d) {
+  assert(d != root());
+  pruneChildren(d);
+  if (d->inode_) {
+    d->inode_->decref();
+    d->inode_ = nullptr;
+  }
+}
+
+void DentryCache::pruneChildren(Dentry* d) {
+  for (int i = 1; d->nchild_ > 0 && i < DCACHE_NENTRY; ++i) {
+    Dentry* child = &dentries_[i];
+    if (child->inuse_ && child->parent_ == d) {
+      pruneChildren(child);
+      release(child);
+    }
+  }
+  assert(d->nchild_ == 0);
+}
+
+// the dentry must not have any children
+void DentryCache::release(Dentry* d) {
+  assert(d->inuse_ && d->nchild_ == 0 && d != root());
+  hashRemove(d);
+  if (d->inode_) {
+    d->inode_->decref();
+    d->inode_ = nullptr;
+  }
+  --d->parent_->nchild_;
+  d->parent_ = nullptr;
+  d->inuse_ = false;
+  // make it the first candidate for reuse
+  lruRemove(d);
+  d->lru_prev_ = lru_tail_;
+  d->lru_next_ = nullptr;
+  if (lru_tail_) {
+    lru_tail_->lru_next_ = d;
+  } else {
+    lru_head_ = d;
+  }
+  lru_tail_ = d;
+}
+
+// Return an unused dentry. Evict the least recently used dentry without
+// children if needed. Such a dentry always exists since the cached dentries
+// form a tree.
+Dentry* DentryCache::reclaim() {
+  Dentry* d = lru_tail_;
+  while (d && d->inuse_ && d->nchild_ > 0) {
+    d = d->lru_prev_;
+  }
+  assert(d && "no dentry can be reclaimed");
+  if (d->inuse_) {
+    release(d);
+    ++stats_.evictions;
+  }
+  return d;
+}
+
+void DentryCache::hashRemove(Dentry* d) {
+  Dentry** pnext = &buckets_[d->hash_ & (DCACHE_NBUCKET - 1)];
+  while (*pnext != d) {
+    assert(*pnext && "dentry not found in the hash chain");
+    pnext = &(*pnext)->hash_next_;
+  }
+  *pnext = d->hash_next_;
+  d->hash_next_ = nullptr;
+}
+
+void DentryCache::lruRemove(Dentry* d) {
+  if (d->lru_prev_) {
+    d->lru_prev_->lru_next_ = d->lru_next_;
+  } else {
+    lru_head_ = d->lru_next_;
+  }
+  if (d->lru_next_) {
+    d->lru_next_->lru_prev_ = d->lru_prev_;
+  } else {
+    lru_tail_ = d->lru_prev_;
+  }
+  d->lru_prev_ = d->lru_next_ = nullptr;
+}
+
+void DentryCache::lruPushFront(Dentry* d) {
+  d->lru_prev_ = nullptr;
+  d->lru_next_ = lru_head_;
+  if (lru_head_) {
+    lru_head_->lru_prev_ = d;
+  } else {
+    lru_tail_ = d;
+  }
+  lru_head_ = d;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+/*
+ * An in-memory dentry cache for SimFs::walkPath.
+ *
+ * A dentry maps (parent dentry, name) to the inode of the child. The inode
+ * knows where the DirEnt is on disk, so flushing a DirEnt does not need to
+ * search the parent directory again. A positive dentry holds a reference to
+ * its inode.
+ *
+ * Lookups that fail are cached as negative dentries so repeatedly probing a
+ * path that does not exist (e.g. searching for an executable) does not scan
+ * the directory each time.
+ *
+ * Dentries form a tree rooted at the root directory. A dentry is only evicted
+ * when no cached child refers to it, so the parent pointer of a cached dentry
+ * is always valid.
+ *
+ * The cache must be kept in sync by the code changing directories on disk:
+ * - SimFs::createFile/mkdir add (or turn a negative dentry into) a positive
+ *   one
+ * - SimFs::removeDirEnt turns the removed entry negative.
+ */
+
+#include <kernel/simfs.h>
+#include <kernel/inode.h>
+
+#define DCACHE_NENTRY 512
+// must be a power of 2
+#define DCACHE_NBUCKET 256
+
+struct DentryCacheStats {
+  uint32_t hits;
+  uint32_t negative_hits;
+  uint32_t misses;
+  uint32_t evictions;
+
+  void print() const;
+};
+
+class Dentry {
+ public:
+  bool negative() const {
+    return !inode_;
+  }
+
+  // nullptr for the root directory
+  Dentry* parent_;
+  // nullptr for a negative dentry
+  Inode* inode_;
+ private:
+  bool inuse_;
+  char name_[NAME_BUF_SIZE];
+  int namelen_;
+  uint32_t hash_;
+  // number of cached children referring to this dentry
+  int nchild_;
+
+  Dentry* hash_next_;
+  // LRU list. The head is the most recently used dentry.
+  Dentry* lru_prev_;
+  Dentry* lru_next_;
+
+  friend class DentryCache;
+};
+
+class DentryCache {
+ public:
+  static DentryCache& get() {
+    return instance_;
+  }
+
+  void init();
+
+  Dentry* root() {
+    return &dentries_[0];
+  }
+
+  // return nullptr if (parent, name) is not cached.
+  Dentry* lookup(Dentry* parent, const char* name, int len);
+
+  // cache the child named name under parent. ino can be nullptr to cache a
+  // negative entry. The dentry takes its own reference to ino. Return the
+  // cached dentry.
+  Dentry* add(Dentry* parent, const char* name, int len, Inode* ino);
+
+  // turn the dentry into a negative one. Cached children are dropped and
+  // the reference to the inode is released.
+  void makeNegative(Dentry* d);
+
+  const DentryCacheStats& stats() const {
+    return stats_;
+  }
+ private:
+  // drop all the cached children of d
+  void pruneChildren(Dentry* d);
+  void release(Dentry* d);
+  Dentry* reclaim();
+
+  void hashRemove(Dentry* d);
+  void lruRemove(Dentry* d);
+  void lruPushFront(Dentry* d);
+  uint32_t hash(Dentry* parent, const char* name, int len);
+
+  static DentryCache instance_;
+
+  // dentries_[0] is the root and never evicted
+  Dentry dentries_[DCACHE_NENTRY];
+  Dentry* buckets_[DCACHE_NBUCKET];
+  Dentry* lru_head_;
+  Dentry* lru_tail_;
+  DentryCacheStats stats_;
+};
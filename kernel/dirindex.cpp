@@ -0,0 +1,286 @@
+/*
+ * Hashed directory index (htree like) for large directories.
+ *
+ * On SB_FLAG_DIRINDEX images a directory gets an index once it has
+ * DIRINDEX_MIN_NCHILD entries. The entries themselves stay where they are,
+ * so a plain scan of the directory (e.g. readdir) does not care about the
+ * index. The index lives in blocks outside of the directory content:
+ * - the root block (DirEnt::index_blk) maps the low bits of the name hash to
+ *   a chain of leaf blocks
+ * - a leaf block holds (hash, entry index) pairs.
+ *
+ * The number of buckets is picked so that leaves start about half full. When
+ * the leaves become 3/4 full on average, one more bucket is split for each
+ * new entry (linear hashing) so the chains stay at a single leaf. Bucket
+ * nsplit is split into itself and bucket nsplit + nbucket by the next bit of
+ * the hash; nbucket doubles once all of the buckets are split. Unlike
+ * rebuilding the whole index, a split only touches a couple of chains, so the
+ * journal transaction of a single insert stays small.
+ *
+ * Within a chain, leaves before the last non-empty one are always full: new
+ * slots go to the first leaf with room and a removed slot is filled with the
+ * last slot of the chain. Empty leaves are kept until the bucket is split or
+ * the index is freed.
+ *
+ * A lookup reads the root block, usually a single leaf and the block holding
+ * the entry. The root of a busy directory stays in the buffer cache.
+ */
+#include <kernel/simfs.h>
+#include <assert.h>
+#include <string.h>
+
+uint32_t DirEnt::nameHash(const char* name, int len) {
+  // FNV-1a
+  uint32_t h = 2166136261U;
+  for (int i = 0; i < len; ++i) {
+    h ^= (uint8_t) name[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static uint32_t bucketOf(const DirIndexRoot& root, uint32_t h) {
+  uint32_t b = h & (root.nbucket - 1);
+  if (b < root.nsplit) {
+    b = h & (root.nbucket * 2 - 1);
+  }
+  return b;
+}
+
+// return the first leaf of the chain for hash h
+static uint32_t chainHead(uint32_t index_blk, uint32_t h) {
+  DirIndexRoot root;
+  SimFs::get().readBlock(index_blk, (uint8_t*) &root);
+  return root.leaves[bucketOf(root, h)];
+}
+
+static uint32_t allocIndexBlock(uint32_t goal) {
+  uint8_t buf[BLOCK_SIZE];
+  memset(buf, 0, sizeof(buf));
+  uint32_t blkid = SimFs::get().allocPhysBlk(goal);
+  SimFs::get().writeBlock(blkid, buf);
+  return blkid;
+}
+
+int DirEnt::indexLookup(const char* name, int len, DirEnt* pent) const {
+  assert(index_blk);
+  uint32_t h = nameHash(name, len);
+  DirIndexLeaf leaf;
+  for (uint32_t blk = chainHead(index_blk, h); blk; blk = leaf.next) {
+    SimFs::get().readBlock(blk, (uint8_t*) &leaf);
+    for (int i = 0; i < leaf.nslot; ++i) {
+      if (leaf.slots[i].hash != h) {
+        continue;
+      }
+      int idx = leaf.slots[i].idx;
+      DirEnt ent = getEntByIdx(idx);
+      if (!strncmp(ent.name, name, len) && ent.name[len] == '\0') {
+        *pent = ent;
+        return idx;
+      }
+    }
+  }
+  return -1;
+}
+
+void DirEnt::indexAdd(const char* name, int len, int idx) {
+  assert(index_blk);
+  DirIndexRoot root;
+  SimFs::get().readBlock(index_blk, (uint8_t*) &root);
+  uint32_t nbucket = root.nbucket + root.nsplit;
+  if (nbucket < DIRINDEX_MAX_NBUCKET
+      && nchild() > nbucket * N_DIRINDEX_SLOT_PER_BLOCK * 3 / 4) {
+    indexSplit(root);
+  }
+  indexInsert(name, len, idx);
+}
+
+// append slots to a new chain of leaves
+class LeafChainWriter {
+ public:
+  explicit LeafChainWriter(uint32_t goal) : goal_(goal) {
+  }
+
+  void append(const DirIndexSlot& slot) {
+    if (!blk_ || leaf_.nslot == N_DIRINDEX_SLOT_PER_BLOCK) {
+      uint32_t blk = SimFs::get().allocPhysBlk(goal_);
+      if (blk_) {
+        leaf_.next = blk;
+        SimFs::get().writeBlock(blk_, (const uint8_t*) &leaf_);
+      } else {
+        head_ = blk;
+      }
+      blk_ = blk;
+      memset(&leaf_, 0, sizeof(leaf_));
+    }
+    leaf_.slots[leaf_.nslot++] = slot;
+  }
+
+  // write the last leaf and return the first one. 0 if nothing is appended.
+  uint32_t finish() {
+    if (blk_) {
+      SimFs::get().writeBlock(blk_, (const uint8_t*) &leaf_);
+    }
+    return head_;
+  }
+ private:
+  uint32_t goal_;
+  uint32_t head_ = 0;
+  uint32_t blk_ = 0;
+  DirIndexLeaf leaf_;
+};
+
+void DirEnt::indexSplit(DirIndexRoot& root) {
+  uint32_t b = root.nsplit;
+  // the slots are copied to two new chains rather than moved around in the
+  // old one, so both chains start compact
+  LeafChainWriter lo(index_blk), hi(index_blk);
+  DirIndexLeaf leaf;
+  for (uint32_t blk = root.leaves[b]; blk; blk = leaf.next) {
+    SimFs::get().readBlock(blk, (uint8_t*) &leaf);
+    for (int i = 0; i < leaf.nslot; ++i) {
+      if (leaf.slots[i].hash & root.nbucket) {
+        hi.append(leaf.slots[i]);
+      } else {
+        lo.append(leaf.slots[i]);
+      }
+    }
+    SimFs::get().freePhysBlk(blk);
+  }
+  root.leaves[b] = lo.finish();
+  root.leaves[b + root.nbucket] = hi.finish();
+  if (++root.nsplit == root.nbucket) {
+    root.nbucket *= 2;
+    root.nsplit = 0;
+  }
+  SimFs::get().writeBlock(index_blk, (const uint8_t*) &root);
+  SimFs::get().flushBitmap();
+}
+
+void DirEnt::indexInsert(const char* name, int len, int idx) {
+  uint32_t h = nameHash(name, len);
+  DirIndexLeaf leaf;
+  uint32_t blk = chainHead(index_blk, h);
+  if (!blk) {
+    blk = allocIndexBlock(index_blk);
+    DirIndexRoot root;
+    SimFs::get().readBlock(index_blk, (uint8_t*) &root);
+    root.leaves[bucketOf(root, h)] = blk;
+    SimFs::get().writeBlock(index_blk, (const uint8_t*) &root);
+  }
+  // find the first leaf with room
+  while (true) {
+    SimFs::get().readBlock(blk, (uint8_t*) &leaf);
+    if (leaf.nslot < N_DIRINDEX_SLOT_PER_BLOCK) {
+      break;
+    }
+    if (!leaf.next) {
+      // chain a new leaf
+      leaf.next = allocIndexBlock(blk);
+      SimFs::get().writeBlock(blk, (const uint8_t*) &leaf);
+    }
+    blk = leaf.next;
+  }
+  leaf.slots[leaf.nslot++] = DirIndexSlot{h, (uint32_t) idx};
+  SimFs::get().writeBlock(blk, (const uint8_t*) &leaf);
+  SimFs::get().flushBitmap();
+}
+
+void DirEnt::indexRemove(const char* name, int len, int idx) {
+  assert(index_blk);
+  uint32_t h = nameHash(name, len);
+  uint32_t head = chainHead(index_blk, h);
+  DirIndexLeaf leaf;
+
+  // locate the slot to remove
+  uint32_t found_blk = 0;
+  int found_i = -1;
+  for (uint32_t blk = head; blk && !found_blk; blk = leaf.next) {
+    SimFs::get().readBlock(blk, (uint8_t*) &leaf);
+    for (int i = 0; i < leaf.nslot; ++i) {
+      if (leaf.slots[i].hash == h && leaf.slots[i].idx == idx) {
+        found_blk = blk;
+        found_i = i;
+        break;
+      }
+    }
+  }
+  assert(found_blk && "entry not found in the directory index");
+
+  // take the last slot of the chain
+  uint32_t last_blk = found_blk;
+  for (uint32_t blk = found_blk; blk; blk = leaf.next) {
+    SimFs::get().readBlock(blk, (uint8_t*) &leaf);
+    if (leaf.nslot == 0) {
+      break;
+    }
+    last_blk = blk;
+  }
+  SimFs::get().readBlock(last_blk, (uint8_t*) &leaf);
+  DirIndexSlot moved = leaf.slots[--leaf.nslot];
+  if (last_blk == found_blk) {
+    if (found_i < leaf.nslot) {
+      leaf.slots[found_i] = moved;
+    }
+    SimFs::get().writeBlock(last_blk, (const uint8_t*) &leaf);
+    return;
+  }
+  SimFs::get().writeBlock(last_blk, (const uint8_t*) &leaf);
+  SimFs::get().readBlock(found_blk, (uint8_t*) &leaf);
+  leaf.slots[found_i] = moved;
+  SimFs::get().writeBlock(found_blk, (const uint8_t*) &leaf);
+}
+
+void DirEnt::indexMove(const char* name, int len, int oldidx, int newidx) {
+  assert(index_blk);
+  uint32_t h = nameHash(name, len);
+  DirIndexLeaf leaf;
+  for (uint32_t blk = chainHead(index_blk, h); blk; blk = leaf.next) {
+    SimFs::get().readBlock(blk, (uint8_t*) &leaf);
+    for (int i = 0; i < leaf.nslot; ++i) {
+      if (leaf.slots[i].hash == h && leaf.slots[i].idx == oldidx) {
+        leaf.slots[i].idx = newidx;
+        SimFs::get().writeBlock(blk, (const uint8_t*) &leaf);
+        return;
+      }
+    }
+  }
+  assert(false && "entry not found in the directory index");
+}
+
+void DirEnt::buildIndex() {
+  assert(isdir() && !index_blk);
+  DirIndexRoot root;
+  memset(&root, 0, sizeof(root));
+  // leaves start about half full
+  root.nbucket = 1;
+  while (root.nbucket < DIRINDEX_MAX_NBUCKET
+      && nchild() > root.nbucket * N_DIRINDEX_SLOT_PER_BLOCK / 2) {
+    root.nbucket *= 2;
+  }
+  index_blk = SimFs::get().allocPhysBlk(nchild() > 0 ? logicalToPhysBlockId(0) : 0);
+  SimFs::get().writeBlock(index_blk, (const uint8_t*) &root);
+  int idx = 0;
+  for (auto curEntPtr : *this) {
+    indexInsert(curEntPtr->name, strlen(curEntPtr->name), idx);
+    ++idx;
+  }
+}
+
+void DirEnt::freeIndex() {
+  assert(index_blk);
+  DirIndexRoot root;
+  DirIndexLeaf leaf;
+  SimFs::get().readBlock(index_blk, (uint8_t*) &root);
+  for (int i = 0; i < root.nbucket + root.nsplit; ++i) {
+    uint32_t blk = root.leaves[i];
+    while (blk) {
+      SimFs::get().readBlock(blk, (uint8_t*) &leaf);
+      SimFs::get().freePhysBlk(blk);
+      blk = leaf.next;
+    }
+  }
+  SimFs::get().freePhysBlk(index_blk);
+  SimFs::get().flushBitmap();
+  index_blk = 0;
+}
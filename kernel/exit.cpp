@@ -12,6 +12,7 @@ void UserProcess::terminate(int status) {
   asm_set_cr3((uint32_t) kernel_page_dir);
 
   release_pgdir(pgdir_);
+  release_mmaps(this);
 
   // release the open file descriptors
   releaseAllFds();
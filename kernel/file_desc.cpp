@@ -2,9 +2,12 @@
 #include <kernel/phys_page.h>
 #include <kernel/keyboard.h>
 #include <kernel/simfs.h>
+#include <kernel/inode.h>
 #include <kernel/pipe.h>
+#include <kernel/idt.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #define MAX_FILE_DESC 4096
 
@@ -12,6 +15,22 @@ void setup_file_desc_freelist();
 
 FileDesc all_file_desc[MAX_FILE_DESC];
 static FileDesc* free_list;
+// the FileDescs with pending write-behind data
+static FileDesc* wb_list;
+// non-zero when a read or write is in progress. The timer interrupt can
+// arrive in the middle of one if it's triggered from kshell which runs with
+// interrupt enabled. Skip the periodic flush in that case, as well as when
+// SimFs is using the device. Check SimFs::devBusy.
+static int fd_busy;
+
+struct FdBusyScope {
+  FdBusyScope() {
+    ++fd_busy;
+  }
+  ~FdBusyScope() {
+    --fd_busy;
+  }
+};
 
 struct _Initializer {
  public:
@@ -40,89 +59,303 @@ void decref_file_desc(FileDesc* fdptr) {
   }
 }
 
-// will fail if path is too long
-int FileDesc::init(const char* path, int rwflags) {
+void FileDesc::init(Inode* inode, int rwflags) {
   fdtype_ = FD_FILE;
   refcount_ = 1;
   off_ = 0;
   flags_ = rwflags;
-  int len = strlen(path);
-  if (len > MAX_PATH_SIZE - 1) {
-    return -1;
-  }
-  strcpy(path_, path);
-  // blkbuf_ must have been reset to nullptr when the last user free the FileDesc
-  assert(blkbuf_ == nullptr);
-  return 0;
+  inode->incref();
+  inode_ = inode;
+  mapcache_.init();
+  // reading from the beginning is treated as sequential
+  ra_next_ = 0;
+  ra_end_ = 0;
+  ra_window_ = 0;
 }
 
 void FileDesc::freeme() {
   FileDesc* fdptr = this;
-  // release the physical page if any is allocated
-  if (blkbuf_) {
-    free_phys_page((phys_addr_t) blkbuf_);
-    blkbuf_ = nullptr;
+  flushWriteBehind();
+  if (wbbuf_) {
+    free_phys_page((phys_addr_t) wbbuf_);
+    wbbuf_ = nullptr;
+  }
+  mapcache_.fini();
+  if (inode_) {
+    inode_->decref();
+    inode_ = nullptr;
   }
   fdptr->next_ = free_list;
   free_list = fdptr;
 }
 
 /*
- * Invariants: when blkbuf_ is not None, blkbuf_[off_ % BLOCK_SIZE] contains
- * the next byte of data.
+ * Detect sequential reads and bring the next blocks into the buffer cache
+ * ahead of time. Physically contiguous blocks are read with a single device
+ * command.
+ */
+void FileDesc::readahead(uint32_t lb) {
+  const DirEnt& dent = inode_->dirent_;
+  if (lb != ra_next_) {
+    // random access. Start over
+    ra_window_ = 0;
+    ra_end_ = lb + 1;
+  }
+  ra_next_ = lb + 1;
+  if (lb < ra_end_) {
+    return;
+  }
+  ra_window_ = ra_window_ ? min(ra_window_ * 2, FD_RA_MAX_BLOCKS) : FD_RA_MIN_BLOCKS;
+  uint32_t nblk = (dent.file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint32_t end = min(lb + ra_window_, nblk);
+
+  // issue a readahead for each physically contiguous run
+  uint32_t start = 0;
+  int n = 0;
+  for (uint32_t l = lb; l < end; ++l) {
+    uint32_t phys_blkid = dent.logicalToPhysBlockId(l, &mapcache_);
+    if (n > 0 && phys_blkid && phys_blkid == start + n) {
+      ++n;
+      continue;
+    }
+    if (n > 0) {
+      SimFs::get().readaheadBlocks(start, n);
+    }
+    // nothing to read for a hole
+    start = phys_blkid;
+    n = phys_blkid ? 1 : 0;
+  }
+  if (n > 0) {
+    SimFs::get().readaheadBlocks(start, n);
+  }
+  ra_end_ = end;
+}
+
+/*
+ * The data is copied out of the buffer cache, which every write to the file
+ * goes through, so the FileDesc keeps no copy of its own that could go out
+ * of date.
  */
 int FileDesc::read(void *buf, int nbyte) {
   // TODO: move majority of this code to class DirEnt
   assert(nbyte > 0);
-  auto dent = SimFs::get().walkPath(path_); // TODO: should cache dent
-  assert(dent);
+  FdBusyScope fd_busy_scope;
+  flush_write_behind(inode_);
+  const DirEnt& dent = inode_->dirent_;
   uint32_t file_size = dent.file_size;
 
   int tot_read = 0; 
-  assert(off_ <= file_size);
+  if (off_ >= file_size) {
+    // lseek can move past the end
+    return 0;
+  }
+  if (dent.isInline()) {
+    // the content came with the DirEnt. No I/O needed.
+    tot_read = min(nbyte, file_size - off_);
+    memmove(buf, dent.inline_data + off_, tot_read);
+    off_ += tot_read;
+    return tot_read;
+  }
   while (tot_read < nbyte && off_ != file_size) {
-    if (!blkbuf_) {
-      blkbuf_ = (uint8_t*) alloc_phys_page();
-      uint32_t logical_blkid = off_ / BLOCK_SIZE;
-      uint32_t phys_blkid = dent.logicalToPhysBlockId(logical_blkid);
-      SimFs::get().readBlock(phys_blkid, blkbuf_);
+    int logical_blkid = off_ / BLOCK_SIZE;
+    int nwhole = min(nbyte - tot_read, file_size - off_) / BLOCK_SIZE;
+    if (off_ % BLOCK_SIZE == 0 && nwhole >= FD_DIRECT_MIN_BLOCKS) {
+      // a large request does not need readahead. The blocks that are not
+      // cached go to buf without a copy.
+      dent.readBlocks(logical_blkid, nwhole, (uint8_t*) buf + tot_read, &mapcache_);
+      tot_read += nwhole * BLOCK_SIZE;
+      off_ += nwhole * BLOCK_SIZE;
+      continue;
     }
-    assert(blkbuf_);
-
     // read content into buf_
     int tocpy = min(nbyte - tot_read, BLOCK_SIZE - off_ % BLOCK_SIZE);
-    // the content in blkbuf_ does not necessarily all be valid if the file size
-    // is not a multiple of BLOCK_SIZE. Use file_size as a cap
+    // the content of the last block does not necessarily all be valid if the
+    // file size is not a multiple of BLOCK_SIZE. Use file_size as a cap
     tocpy = min(tocpy, file_size - off_);
     assert(tocpy > 0);
-    memmove(buf + tot_read, &blkbuf_[off_ % BLOCK_SIZE], tocpy);
+    uint32_t phys_blkid = dent.logicalToPhysBlockId(logical_blkid, &mapcache_);
+    if (phys_blkid) {
+      if (ra_next_ != logical_blkid + 1) {
+        // the first read from this block
+        readahead(logical_blkid);
+      }
+      SimFs::get().readBlock(phys_blkid, (uint8_t*) buf + tot_read, tocpy, off_ % BLOCK_SIZE);
+    } else {
+      // a hole
+      memset((uint8_t*) buf + tot_read, 0, tocpy);
+    }
     tot_read += tocpy;
     off_ += tocpy;
     assert(off_ <= file_size);
-
-    // check if blkbuf_ need to be released
-    // We could alternatively read the next block
-    if (off_ % BLOCK_SIZE == 0) {
-      free_phys_page((phys_addr_t) blkbuf_);
-      blkbuf_ = nullptr;
-    }
   }
   return tot_read;
 }
 
 int FileDesc::write(const void *buf, int nbyte) {
-  auto dent = SimFs::get().walkPath(path_);
-  assert(dent);
+  if (inode_->unlinked_) {
+    // the file has been removed
+    return -1;
+  }
+  if (nbyte == 0) {
+    // nothing to write. Must not extend the file even if off_ is past the end.
+    return 0;
+  }
+  FdBusyScope fd_busy_scope;
+  if (inode_->wb_fd_ && inode_->wb_fd_ != this) {
+    // keep the appends from different FileDescs in order
+    inode_->wb_fd_->flushWriteBehind();
+  }
+  int ret = nbyte;
+  if (nbyte < BLOCK_SIZE && off_ == inode_->dirent_.file_size + wb_len_) {
+    // a small append
+    const uint8_t* src = (const uint8_t*) buf;
+    int left = nbyte;
+    while (left > 0) {
+      if (wb_len_ == 0) {
+        if (!wbbuf_) {
+          wbbuf_ = (uint8_t*) alloc_phys_page();
+        }
+        wb_off_ = off_;
+        wb_tick_ = getTick();
+        wb_next_ = wb_list;
+        wb_list = this;
+        inode_->wb_fd_ = this;
+      }
+      int n = min(left, BLOCK_SIZE - (wb_off_ + wb_len_) % BLOCK_SIZE);
+      memmove(wbbuf_ + wb_len_, src, n);
+      wb_len_ += n;
+      off_ += n;
+      src += n;
+      left -= n;
+      if ((wb_off_ + wb_len_) % BLOCK_SIZE == 0) {
+        // the block is full
+        flushWriteBehind();
+      }
+    }
+  } else {
+    flushWriteBehind();
+    ret = writeThrough(buf, nbyte);
+  }
+  return ret;
+}
+
+void FileDesc::flushWriteBehind() {
+  if (wb_len_ == 0) {
+    return;
+  }
+  FileDesc** pp = &wb_list;
+  while (*pp != this) {
+    pp = &(*pp)->wb_next_;
+  }
+  *pp = wb_next_;
+  assert(inode_->wb_fd_ == this);
+  inode_->wb_fd_ = nullptr;
+  int len = wb_len_;
+  wb_len_ = 0;
+  if (inode_->unlinked_) {
+    // the file has been removed. Drop the data.
+    return;
+  }
+  int saved_off = off_;
+  off_ = wb_off_;
+  int r = writeThrough(wbbuf_, len);
+  assert(r == len);
+  off_ = saved_off;
+}
 
-  if (off_ + nbyte > dent.file_size) {
-    dent.resize(off_ + nbyte);
-    dent.flush(path_, strlen(path_));
+void flush_write_behind(Inode* ino) {
+  if (ino->wb_fd_) {
+    ino->wb_fd_->flushWriteBehind();
   }
-  dent.write(off_, nbyte, buf);
+}
+
+void flush_all_write_behind() {
+  // flushWriteBehind unlinks the FileDesc from wb_list
+  while (wb_list) {
+    wb_list->flushWriteBehind();
+  }
+}
+
+void file_desc_timer_tick() {
+  auto& fs = SimFs::get();
+  if (fd_busy || fs.devBusy() || fs.bufCache().busy() || fs.journal().inTransaction()) {
+    return;
+  }
+  int64_t now = getTick();
+  FileDesc* next;
+  for (FileDesc* fd = wb_list; fd; fd = next) {
+    next = fd->wb_next_;
+    if (now - fd->wb_tick_ >= FD_WB_FLUSH_INTERVAL_TICKS) {
+      fd->flushWriteBehind();
+    }
+  }
+}
+
+int FileDesc::writeThrough(const void *buf, int nbyte) {
+  DirEnt& dent = inode_->dirent_;
+  if (nbyte == 0) {
+    return 0;
+  }
+
+  {
+    JournalTx tx;
+    bool dirty = false;
+    if (off_ + nbyte > dent.file_size) {
+      dent.resize(off_ + nbyte, inode_->blkid_);
+      dirty = true;
+    }
+    if (dent.isInline()) {
+      // the content is part of the DirEnt. Update both in one transaction.
+      dent.write(off_, nbyte, buf);
+      dirty = true;
+    } else if (dent.allocBlocks(off_, nbyte, inode_->blkid_, &mapcache_)) {
+      // fill the holes. Place the data near the parent directory if the file
+      // has no block before off_.
+      dirty = true;
+    }
+    if (dirty) {
+      inode_->flush();
+    }
+  }
+  if (!dent.isInline()) {
+    dent.write(off_, nbyte, buf, &mapcache_);
+  }
+  // keep the mappings of the file up to date
+  PageCache::get().update(inode_, off_, nbyte, buf);
   off_ += nbyte;
   return nbyte;
 }
 
+int FileDesc::lseek(int off, int whence) {
+  flush_write_behind(inode_);
+  const DirEnt& dent = inode_->dirent_;
+  int pos;
+  switch (whence) {
+  case SEEK_SET:
+    pos = off;
+    break;
+  case SEEK_CUR:
+    pos = off_ + off;
+    break;
+  case SEEK_END:
+    pos = dent.file_size + off;
+    break;
+  case SEEK_DATA:
+    pos = dent.seekData(off, false, &mapcache_);
+    break;
+  case SEEK_HOLE:
+    pos = dent.seekData(off, true, &mapcache_);
+    break;
+  default:
+    return -1;
+  }
+  if (pos < 0) {
+    return -1;
+  }
+  off_ = pos;
+  return pos;
+}
+
 // TODO: hack for the missing support of virtual method
 #define FILE_DESC_DISPATCH(method, ...) \
   switch (fdtype_) { \
@@ -1,9 +1,7 @@
 #pragma once
 
 #include <assert.h>
-
-// relatively small for now
-#define MAX_PATH_SIZE 256
+#include <kernel/simfs.h>
 
 // if both FD_FLAG_RD and FD_FLAG_RD are on, the file is opened for both read
 // and write.
@@ -13,6 +11,17 @@
 
 #define FD_FLAG_TRUNC 4
 
+// read-ahead window for sequential reads in blocks. The window starts at
+// FD_RA_MIN_BLOCKS and doubles each time it's consumed up to FD_RA_MAX_BLOCKS.
+#define FD_RA_MIN_BLOCKS 8 // 32KB
+#define FD_RA_MAX_BLOCKS 64 // 256KB
+// a read covering at least this many whole blocks is done with BufCache::readRun
+// rather than block by block
+#define FD_DIRECT_MIN_BLOCKS 4
+// pending appends in the write-behind buffer are flushed after this many
+// ticks (1 tick == 10 ms) even if nothing else triggers the flush
+#define FD_WB_FLUSH_INTERVAL_TICKS 100
+
 // TODO: revise once we support virtual method
 enum {
   FD_FILE,
@@ -21,6 +30,7 @@ enum {
 };
 
 class FileDesc;
+class Inode;
 
 class FileDescBase {
  public:
@@ -58,19 +68,67 @@ ConsoleFileDesc* acquire_console_file_desc();
 
 class FileDesc : public FileDescBase {
  public:
-  char path_[MAX_PATH_SIZE];
+  // the open file holds a reference to the inode
+  Inode* inode_ = nullptr;
   int off_;
-  uint8_t* blkbuf_ = nullptr;
+  // indirect blocks used to map the blocks of the file
+  BlockMapCache mapcache_;
 
-  int init(const char*path, int rwflags);
+  void init(Inode* inode, int rwflags);
 
   void freeme();
   int read(void *buf, int nbyte);
   int write(const void* buf, int nbyte);
+  // whence is one of SEEK_* in stdio.h. The offset can go past the end of the
+  // file; a write there leaves a hole. Return the new offset or -1 on error.
+  int lseek(int off, int whence);
+
+  /*
+   * Write-behind: a small write appending to the file is copied to wbbuf_
+   * rather than going to the file right away. Consecutive appends are
+   * gathered until the block containing them is full, and then written with
+   * a single resize and DirEnt update. Pending data is also flushed when the
+   * file is closed, read or seeked through any FileDesc, mapped, or after
+   * FD_WB_FLUSH_INTERVAL_TICKS.
+   *
+   * The pending bytes are not counted in the on-disk file size until they
+   * are flushed.
+   */
+  void flushWriteBehind();
+  // wbbuf_ holds the bytes for file offsets [wb_off_, wb_off_ + wb_len_).
+  // They never cross a block boundary.
+  uint8_t* wbbuf_ = nullptr;
+  int wb_off_;
+  int wb_len_ = 0;
+  int64_t wb_tick_; // when wbbuf_ got the first pending byte
 
  private:
+  // write to the file without going through the write-behind buffer
+  int writeThrough(const void* buf, int nbyte);
+  // the FileDescs with pending write-behind data are chained for the timer
+  FileDesc* wb_next_;
+  friend void file_desc_timer_tick();
+  friend void flush_all_write_behind();
+
+  // called before reading logical block lb from the device
+  void readahead(uint32_t lb);
+
+  // read-ahead state
+  uint32_t ra_next_; // the next logical block if the access is sequential
+  uint32_t ra_end_; // blocks before ra_end_ have been read ahead
+  int ra_window_; // 0 if the access is not sequential
+
   FileDesc* next_;  // used for the freelist
   friend FileDesc* alloc_file_desc();
 };
 
 FileDesc* alloc_file_desc();
+
+// flush the write-behind data pending for the inode if any. Call this before
+// looking at the size or the content of a file through other paths.
+void flush_write_behind(Inode* ino);
+// flush the write-behind data of all the files. Used by sync.
+void flush_all_write_behind();
+
+// called by the timer interrupt handler
+void file_desc_timer_tick();
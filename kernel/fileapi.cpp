@@ -1,6 +1,7 @@
 #include <kernel/fileapi.h>
 #include <kernel/user_process.h>
 #include <kernel/simfs.h>
+#include <kernel/inode.h>
 #include <kernel/keyboard.h>
 #include <assert.h>
 
@@ -12,27 +13,34 @@ int file_open(const char* path, int oflags) {
 	if (rwflags == 0) {
 		return -1; // fail
 	}
-	auto dent = SimFs::get().walkPath(path);
+	Inode* ino = SimFs::get().lookupInode(path);
   // already exist and it's not a regular file
-  if (dent && dent.ent_type != ET_FILE) {
+  if (ino && ino->dirent_.ent_type != ET_FILE) {
     // for debug
     printf("Can only open regular file but a directory found\n");
+    ino->decref();
     return -1;
   }
-  if (!dent && (oflags & FD_FLAG_WR)) {
+  if (!ino && (oflags & FD_FLAG_WR)) {
     // try to create the file
-    dent = SimFs::get().createFile(path);
+    ino = SimFs::get().createFile(path);
   }
 
-	if (!dent) {
+	if (!ino) {
 		return -1; // file does not exist for read or fail to create for write
 	}
 
-  if ((oflags & FD_FLAG_TRUNC) && dent.file_size > 0) {
-    dent.truncate();
-    dent.flush(path, strlen(path));
+  // data appended through another open file counts
+  flush_write_behind(ino);
+  if ((oflags & FD_FLAG_TRUNC) && ino->dirent_.file_size > 0) {
+    JournalTx tx;
+    ino->dirent_.truncate();
+    ino->flush();
+    PageCache::get().truncate(ino, 0);
   }
-	int fd = UserProcess::current()->allocFd(path, rwflags);
+	int fd = UserProcess::current()->allocFd(ino, rwflags);
+  // the FileDesc holds its own reference
+  ino->decref();
 	return fd;
 }
 
@@ -51,3 +59,73 @@ int file_close(int fd) {
 int file_write(int fd, const void* buf, int nbyte) {
   return UserProcess::current()->getFdptr(fd)->write(buf, nbyte);
 }
+
+int file_lseek(int fd, int off, int whence) {
+  if (fd < 0 || fd >= MAX_OPEN_FILE) {
+    return -1;
+  }
+  FileDescBase* fdptr = UserProcess::current()->filetab_[fd];
+  if (!fdptr || fdptr->fdtype_ != FD_FILE) {
+    // pipes and the console can't seek
+    return -1;
+  }
+  return ((FileDesc*) fdptr)->lseek(off, whence);
+}
+
+// TODO: only write back the blocks of the file. For now the whole file system
+// is synced which includes them.
+int file_fsync(int fd) {
+  if (fd < 0 || fd >= MAX_OPEN_FILE) {
+    return -1;
+  }
+  FileDescBase* fdptr = UserProcess::current()->filetab_[fd];
+  if (!fdptr || fdptr->fdtype_ != FD_FILE) {
+    // nothing to sync for pipes and the console
+    return -1;
+  }
+  ((FileDesc*) fdptr)->flushWriteBehind();
+  SimFs::get().sync();
+  return 0;
+}
+
+int file_sync() {
+  flush_all_write_behind();
+  SimFs::get().sync();
+  return 0;
+}
+
+// TODO dedup with ls function under kernel/simfs.cpp
+int file_readdir(const char* path, struct dirent* entlist, int capa, int off) {
+  auto dent = SimFs::get().walkPath(path);
+  if (!dent) {
+    printf("Path does not exist %s\n", path);
+    return -1;
+  }
+  if (!dent.isdir()) {
+    printf("Not a directory %s\n", path);
+    return -1;
+  }
+  if (capa < 0 || off < 0) {
+    return -1;
+  }
+  int nchild = dent.nchild();
+  if (off >= nchild) {
+    return 0;
+  }
+  // off + capa may overflow
+  int end = capa > nchild - off ? nchild : off + capa;
+  int cnt = 0;
+  // the iterator starts from the block containing entry off
+  DirEntIterator itr(&dent, off);
+  for (int i = off; i < end; ++i, ++itr) {
+    DirEnt* curEnt = *itr;
+    struct dirent* dstEnt = entlist + cnt;
+
+    strcpy(dstEnt->name, curEnt->name);
+    dstEnt->file_size = curEnt->file_size;
+    dstEnt->ent_type = curEnt->ent_type;
+
+    ++cnt;
+  }
+  return cnt;
+}
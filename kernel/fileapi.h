@@ -4,3 +4,11 @@ int file_open(const char* path, int oflags);
 int file_read(int fd, void *buf, int nbyte);
 int file_close(int fd);
 int file_write(int fd, const void* buf, int nbyte);
+int file_lseek(int fd, int off, int whence);
+int file_fsync(int fd);
+int file_sync();
+
+struct dirent;
+// fill up to capa entries of the directory starting from entry off. Return the
+// number of entries filled, which is 0 after the last entry, or -1 on error.
+int file_readdir(const char* path, struct dirent* entlist, int capa, int off);
@@ -22,6 +22,9 @@ UserProcess* UserProcess::clone(bool use_cow) {
   child->pgdir_ = clone_address_space(parent->pgdir_, use_cow);
   child->copy_cwd_from(parent);
   child->copy_filetab_from(parent);
+  clone_mmaps(child, parent);
+  // the ring is at the same address in the child's copy of the memory
+  child->ioring_ = parent->ioring_;
   child->setup_stdio();
   return child;
 }
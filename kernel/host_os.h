@@ -0,0 +1,61 @@
+#pragma once
+
+/*
+ * Support for building SimFs on the host OS (-DHOST_OS) so it can be exercised
+ * and measured without booting SOS. The host program provides the pieces of
+ * the kernel the file system relies on: the block device, getTick and the
+ * physical pages. See test/simfs.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// provided by cinc/stdlib.h in SOS
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+#define ROUND_UP(s, base) ((s + base - 1) / base * base)
+
+#ifndef SECTOR_SIZE
+#define SECTOR_SIZE 512
+#endif
+
+struct HostBlockDeviceStats {
+  uint32_t read_cmds;
+  uint32_t read_sectors;
+  uint32_t write_cmds;
+  uint32_t write_sectors;
+};
+
+// A block device backed by a file image. It has the same interface as
+// IDEDevice and counts the commands issued to it.
+class HostBlockDevice {
+ public:
+  HostBlockDevice(int fd = -1) : fd_(fd) {
+    memset(&stats_, 0, sizeof(stats_));
+  }
+
+  operator bool() const {
+    return fd_ >= 0;
+  }
+
+  void read(uint8_t* buf, int startSectorNo, int nSector);
+  void write(const uint8_t* buf, int startSectorNo, int nSector);
+
+  HostBlockDeviceStats& stats() {
+    return stats_;
+  }
+
+  // called before each write if set. Lets a test stop the program at a
+  // chosen point of a journal commit as if the machine lost power.
+  void (*before_write_)(const uint8_t* buf, int startSectorNo, int nSector) = nullptr;
+ private:
+  int fd_;
+  HostBlockDeviceStats stats_;
+};
+
+// opened by the host program before SimFs::init
+extern HostBlockDevice host_dev;
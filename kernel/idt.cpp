@@ -9,6 +9,8 @@
 #include <kernel/user_process.h>
 #include <kernel/page_fault.h>
 #include <kernel/pic.h>
+#include <kernel/bufcache.h>
+#include <kernel/file_desc.h>
 
 #define NIDT_ENTRY 256
 
@@ -37,6 +39,11 @@ extern "C" void interrupt_handler(int32_t intNum, InterruptFrame* framePtr) {
   UserProcess::set_frame_for_current(framePtr);
   if (intNum == 32) { // call scheduler for timer interrupt
     incTick();
+    // periodically write back dirty filesystem blocks. Do this before calling
+    // the scheduler since sched does not return if there is a process to resume.
+    // The pending write-behind data of open files goes first.
+    file_desc_timer_tick();
+    bufcache_timer_tick();
     UserProcess::sched();
     // sched may return if there is no current process
     // that's why we need call framePtr->returnFromInterrupt
@@ -50,7 +57,7 @@ extern "C" void interrupt_handler(int32_t intNum, InterruptFrame* framePtr) {
   if (intNum == 32 + 14 || intNum == 32 + 15) {
     framePtr->returnFromInterrupt();
   }
-  if (intNum == 32 + 10) {
+  if (intNum == 32 + 10 && !irq_handlers[10]) {
     // simulating UHCI and attaching a MSD device will cause this interrupt
     // happens during kernel initialization. Ignore for now.
     framePtr->returnFromInterrupt();
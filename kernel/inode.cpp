@@ -0,0 +1,118 @@
+#include <kernel/inode.h>
+#include <assert.h>
+#include <string.h>
+
+InodeTable InodeTable::instance_;
+
+void Inode::flush() {
+  if (unlinked_) {
+    // nothing on disk to update
+    return;
+  }
+  if (isroot()) {
+    SimFs::get().updateRootDirEnt(dirent_);
+    return;
+  }
+  uint8_t buf[BLOCK_SIZE];
+  SimFs::get().readBlock(blkid_, buf);
+  memmove(buf + (idx_ % NDIR_ENT_PER_BLOCK) * sizeof(DirEnt), &dirent_, sizeof(DirEnt));
+  SimFs::get().writeBlock(blkid_, buf);
+}
+
+void Inode::decref() {
+  assert(refcount_ > 0);
+  if (--refcount_ == 0) {
+    InodeTable::get().release(this);
+  }
+}
+
+void InodeTable::init(const DirEnt& rootdir) {
+  for (int i = 0; i < INODE_NBUCKET; ++i) {
+    buckets_[i] = nullptr;
+  }
+  free_list_ = nullptr;
+  for (int i = INODE_NENTRY - 1; i > 0; --i) {
+    inodes_[i].refcount_ = 0;
+    inodes_[i].hash_next_ = free_list_;
+    free_list_ = &inodes_[i];
+  }
+  // the root is not hashed. It has a permanent reference.
+  Inode* r = root();
+  r->dirent_ = rootdir;
+  r->blkid_ = 0;
+  r->idx_ = 0;
+  r->unlinked_ = false;
+  r->pages_ = nullptr;
+  r->wb_fd_ = nullptr;
+  r->refcount_ = 1;
+  r->hash_next_ = nullptr;
+}
+
+Inode* InodeTable::find(uint32_t blkid, int idx) {
+  assert(blkid > 0);
+  for (Inode* ino = buckets_[bucketIdx(blkid, idx)]; ino; ino = ino->hash_next_) {
+    if (ino->blkid_ == blkid && ino->idx_ == idx) {
+      return ino;
+    }
+  }
+  return nullptr;
+}
+
+Inode* InodeTable::acquire(uint32_t blkid, int idx, const DirEnt& ent) {
+  Inode* ino = find(blkid, idx);
+  if (!ino) {
+    assert(free_list_ && "Out of inodes");
+    ino = free_list_;
+    free_list_ = ino->hash_next_;
+    ino->dirent_ = ent;
+    ino->blkid_ = blkid;
+    ino->idx_ = idx;
+    ino->unlinked_ = false;
+    ino->pages_ = nullptr;
+    ino->wb_fd_ = nullptr;
+    ino->refcount_ = 0;
+    hashInsert(ino);
+  }
+  ino->incref();
+  return ino;
+}
+
+void InodeTable::relocate(Inode* ino, uint32_t blkid, int idx) {
+  assert(!ino->isroot() && !ino->unlinked_);
+  hashRemove(ino);
+  ino->blkid_ = blkid;
+  ino->idx_ = idx;
+  hashInsert(ino);
+}
+
+void InodeTable::unlink(Inode* ino) {
+  assert(!ino->isroot() && !ino->unlinked_);
+  hashRemove(ino);
+  ino->unlinked_ = true;
+}
+
+void InodeTable::release(Inode* ino) {
+  assert(ino->refcount_ == 0 && !ino->isroot());
+  PageCache::get().dropInode(ino);
+  if (!ino->unlinked_) {
+    hashRemove(ino);
+  }
+  ino->hash_next_ = free_list_;
+  free_list_ = ino;
+}
+
+void InodeTable::hashInsert(Inode* ino) {
+  Inode*& head = buckets_[bucketIdx(ino->blkid_, ino->idx_)];
+  ino->hash_next_ = head;
+  head = ino;
+}
+
+void InodeTable::hashRemove(Inode* ino) {
+  Inode** pnext = &buckets_[bucketIdx(ino->blkid_, ino->idx_)];
+  while (*pnext != ino) {
+    assert(*pnext && "inode not found in the hash chain");
+    pnext = &(*pnext)->hash_next_;
+  }
+  *pnext = ino->hash_next_;
+  ino->hash_next_ = nullptr;
+}
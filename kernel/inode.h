@@ -0,0 +1,108 @@
+#pragma once
+
+/*
+ * The in-memory inode table.
+ *
+ * An Inode is the in-memory view of a DirEnt. Besides the DirEnt itself, it
+ * records where the DirEnt lives on disk: the physical block of the parent
+ * directory containing it and the index of the entry inside the parent
+ * directory. Flushing an inode writes the DirEnt back to that location
+ * directly without walking the path again.
+ *
+ * There is at most one Inode for each on-disk DirEnt so all the users
+ * (dentries, open files) share the same up-to-date copy. Inodes are
+ * refcounted and returned to the free list when the last reference is gone.
+ *
+ * The root directory lives in the super block (block 0, index 0) and is
+ * never freed.
+ */
+
+#include <kernel/simfs.h>
+#include <kernel/pagecache.h>
+
+class FileDesc;
+
+#define INODE_NENTRY 1024
+// must be a power of 2
+#define INODE_NBUCKET 256
+
+class Inode {
+ public:
+  DirEnt dirent_;
+  // physical block containing the DirEnt
+  uint32_t blkid_;
+  // index of the DirEnt inside the parent directory. The DirEnt is at
+  // slot idx_ % NDIR_ENT_PER_BLOCK inside block blkid_.
+  int idx_;
+  // the DirEnt has been removed from the parent directory. The inode is
+  // only kept alive by the remaining references.
+  bool unlinked_;
+  // the pages of the file in the page cache
+  CachedPage* pages_;
+  // the open file holding write-behind data for the file. Check
+  // FileDesc::flushWriteBehind
+  FileDesc* wb_fd_;
+
+  bool isroot() const {
+    return blkid_ == 0;
+  }
+
+  // write dirent_ back to disk
+  void flush();
+
+  void incref() {
+    ++refcount_;
+  }
+  void decref();
+ private:
+  int refcount_;
+  Inode* hash_next_; // also used to chain the free list
+
+  friend class InodeTable;
+};
+
+class InodeTable {
+ public:
+  static InodeTable& get() {
+    return instance_;
+  }
+
+  void init(const DirEnt& rootdir);
+
+  Inode* root() {
+    return &inodes_[0];
+  }
+
+  // Return the inode for the DirEnt at index idx of the parent directory
+  // that is stored in physical block blkid. ent is used to initialize the
+  // inode if it's not in the table yet. The refcount of the returned inode
+  // is increased.
+  Inode* acquire(uint32_t blkid, int idx, const DirEnt& ent);
+
+  // return nullptr if no inode exists for the location. The refcount is
+  // not changed.
+  Inode* find(uint32_t blkid, int idx);
+
+  // called when the DirEnt is moved inside the parent directory.
+  void relocate(Inode* ino, uint32_t blkid, int idx);
+
+  // called when the DirEnt is removed from the parent directory. The
+  // location may be reused by a new DirEnt right away.
+  void unlink(Inode* ino);
+
+  // called when the refcount drops to 0
+  void release(Inode* ino);
+ private:
+  static uint32_t bucketIdx(uint32_t blkid, int idx) {
+    return (blkid * NDIR_ENT_PER_BLOCK + idx % NDIR_ENT_PER_BLOCK) & (INODE_NBUCKET - 1);
+  }
+  void hashInsert(Inode* ino);
+  void hashRemove(Inode* ino);
+
+  static InodeTable instance_;
+
+  // inodes_[0] is the root
+  Inode inodes_[INODE_NENTRY];
+  Inode* buckets_[INODE_NBUCKET];
+  Inode* free_list_;
+};
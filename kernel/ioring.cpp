@@ -0,0 +1,84 @@
+#include <kernel/ioring.h>
+#include <kernel/user_process.h>
+#include <kernel/fileapi.h>
+#include <ioring.h>
+#include <assert.h>
+#include <string.h>
+
+#define IORING_MASK (IORING_NENTRIES - 1)
+
+static bool valid_fd(UserProcess* proc, int fd) {
+  return fd >= 0 && fd < MAX_OPEN_FILE && proc->filetab_[fd];
+}
+
+static int ioring_run(UserProcess* proc, const ioring_sqe& sqe) {
+  switch (sqe.opcode) {
+  case IORING_OP_NOP:
+    return 0;
+  case IORING_OP_READ:
+    if (!valid_fd(proc, sqe.fd)) {
+      return -1;
+    }
+    return file_read(sqe.fd, (void*) sqe.addr, sqe.len);
+  case IORING_OP_WRITE:
+    if (!valid_fd(proc, sqe.fd) || sqe.len < 0 || (sqe.len > 0 && !sqe.addr)) {
+      return -1;
+    }
+    return file_write(sqe.fd, (const void*) sqe.addr, sqe.len);
+  case IORING_OP_OPEN:
+    if (!sqe.path) {
+      return -1;
+    }
+    return file_open((const char*) sqe.path, sqe.flags);
+  case IORING_OP_CLOSE:
+    return file_close(sqe.fd);
+  case IORING_OP_READDIR:
+    if (!sqe.path || !sqe.addr) {
+      return -1;
+    }
+    return file_readdir((const char*) sqe.path, (struct dirent*) sqe.addr, sqe.len, sqe.off);
+  default:
+    return -1;
+  }
+}
+
+int ioring_setup(struct ioring* ring) {
+  if (!ring || ring->sq_head != ring->sq_tail || ring->cq_head != ring->cq_tail) {
+    return -1;
+  }
+  UserProcess::current()->ioring_ = ring;
+  return 0;
+}
+
+// TODO: the entries are run one by one before returning since the device
+// drivers poll. Run them in the background once a process can wait for the
+// device.
+int ioring_enter(int to_submit) {
+  UserProcess* proc = UserProcess::current();
+  ioring* ring = proc->ioring_;
+  if (!ring || to_submit < 0) {
+    return -1;
+  }
+  if (ring->sq_tail - ring->sq_head > IORING_NENTRIES || ring->cq_tail - ring->cq_head > IORING_NENTRIES) {
+    // the process corrupted the indices
+    return -1;
+  }
+  int n = 0;
+  while (n < to_submit && ring->sq_head != ring->sq_tail) {
+    if (ring->cq_tail - ring->cq_head == IORING_NENTRIES) {
+      // no room for the completion. The rest is run by the next ioring_enter.
+      break;
+    }
+    // copy the entry so the process can not change it while it runs
+    ioring_sqe sqe = ring->sqes[ring->sq_head & IORING_MASK];
+    ring->sq_head = ring->sq_head + 1;
+
+    int res = ioring_run(proc, sqe);
+    ioring_cqe& cqe = ring->cqes[ring->cq_tail & IORING_MASK];
+    cqe.user_data = sqe.user_data;
+    cqe.res = res;
+    ring->cq_tail = ring->cq_tail + 1;
+    ++n;
+  }
+  return n;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+/*
+ * The kernel side of the I/O rings. Check cinc/ioring.h for the layout shared
+ * with user programs.
+ *
+ * The ring lives in the memory of the process and the kernel accesses it
+ * through the address space of the current process like other syscall
+ * arguments. A forked child has a copy of the ring at the same address, so it
+ * inherits the registration.
+ */
+
+#include <stdint.h>
+
+struct ioring;
+
+// register the ring of the current process. The indices must be reset.
+// Return 0 on success and -1 on error.
+int ioring_setup(struct ioring* ring);
+
+// run up to to_submit queued sqes and post their completions. Return the
+// number of sqes consumed or -1 on error.
+int ioring_enter(int to_submit);
@@ -0,0 +1,194 @@
+#include <kernel/journal.h>
+#include <kernel/simfs.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+struct JournalHeader {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t nblock; // number of blocks logged. 0 if there is nothing to replay
+  uint32_t checksum; // of the home locations and the logged blocks
+  uint32_t blkids[JOURNAL_MAX_NBLOCK]; // the home locations
+} __attribute__((packed));
+
+static_assert(sizeof(JournalHeader) == BLOCK_SIZE);
+
+#define JOURNAL_IO_BLOCKS 16
+// gathers the logged blocks, which are in separate buffers, for multi-block
+// writes
+static uint8_t journal_buf[JOURNAL_IO_BLOCKS * BLOCK_SIZE] __attribute__((aligned(4096)));
+
+void JournalStats::print() const {
+  printf("Journal: %d transactions, %d commits, %d blocks logged\n",
+    transactions, commits, logged_blocks);
+}
+
+// FNV-1a over 32 bit words
+static uint32_t checksum(uint32_t h, const uint32_t* words, int n) {
+  for (int i = 0; i < n; ++i) {
+    h ^= words[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+#define CHECKSUM_INIT 2166136261U
+
+void Journal::init(uint32_t start, uint32_t nblock) {
+  assert(nblock >= 2);
+  start_ = start;
+  nblock_ = nblock;
+  seq_ = 0;
+  depth_ = 0;
+  nlogged_ = 0;
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+int Journal::capacity() const {
+  // leave half of the buffers for reading
+  return min(min((int) nblock_ - 1, JOURNAL_MAX_NBLOCK), BUFCACHE_NBUF / 2);
+}
+
+void Journal::writeHeader(uint32_t nblock, uint32_t sum) {
+  JournalHeader* hdr = (JournalHeader*) journal_buf;
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic = JOURNAL_MAGIC;
+  hdr->seq = seq_;
+  hdr->nblock = nblock;
+  hdr->checksum = sum;
+  memmove(hdr->blkids, blkids_, nblock * sizeof(uint32_t));
+  SimFs::get().writeBlocksToDev(start_, 1, journal_buf);
+}
+
+void Journal::replay() {
+  auto& fs = SimFs::get();
+  // journal_buf is not to be touched by a flush from the timer
+  DevBusyScope dev_busy;
+  fs.readBlocksFromDev(start_, 1, journal_buf);
+  JournalHeader* hdr = (JournalHeader*) journal_buf;
+  if (hdr->magic != JOURNAL_MAGIC) {
+    // never used since mkfs
+    return;
+  }
+  seq_ = hdr->seq;
+  int n = hdr->nblock;
+  if (n == 0) {
+    return;
+  }
+  if (n > capacity()) {
+    printf("Journal: invalid header, %d blocks logged\n", n);
+    return;
+  }
+  // journal_buf is reused to read the logged blocks
+  uint32_t sum = hdr->checksum;
+  memmove(blkids_, hdr->blkids, n * sizeof(uint32_t));
+
+  // the group may not be completely written if the header is torn
+  uint32_t h = checksum(CHECKSUM_INIT, blkids_, n);
+  for (int i = 0; i < n; ++i) {
+    fs.readBlocksFromDev(start_ + 1 + i, 1, journal_buf);
+    h = checksum(h, (const uint32_t*) journal_buf, BLOCK_SIZE / 4);
+  }
+  if (h != sum) {
+    printf("Journal: discard an incomplete group\n");
+    writeHeader(0, 0);
+    return;
+  }
+  for (int i = 0; i < n; ++i) {
+    fs.readBlocksFromDev(start_ + 1 + i, 1, journal_buf);
+    // go through the buffer cache so the cached copies are up to date
+    fs.bufCache().write(blkids_[i], journal_buf);
+  }
+  fs.bufCache().sync();
+  printf("Journal: replayed %d blocks\n", n);
+  writeHeader(0, 0);
+}
+
+void Journal::begin() {
+  if (depth_++ == 0) {
+    ++stats_.transactions;
+  }
+}
+
+void Journal::end() {
+  assert(depth_ > 0);
+  if (--depth_ == 0 && enabled() && nlogged_ >= min(JOURNAL_COMMIT_NBLOCK, capacity() / 2)) {
+    commit();
+  }
+}
+
+int Journal::addBlock(uint32_t blkid) {
+  assert(enabled() && depth_ > 0);
+  auto& bc = SimFs::get().bufCache();
+  if (bc.pinned(blkid)) {
+    // already in the group
+    return 0;
+  }
+  if (nlogged_ == capacity()) {
+    printf("Journal: transaction too large, block %d not logged\n", blkid);
+    return -1;
+  }
+  bc.pin(blkid);
+  blkids_[nlogged_++] = blkid;
+  return 0;
+}
+
+void Journal::commit() {
+  assert(depth_ == 0);
+  if (!enabled()) {
+    return;
+  }
+  auto& fs = SimFs::get();
+  auto& bc = fs.bufCache();
+  // journal_buf is not to be touched by a flush from the timer
+  DevBusyScope dev_busy;
+
+  // the allocations and frees of the group go with it
+  ++depth_;
+  fs.flushBitmap();
+  --depth_;
+  if (nlogged_ == 0) {
+    return;
+  }
+
+  // 1. log the blocks
+  uint32_t h = checksum(CHECKSUM_INIT, blkids_, nlogged_);
+  for (int i = 0; i < nlogged_; i += JOURNAL_IO_BLOCKS) {
+    int cnt = min(JOURNAL_IO_BLOCKS, nlogged_ - i);
+    for (int j = 0; j < cnt; ++j) {
+      uint8_t* data = journal_buf + j * BLOCK_SIZE;
+      bc.copyOut(blkids_[i + j], data);
+      h = checksum(h, (const uint32_t*) data, BLOCK_SIZE / 4);
+    }
+    fs.writeBlocksToDev(start_ + 1 + i, cnt, journal_buf);
+  }
+
+  // 2. the group is durable once the header is written
+  ++seq_;
+  writeHeader(nlogged_, h);
+
+  // 3. write the blocks to their home locations
+  for (int i = 0; i < nlogged_; ++i) {
+    bc.checkpoint(blkids_[i]);
+  }
+
+  // 4. nothing to replay any more
+  writeHeader(0, 0);
+
+  // the blocks freed by the group are not referenced on disk any more
+  fs.releaseFreedBlocks();
+
+  ++stats_.commits;
+  stats_.logged_blocks += nlogged_;
+  nlogged_ = 0;
+}
+
+JournalTx::JournalTx() {
+  SimFs::get().journal().begin();
+}
+
+JournalTx::~JournalTx() {
+  SimFs::get().journal().end();
+}
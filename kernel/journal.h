@@ -0,0 +1,106 @@
+#pragma once
+
+/*
+ * A write-ahead journal for SimFs metadata.
+ *
+ * Operations changing metadata (createEnt, resize, truncate, removeDirEnt
+ * and the flushes of the changed DirEnts) run inside a transaction. Every
+ * block written through SimFs::writeBlock while a transaction is open is
+ * added to the running transaction group and pinned in the buffer cache so
+ * it does not reach its home location early.
+ *
+ * Many operations are batched into one group. The group is committed when
+ * it has JOURNAL_COMMIT_NBLOCK blocks, by SimFs::sync or by the periodic
+ * flush of the buffer cache:
+ * 1. the blocks are written to the journal region sequentially after the
+ *    header block, a few device commands in total
+ * 2. the header recording the home locations and a checksum is written.
+ *    The group is durable once the header is on disk.
+ * 3. the blocks are written to their home locations (checkpoint)
+ * 4. the header is cleared.
+ * SimFs::init replays a group whose header is valid, so a crash (or pulling
+ * the USB stick) at any point leaves the metadata either before or after the
+ * whole group.
+ *
+ * Blocks freed by a group are not reused before it is committed, and the
+ * bitmap is always written inside the group, so the committed metadata never
+ * points to a block holding something else.
+ *
+ * A group holds at most half of the buffers. A transaction writing more
+ * blocks than that loses its atomicity; Journal::addBlock reports it rather
+ * than stalling the buffer cache. Operations are expected to stay well below
+ * the limit, e.g. the directory index grows one bucket at a time.
+ *
+ * File data is not journaled. The journal requires the bitmap allocator since
+ * freeing blocks with the free list writes to each freed block.
+ */
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+// the number of home locations fitting in the header block
+#define JOURNAL_MAX_NBLOCK 1020
+// commit the group once it has this many blocks. Keep it well below the
+// number of buffers since the blocks are pinned in the buffer cache.
+#define JOURNAL_COMMIT_NBLOCK 64
+
+struct JournalStats {
+  uint32_t commits;
+  uint32_t logged_blocks;
+  uint32_t transactions;
+
+  void print() const;
+};
+
+class Journal {
+ public:
+  // start is the header block. nblock includes the header block.
+  void init(uint32_t start, uint32_t nblock);
+  bool enabled() const {
+    return nblock_ > 0;
+  }
+
+  // called by SimFs::init. Copy the blocks of a committed group to their
+  // home locations.
+  void replay();
+
+  // transactions can nest. The group may be committed when the outermost
+  // transaction ends.
+  void begin();
+  void end();
+  bool inTransaction() const {
+    return depth_ > 0;
+  }
+
+  // called for each block written while a transaction is open. The block
+  // must be cached. Return -1 if the group is full; the block is not logged
+  // and may reach its home location before the group commits.
+  int addBlock(uint32_t blkid);
+
+  // commit the running group. Must not be called inside a transaction.
+  void commit();
+
+  const JournalStats& stats() const {
+    return stats_;
+  }
+ private:
+  void writeHeader(uint32_t nblock, uint32_t checksum);
+  // max number of blocks in a group. Bounded by both the journal area and
+  // the buffer cache, since the blocks stay pinned until the commit.
+  int capacity() const;
+
+  uint32_t start_;
+  uint32_t nblock_ = 0;
+  uint32_t seq_;
+  int depth_ = 0;
+  int nlogged_ = 0;
+  uint32_t blkids_[JOURNAL_MAX_NBLOCK];
+  JournalStats stats_;
+};
+
+// open a transaction for the scope
+class JournalTx {
+ public:
+  JournalTx();
+  ~JournalTx();
+};
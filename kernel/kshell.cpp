@@ -3,10 +3,12 @@
 #include <kernel/vga.h>
 #include <kernel/user_process.h>
 #include <kernel/simfs.h>
+#include <kernel/dcache.h>
 #include <kernel/ide.h>
 #include <kernel/loader.h>
 #include <kernel/pci.h>
 #include <kernel/phys_page.h>
+#include <kernel/usb/usb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,6 +55,13 @@ int cmdCat(char* args[]);
 int cmdLaunch(char* args[]);
 int cmdLspci(char *args[]);
 int cmdCheckPhysMem(char *args[]);
+int cmdBufCacheStat(char *args[]);
+int cmdSync(char *args[]);
+int cmdDentryCacheStat(char *args[]);
+int cmdDf(char *args[]);
+int cmdJournalStat(char *args[]);
+int cmdPageCacheStat(char *args[]);
+int cmdUsbBench(char *args[]);
 
 struct KernelCmd {
   const char* cmdName;
@@ -79,6 +88,13 @@ struct KernelCmd {
   { "launch", "Lauch a user process from the program in the file system", cmdLaunch},
   { "lspci", "Enumerate PCI devices.", cmdLspci},
   { "check_phys_mem", "Check the amount of available physical pages.", cmdCheckPhysMem},
+  { "bcstat", "Show buffer cache statistics.", cmdBufCacheStat},
+  { "sync", "Write back dirty blocks in the buffer cache.", cmdSync},
+  { "dcstat", "Show dentry cache statistics.", cmdDentryCacheStat},
+  { "df", "Show the number of free blocks in the filesystem.", cmdDf},
+  { "jstat", "Show journal statistics.", cmdJournalStat},
+  { "pcstat", "Show page cache statistics.", cmdPageCacheStat},
+  { "usbbench", "Compare USB read throughput with SuperSpeed bursts off and on. Optional arg: MB to read.", cmdUsbBench},
   {nullptr, nullptr},
 };
 
@@ -231,6 +247,51 @@ int cmdCheckPhysMem(char *args[]) {
   return 0;
 }
 
+int cmdBufCacheStat(char *args[]) {
+  SimFs::get().bufCache().stats().print();
+  return 0;
+}
+
+int cmdSync(char *args[]) {
+  SimFs::get().sync();
+  return 0;
+}
+
+int cmdDentryCacheStat(char *args[]) {
+  DentryCache::get().stats().print();
+  return 0;
+}
+
+int cmdPageCacheStat(char *args[]) {
+  PageCache::get().stats().print();
+  return 0;
+}
+
+int cmdUsbBench(char *args[]) {
+  usb_burst_bench(args[0] ? atoi(args[0]) : 64);
+  return 0;
+}
+
+int cmdJournalStat(char *args[]) {
+  if (!SimFs::get().useJournal()) {
+    printf("The filesystem does not have a journal\n");
+    return 0;
+  }
+  SimFs::get().journal().stats().print();
+  return 0;
+}
+
+int cmdDf(char *args[]) {
+  auto& fs = SimFs::get();
+  int nfree = fs.countFreeBlocks();
+  if (nfree < 0) {
+    printf("%d blocks in total. Free block count is only tracked with the bitmap allocator\n", fs.totBlocks());
+  } else {
+    printf("%d blocks in total, %d free\n", fs.totBlocks(), nfree);
+  }
+  return 0;
+}
+
 char* parseCmdLine(char* line, char *args[]) {
   char* cmd = nullptr;
   int argIdx = 0;
@@ -30,11 +30,19 @@ int launch(const char* path, const char** argv, bool should_resume) {
     return -1;
   }
   assert(dent.file_size < sizeof(launch_buf) / sizeof(*launch_buf));
+  BlockMapCache cache;
+  cache.init();
   for (int i = 0; i < dent.file_size; i += BLOCK_SIZE) {
     uint32_t logical_blkid = i / BLOCK_SIZE;
-    uint32_t phys_blkid = dent.logicalToPhysBlockId(logical_blkid);
-    SimFs::get().readBlock(phys_blkid, &launch_buf[i]);
+    uint32_t phys_blkid = dent.logicalToPhysBlockId(logical_blkid, &cache);
+    if (phys_blkid) {
+      SimFs::get().readBlock(phys_blkid, &launch_buf[i]);
+    } else {
+      // a hole
+      memset(&launch_buf[i], 0, BLOCK_SIZE);
+    }
   }
+  cache.fini();
 
   // Note that load will activate the child process's address space.
   // Pointer like 'path' residing in parent process's address space may not
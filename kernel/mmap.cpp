@@ -0,0 +1,155 @@
+#include <kernel/mmap.h>
+#include <kernel/user_process.h>
+#include <kernel/pagecache.h>
+#include <kernel/inode.h>
+#include <kernel/paging.h>
+#include <kernel/page_fault.h>
+#include <mman.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// return the lowest address in the mmap area where len bytes fit
+static uint32_t find_free_range(UserProcess* proc, uint32_t len) {
+  uint32_t cand = USER_MMAP_START;
+  bool moved = true;
+  while (moved) {
+    moved = false;
+    for (int i = 0; i < MAX_MMAP_REGION; ++i) {
+      MmapRegion& r = proc->mmaps_[i];
+      if (r.start && cand < r.start + r.len && r.start < cand + len) {
+        // overlap. Try the address right after the region.
+        cand = r.start + r.len;
+        moved = true;
+      }
+    }
+    if (cand > USER_MMAP_END || USER_MMAP_END - cand < len) {
+      return 0;
+    }
+  }
+  return cand;
+}
+
+int mmap(int len, int prot, int flags, int fd, int off) {
+  if (len <= 0 || off < 0 || off % PAGE_SIZE != 0 || fd < 0 || fd >= MAX_OPEN_FILE) {
+    return -1;
+  }
+  if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+    return -1;
+  }
+  if (flags == MAP_SHARED && (prot & PROT_WRITE)) {
+    // TODO: support writing back shared mappings
+    return -1;
+  }
+  UserProcess* proc = UserProcess::current();
+  FileDescBase* fdbase = proc->filetab_[fd];
+  if (!fdbase || fdbase->fdtype_ != FD_FILE) {
+    return -1;
+  }
+  Inode* ino = ((FileDesc*) fdbase)->inode_;
+  if (ino->dirent_.ent_type != ET_FILE) {
+    return -1;
+  }
+  // the pages are filled from the file
+  flush_write_behind(ino);
+
+  MmapRegion* slot = nullptr;
+  for (int i = 0; i < MAX_MMAP_REGION; ++i) {
+    if (!proc->mmaps_[i].start) {
+      slot = &proc->mmaps_[i];
+      break;
+    }
+  }
+  if (!slot) {
+    return -1;
+  }
+  uint32_t rlen = ROUND_UP(len, PAGE_SIZE);
+  uint32_t start = find_free_range(proc, rlen);
+  if (!start) {
+    return -1;
+  }
+  slot->start = start;
+  slot->len = rlen;
+  slot->inode = ino;
+  ino->incref();
+  slot->pgoff = off / PAGE_SIZE;
+  slot->prot = prot;
+  slot->flags = flags;
+  return (int) start;
+}
+
+int munmap(uint32_t addr, int len) {
+  UserProcess* proc = UserProcess::current();
+  for (int i = 0; i < MAX_MMAP_REGION; ++i) {
+    MmapRegion& r = proc->mmaps_[i];
+    if (r.start && r.start == addr && r.len == ROUND_UP(len, PAGE_SIZE)) {
+      unmap_region(proc->getPgdir(), r.start, r.len);
+      r.inode->decref();
+      memset(&r, 0, sizeof(r));
+      return 0;
+    }
+  }
+  // TODO: support unmapping part of a mapping
+  return -1;
+}
+
+bool handle_mmap_fault(UserProcess* proc, uint32_t la, bool write) {
+  MmapRegion* region = nullptr;
+  for (int i = 0; i < MAX_MMAP_REGION; ++i) {
+    MmapRegion& r = proc->mmaps_[i];
+    if (r.start && la >= r.start && la < r.start + r.len) {
+      region = &r;
+      break;
+    }
+  }
+  if (!region || (write && !(region->prot & PROT_WRITE))) {
+    return false;
+  }
+  phys_addr_t pgdir = proc->getPgdir();
+  uint32_t pgaddr = la & ~(PAGE_SIZE - 1);
+  if (virt_to_phys(pgdir, pgaddr)) {
+    // present. Leave a write to a COW page to the COW handling.
+    return false;
+  }
+  uint32_t pgidx = region->pgoff + (pgaddr - region->start) / PAGE_SIZE;
+  phys_addr_t page = PageCache::get().getPage(region->inode, pgidx);
+  if (!page) {
+    printf("Out of page cache entries for mmap\n");
+    return false;
+  }
+
+  // the page table may be shared with writable pages, so it's always
+  // created writable. The permission is controlled by the PTE.
+  map_region(pgdir, pgaddr, page, PAGE_SIZE, MAP_FLAG_USER | MAP_FLAG_WRITE);
+  paging_entry_t* ppte = get_pte_ptr(pgdir, pgaddr);
+  ppte->r_w = 0;
+  if (region->flags == MAP_PRIVATE && (region->prot & PROT_WRITE)) {
+    ppte->cow = 1;
+    if (write) {
+      // the page cache holds a reference so the page is copied
+      handle_cow(pgaddr, ppte);
+    }
+  }
+  return true;
+}
+
+void clone_mmaps(UserProcess* child, UserProcess* parent) {
+  for (int i = 0; i < MAX_MMAP_REGION; ++i) {
+    MmapRegion& r = parent->mmaps_[i];
+    child->mmaps_[i] = r;
+    if (r.start) {
+      r.inode->incref();
+    }
+  }
+}
+
+void release_mmaps(UserProcess* proc) {
+  for (int i = 0; i < MAX_MMAP_REGION; ++i) {
+    MmapRegion& r = proc->mmaps_[i];
+    if (r.start) {
+      r.inode->decref();
+      memset(&r, 0, sizeof(r));
+    }
+  }
+}
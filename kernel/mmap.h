@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * mmap of SimFs files.
+ *
+ * A mapping is recorded as an MmapRegion of the process; no page is mapped
+ * at mmap time. The first access to a page faults and pfhandler maps the
+ * page from the page cache (check kernel/pagecache.h):
+ * - MAP_SHARED mappings map the cached page read only
+ * - MAP_PRIVATE mappings with PROT_WRITE map it as a COW page. The first
+ *   write copies it the same way as a COW fork does.
+ *
+ * Mappings are placed in [USER_MMAP_START, USER_MMAP_END), above the code
+ * and the stack of the process.
+ */
+
+#include <stdint.h>
+
+#define USER_MMAP_START 0x80000000
+#define USER_MMAP_END 0xC0000000
+#define MAX_MMAP_REGION 16
+
+class Inode;
+class UserProcess;
+
+struct MmapRegion {
+  uint32_t start; // 0 if the slot is free
+  uint32_t len; // a multiple of PAGE_SIZE
+  Inode* inode; // the region holds a reference
+  uint32_t pgoff; // file offset of start in pages
+  int prot;
+  int flags;
+};
+
+// return the address of the mapping or -1. off must be page aligned.
+int mmap(int len, int prot, int flags, int fd, int off);
+// addr and len must cover a whole mapping
+int munmap(uint32_t addr, int len);
+
+// called by pfhandler. Return true if the fault is resolved.
+bool handle_mmap_fault(UserProcess* proc, uint32_t la, bool write);
+
+// called by fork. The child gets the same mappings.
+void clone_mmaps(UserProcess* child, UserProcess* parent);
+// called when the process terminates. The pages are released along with the
+// page directory.
+void release_mmaps(UserProcess* proc);
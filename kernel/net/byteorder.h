@@ -16,6 +16,10 @@ static inline uint32_t swap(uint32_t val) {
     | ((val << 24) & 0xFF000000);
 }
 
+static inline uint64_t swap(uint64_t val) {
+  return ((uint64_t) swap((uint32_t) val) << 32) | swap((uint32_t) (val >> 32));
+}
+
 static inline uint16_t hton(uint16_t val) {
   return swap(val);
 }
@@ -24,6 +28,10 @@ static inline uint32_t hton(uint32_t val) {
   return swap(val);
 }
 
+static inline uint64_t hton(uint64_t val) {
+  return swap(val);
+}
+
 static inline uint16_t ntoh(uint16_t val) {
   return swap(val);
 }
@@ -31,3 +39,7 @@ static inline uint16_t ntoh(uint16_t val) {
 static inline uint32_t ntoh(uint32_t val) {
   return swap(val);
 }
+
+static inline uint64_t ntoh(uint64_t val) {
+  return swap(val);
+}
@@ -5,9 +5,15 @@
 #include <kernel/user_process.h>
 #include <kernel/phys_page.h>
 #include <kernel/paging.h>
+#include <kernel/mmap.h>
 #include <string.h>
 #include <stdlib.h>
 
+// bit 1 of the error code is set if the fault is caused by a write
+#define PF_ERR_WRITE 2
+// bit 2 of the error code is set if the fault happens in user mode
+#define PF_ERR_USER 4
+
 /*
  * adjust the page mapping for COW
  */
@@ -48,18 +54,26 @@ void pfhandler(InterruptFrame* framePtr) {
   if (curProcess) {
     pid = curProcess->get_pid();
   }
-  printf("PFHANDLER pid %d (%s), error code 0x%x"
-         ", eip 0x%x, cr2 0x%x\n",
-         pid, curProcess ? curProcess->name : "N/A",  framePtr->error_code, framePtr->eip, fault_addr);
-
   // cr3 should equals to the current process's page direcotry
   phys_addr_t pgdir = curProcess->getPgdir();
   assert(asm_get_cr3() == pgdir);
-  paging_entry_t* ppte = get_pte_ptr(pgdir, fault_addr);
 
+  // a page of a file mapping that has not been accessed yet
+  if (handle_mmap_fault(curProcess, fault_addr, framePtr->error_code & PF_ERR_WRITE)) {
+    framePtr->returnFromInterrupt();
+  }
+
+  paging_entry_t* ppte = get_pte_ptr(pgdir, fault_addr);
   if (ppte->present && !ppte->r_w && ppte->u_s && ppte->cow) {
     handle_cow(fault_addr, ppte);
     framePtr->returnFromInterrupt();
   }
+  printf("PFHANDLER pid %d (%s), error code 0x%x"
+         ", eip 0x%x, cr2 0x%x\n",
+         pid, curProcess ? curProcess->name : "N/A",  framePtr->error_code, framePtr->eip, fault_addr);
+  if (curProcess && (framePtr->error_code & PF_ERR_USER)) {
+    // only the faulting process is affected
+    UserProcess::terminate_current_process(-1);
+  }
   assert(false && "non recoverable page fault");
 }
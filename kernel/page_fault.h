@@ -1,6 +1,12 @@
 #pragma once
 
+#include <stdint.h>
+
 // the page fault handler. This function should not return to caller but
 // return to user space if it's a recoverable page fault.
 struct InterruptFrame;
 void pfhandler(InterruptFrame* framePtr);
+
+// make the COW page at la writable for the current process
+struct paging_entry;
+void handle_cow(uint32_t la, paging_entry* ppte);
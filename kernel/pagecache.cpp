@@ -0,0 +1,157 @@
+#include <kernel/pagecache.h>
+#include <kernel/inode.h>
+#include <kernel/paging.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+PageCache PageCache::instance_;
+
+void PageCacheStats::print() const {
+  printf("Page cache: %d hits, %d misses, %d evictions\n", hits, misses, evictions);
+}
+
+void PageCache::init() {
+  for (int i = 0; i < PAGECACHE_NBUCKET; ++i) {
+    buckets_[i] = nullptr;
+  }
+  free_list_ = nullptr;
+  for (int i = PAGECACHE_NPAGE - 1; i >= 0; --i) {
+    pages_[i].inode_ = nullptr;
+    pages_[i].hash_next_ = free_list_;
+    free_list_ = &pages_[i];
+  }
+  clock_hand_ = 0;
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+CachedPage* PageCache::lookup(Inode* ino, uint32_t pgidx) {
+  for (CachedPage* cp = buckets_[bucketIdx(ino, pgidx)]; cp; cp = cp->hash_next_) {
+    if (cp->inode_ == ino && cp->pgidx_ == pgidx) {
+      return cp;
+    }
+  }
+  return nullptr;
+}
+
+CachedPage* PageCache::alloc() {
+  if (!free_list_) {
+    // evict a page no process maps
+    for (int i = 0; i < PAGECACHE_NPAGE; ++i) {
+      CachedPage* cp = &pages_[clock_hand_];
+      clock_hand_ = (clock_hand_ + 1) % PAGECACHE_NPAGE;
+      if (PhysPageStat::getRefCountUser(cp->page_) == 1) {
+        drop(cp);
+        ++stats_.evictions;
+        break;
+      }
+    }
+    if (!free_list_) {
+      // all the cached pages are mapped
+      return nullptr;
+    }
+  }
+  CachedPage* cp = free_list_;
+  free_list_ = cp->hash_next_;
+  return cp;
+}
+
+void PageCache::drop(CachedPage* cp) {
+  Inode* ino = cp->inode_;
+  assert(ino);
+
+  CachedPage** pnext = &buckets_[bucketIdx(ino, cp->pgidx_)];
+  while (*pnext != cp) {
+    assert(*pnext && "page not found in the hash chain");
+    pnext = &(*pnext)->hash_next_;
+  }
+  *pnext = cp->hash_next_;
+
+  pnext = &ino->pages_;
+  while (*pnext != cp) {
+    assert(*pnext && "page not found in the inode list");
+    pnext = &(*pnext)->inode_next_;
+  }
+  *pnext = cp->inode_next_;
+
+  // the page stays alive if it's still mapped
+  PhysPageStat::decRefCountUser(cp->page_);
+  cp->inode_ = nullptr;
+  cp->hash_next_ = free_list_;
+  free_list_ = cp;
+}
+
+phys_addr_t PageCache::getPage(Inode* ino, uint32_t pgidx) {
+  CachedPage* cp = lookup(ino, pgidx);
+  if (cp) {
+    ++stats_.hits;
+    return cp->page_;
+  }
+  ++stats_.misses;
+  cp = alloc();
+  if (!cp) {
+    return 0;
+  }
+  cp->inode_ = ino;
+  cp->pgidx_ = pgidx;
+  cp->page_ = alloc_phys_page();
+  PhysPageStat::incRefCountUser(cp->page_);
+
+  uint8_t* data = (uint8_t*) cp->page_;
+  const DirEnt& dent = ino->dirent_;
+  int pos = pgidx * PAGE_SIZE;
+  if (pos < dent.file_size) {
+    dent.readBlocks(pgidx, 1, data);
+    int valid = dent.file_size - pos;
+    if (valid < PAGE_SIZE) {
+      memset(data + valid, 0, PAGE_SIZE - valid);
+    }
+  } else {
+    memset(data, 0, PAGE_SIZE);
+  }
+
+  CachedPage*& head = buckets_[bucketIdx(ino, pgidx)];
+  cp->hash_next_ = head;
+  head = cp;
+  cp->inode_next_ = ino->pages_;
+  ino->pages_ = cp;
+  return cp->page_;
+}
+
+void PageCache::update(Inode* ino, int pos, int size, const void* buf) {
+  const uint8_t* src = (const uint8_t*) buf;
+  for (CachedPage* cp = ino->pages_; cp; cp = cp->inode_next_) {
+    int pgstart = cp->pgidx_ * PAGE_SIZE;
+    int from = max(pos, pgstart);
+    int to = min(pos + size, pgstart + PAGE_SIZE);
+    if (from < to) {
+      memmove((uint8_t*) cp->page_ + from - pgstart, src + from - pos, to - from);
+    }
+  }
+}
+
+void PageCache::truncate(Inode* ino, int newsize) {
+  CachedPage* next;
+  for (CachedPage* cp = ino->pages_; cp; cp = next) {
+    next = cp->inode_next_;
+    int pgstart = cp->pgidx_ * PAGE_SIZE;
+    if (pgstart >= newsize) {
+      if (PhysPageStat::getRefCountUser(cp->page_) == 1) {
+        drop(cp);
+      } else {
+        // still mapped. Keep the page so later writes reach the mappings;
+        // it's evicted once the last mapping goes away.
+        memset((uint8_t*) cp->page_, 0, PAGE_SIZE);
+      }
+    } else if (pgstart + PAGE_SIZE > newsize) {
+      memset((uint8_t*) cp->page_ + newsize - pgstart, 0, pgstart + PAGE_SIZE - newsize);
+    }
+  }
+}
+
+void PageCache::dropInode(Inode* ino) {
+  while (ino->pages_) {
+    drop(ino->pages_);
+  }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+/*
+ * The page cache backing mmap of SimFs files.
+ *
+ * A cached page holds the content of one page of a file, keyed by (inode,
+ * page index). Since a page is the same size as a block, page i of a file
+ * is logical block i. Processes mapping the same file map the same physical
+ * pages, so a read-mostly file takes RAM only once no matter how many
+ * processes map it.
+ *
+ * The cache holds one user reference (PhysPageStat::refcount_user) on each
+ * page and each mapping holds another. A page only referenced by the cache
+ * can be evicted. MAP_PRIVATE mappings rely on this: a write to the page
+ * sees a refcount above 1 and handle_cow copies it.
+ *
+ * FileDesc::write and truncation update the cached pages so mappings see
+ * the new content. A page truncated away is zeroed rather than dropped while
+ * it's still mapped, so the mappings keep following the file. The pages of an inode are dropped when the inode is
+ * released, which can only happen after all its mappings are gone since each
+ * mapping holds a reference to the inode.
+ */
+
+#include <stdint.h>
+#include <kernel/phys_page.h>
+
+#define PAGECACHE_NPAGE 4096 // 16MB
+// must be a power of 2
+#define PAGECACHE_NBUCKET 1024
+
+class Inode;
+
+struct PageCacheStats {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions;
+
+  void print() const;
+};
+
+class CachedPage {
+ public:
+  Inode* inode_; // nullptr if the entry is free
+  uint32_t pgidx_;
+  phys_addr_t page_;
+
+  CachedPage* hash_next_; // also used to chain the free list
+  CachedPage* inode_next_; // the pages of the same inode
+};
+
+class PageCache {
+ public:
+  static PageCache& get() {
+    return instance_;
+  }
+
+  void init();
+
+  // return the physical page holding page pgidx of the file. It's read from
+  // the file on a miss; the part beyond the end of file is zero. Return 0 if
+  // the cache is full of mapped pages.
+  phys_addr_t getPage(Inode* ino, uint32_t pgidx);
+
+  // called after [pos, pos + size) of the file is written from buf
+  void update(Inode* ino, int pos, int size, const void* buf);
+  // called after the file is truncated to newsize
+  void truncate(Inode* ino, int newsize);
+  // drop all the pages of the inode
+  void dropInode(Inode* ino);
+
+  const PageCacheStats& stats() const {
+    return stats_;
+  }
+ private:
+  CachedPage* lookup(Inode* ino, uint32_t pgidx);
+  // return a free entry. Evict a page that is not mapped if needed. Return
+  // nullptr if all the pages are mapped.
+  CachedPage* alloc();
+  // remove the entry from the hash table and the inode list and release the
+  // cache's reference to the page
+  void drop(CachedPage* cp);
+  static uint32_t bucketIdx(Inode* ino, uint32_t pgidx) {
+    return ((uintptr_t) ino / sizeof(void*) + pgidx) & (PAGECACHE_NBUCKET - 1);
+  }
+
+  static PageCache instance_;
+
+  CachedPage pages_[PAGECACHE_NPAGE];
+  CachedPage* buckets_[PAGECACHE_NBUCKET];
+  CachedPage* free_list_;
+  // where the next eviction scan starts
+  int clock_hand_;
+  PageCacheStats stats_;
+};
@@ -1,10 +1,12 @@
 #include <kernel/paging.h>
 #include <kernel/asm_util.h>
 #include <kernel/phys_page.h>
+#include <kernel/page_fault.h>
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 
 #define CR0_PG (1UL << 31)
 #define CR0_WP (1UL << 16)
@@ -35,6 +37,70 @@ paging_entry_t* get_pte_ptr(phys_addr_t page_dir, uint32_t la) {
   return ppte;
 }
 
+phys_addr_t virt_to_phys(phys_addr_t page_dir, uint32_t la) {
+  paging_entry_t* ppde = GET_PDE_PTR(page_dir, la);
+  if (!ppde->present) {
+    return 0;
+  }
+  phys_addr_t page_tbl = (ppde->phys_page_no << 12);
+  paging_entry_t* ppte = GET_PTE_PTR(page_tbl, la);
+  if (!ppte->present) {
+    return 0;
+  }
+  return (ppte->phys_page_no << 12) | PGOFF(la);
+}
+
+/*
+ * Pinning only matters for user pages: a pinned page holds an extra user
+ * reference so it's not released if the process unmaps it or exits in the
+ * middle of the transfer. Kernel pages are never released this way.
+ */
+bool pin_pages(phys_addr_t page_dir, uint32_t la, uint32_t len, bool dev_write) {
+  if (len == 0) {
+    return true;
+  }
+  uint32_t end = la + len;
+  for (uint32_t pg = la & ~PAGE_OFF_MASK; pg < end; pg += PAGE_SIZE) {
+    if (!virt_to_phys(page_dir, pg)) {
+      // may be a page of a file mapping not accessed yet. Touch it so the page
+      // fault handler maps it.
+      (void) *(volatile uint8_t*) max(pg, la);
+    }
+    if (!virt_to_phys(page_dir, pg)) {
+      unpin_pages(page_dir, la, pg > la ? pg - la : 0);
+      return false;
+    }
+    paging_entry_t* ppte = get_pte_ptr(page_dir, pg);
+    if (!ppte->u_s) {
+      continue;
+    }
+    if (dev_write && !ppte->r_w) {
+      if (!ppte->cow) {
+        // e.g. a read only file mapping
+        unpin_pages(page_dir, la, pg > la ? pg - la : 0);
+        return false;
+      }
+      // DMA does not go through the MMU so it can not trigger the page fault
+      handle_cow(pg, ppte);
+    }
+    PhysPageStat::incRefCountUser(ppte->phys_page_no << 12);
+  }
+  return true;
+}
+
+void unpin_pages(phys_addr_t page_dir, uint32_t la, uint32_t len) {
+  if (len == 0) {
+    return;
+  }
+  uint32_t end = la + len;
+  for (uint32_t pg = la & ~PAGE_OFF_MASK; pg < end; pg += PAGE_SIZE) {
+    paging_entry_t* ppte = get_pte_ptr(page_dir, pg);
+    if (ppte->u_s) {
+      PhysPageStat::decRefCountUser(ppte->phys_page_no << 12);
+    }
+  }
+}
+
 void map_page(phys_addr_t page_dir, uint32_t la_start, uint32_t pa_start, int map_flags) {
   paging_entry_t* ppde = GET_PDE_PTR(page_dir, la_start);
   if (!ppde->present) {
@@ -96,6 +162,24 @@ void map_region(phys_addr_t page_dir, uint32_t la_start, uint32_t pa_start, uint
   }
 }
 
+void unmap_region(phys_addr_t page_dir, uint32_t la_start, uint32_t size) {
+  assert((la_start & PAGE_OFF_MASK) == 0);
+  for (uint32_t la = la_start; la < la_start + size; la += PAGE_SIZE) {
+    paging_entry_t* ppde = GET_PDE_PTR(page_dir, la);
+    if (!ppde->present) {
+      continue;
+    }
+    paging_entry_t* ppte = get_pte_ptr(page_dir, la);
+    if (!ppte->present) {
+      continue;
+    }
+    assert(ppte->u_s);
+    PhysPageStat::decRefCountUser(ppte->phys_page_no << 12);
+    memset(ppte, 0, sizeof(*ppte));
+    asm_invlpg(la);
+  }
+}
+
 void setup_paging() {
   // NOTE: gdt is still in the range of [0x7c00, 0x7dff]
   // NOTE: not map [0, 4095] on purpose so deref NULL is invalid
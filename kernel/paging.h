@@ -31,11 +31,21 @@ static_assert(sizeof(paging_entry_t) == 4);
 extern char kernel_page_dir[];
 
 paging_entry_t* get_pte_ptr(phys_addr_t page_dir, uint32_t la);
+// return the physical address la maps to. Return 0 if la is not mapped.
+phys_addr_t virt_to_phys(phys_addr_t page_dir, uint32_t la);
+// make sure the pages covering [la, la + len) stay mapped to the same
+// physical pages while a device accesses them. Pass dev_write as true if the
+// device writes to the memory; COW pages are copied first in that case.
+// Return false if some page is not mapped.
+bool pin_pages(phys_addr_t page_dir, uint32_t la, uint32_t len, bool dev_write);
+void unpin_pages(phys_addr_t page_dir, uint32_t la, uint32_t len);
 void setup_paging();
 void release_pgdir(phys_addr_t pgdir);
 phys_addr_t clone_address_space(phys_addr_t parent_pgdir, bool use_cow);
 void map_region_alloc(phys_addr_t page_dir, uint32_t la_start, uint32_t size, int map_flags);
 void map_region(phys_addr_t page_dir, uint32_t la_start, uint32_t pa_start, uint32_t size, int map_flags);
+// unmap the present user pages in the region and drop their references
+void unmap_region(phys_addr_t page_dir, uint32_t la_start, uint32_t size);
 
 void dump_pgdir(phys_addr_t page_dir);
 void debug_paging_for_addr(uint32_t pgdir, uint32_t laddr);
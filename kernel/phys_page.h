@@ -2,12 +2,18 @@
 #define _KERNEL_PHYS_PAGE_H
 
 #include <stdint.h>
+#include <assert.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#ifdef HOST_OS
+// pages are allocated from the host heap
+typedef uintptr_t phys_addr_t;
+#else
 typedef uint32_t phys_addr_t;
+#endif
 
 phys_addr_t alloc_phys_page();
 void free_phys_page(phys_addr_t phys_addr);
@@ -54,6 +54,52 @@ int Pipe::write(const void* buf, int nbyte) {
   return cnt;
 }
 
+int Pipe::writeFrom(FileDescBase* in, int nbyte) {
+  int cnt = 0;
+  while (cnt < nbyte) {
+    int pos = write_pos_ % PIPE_BUF_SIZE;
+    // the free space up to the end of buf_
+    int len = min(nbyte - cnt, PIPE_BUF_SIZE - (write_pos_ - read_pos_));
+    len = min(len, PIPE_BUF_SIZE - pos);
+    if (len == 0) {
+      break;
+    }
+    int r = in->read(buf_ + pos, len);
+    if (r <= 0) {
+      break;
+    }
+    write_pos_ += r;
+    cnt += r;
+    if (r < len) {
+      break;
+    }
+  }
+  return cnt;
+}
+
+int Pipe::readTo(FileDescBase* out, int nbyte) {
+  int cnt = 0;
+  while (cnt < nbyte) {
+    int pos = read_pos_ % PIPE_BUF_SIZE;
+    // the data up to the end of buf_
+    int len = min(nbyte - cnt, write_pos_ - read_pos_);
+    len = min(len, PIPE_BUF_SIZE - pos);
+    if (len == 0) {
+      break;
+    }
+    int r = out->write(buf_ + pos, len);
+    if (r <= 0) {
+      break;
+    }
+    read_pos_ += r;
+    cnt += r;
+    if (r < len) {
+      break;
+    }
+  }
+  return cnt;
+}
+
 void PipeFileDesc::init(Pipe* pipeobj, bool write) {
   refcount_ = 1;
   fdtype_ = FD_PIPE;
@@ -15,6 +15,12 @@ class Pipe {
   int write_pos_;
   int read(void* buf, int nbyte);
   int write(const void* buf, int nbyte);
+  // Move up to nbyte between the pipe and another file descriptor without a
+  // user buffer. The other side reads into or writes from buf_ directly.
+  // Return the number of bytes moved which is 0 if the pipe is full (for
+  // writeFrom) or empty (for readTo).
+  int writeFrom(FileDescBase* in, int nbyte);
+  int readTo(FileDescBase* out, int nbyte);
 
   void init();
   void fini();
@@ -12,8 +12,19 @@ enum OperationCode {
   READ_CAPACITY_10 = 0x25,
   READ_10 = 0x28,
   WRITE_10 = 0x2A,
+  READ_16 = 0x88,
+  WRITE_16 = 0x8A,
+  SERVICE_ACTION_IN_16 = 0x9E,
 };
 
+// service actions of SERVICE_ACTION_IN_16
+enum ServiceAction {
+  READ_CAPACITY_16 = 0x10,
+};
+
+// the max number of blocks a READ(10)/WRITE(10) command transfers
+#define SCSI_MAX_BLOCKS_10 0xFFFF
+
 // command descriptor block
 // multi-byte fields are in big-endian order
 class CDB {
@@ -83,4 +94,66 @@ class Write10 : public CDB {
 } __attribute__((packed));
 static_assert(sizeof(Write10) == 10);
 
+// READ CAPACITY(10) returns 0xFFFFFFFF as the LBA when the device has more
+// blocks than that. READ CAPACITY(16) returns the whole LBA.
+class ReadCapacity16Response {
+ public:
+  uint64_t returned_logical_block_address() const {
+    return ntoh(returned_logical_block_address_);
+  }
+  uint32_t block_length_in_bytes() const {
+    return ntoh(block_length_in_bytes_);
+  }
+ private:
+  uint64_t returned_logical_block_address_;
+  uint32_t block_length_in_bytes_;
+  uint8_t dummy[20];
+} __attribute__((packed));
+static_assert(sizeof(ReadCapacity16Response) == 32);
+
+class ReadCapacity16 : public CDB {
+ public:
+  explicit ReadCapacity16() : CDB(SERVICE_ACTION_IN_16) {
+    allocation_length_ = hton((uint32_t) sizeof(ReadCapacity16Response));
+  }
+ private:
+  uint8_t service_action_ = READ_CAPACITY_16;
+  uint64_t lba_ = 0; // obsolete
+  uint32_t allocation_length_;
+  uint8_t reserved_ = 0;
+  uint8_t control_ = 0;
+} __attribute__((packed));
+static_assert(sizeof(ReadCapacity16) == 16);
+
+// 64 bit LBA and 32 bit transfer length
+class Read16 : public CDB {
+ public:
+  explicit Read16(uint64_t lba, uint32_t transfer_length) : CDB(READ_16) {
+    lba_ = hton(lba);
+    transfer_length_ = hton(transfer_length);
+  }
+ private:
+  uint8_t flags_ = 0;
+  uint64_t lba_;
+  uint32_t transfer_length_; // number of blocks
+  uint8_t group_number_ = 0;
+  uint8_t control_ = 0;
+} __attribute__((packed));
+static_assert(sizeof(Read16) == 16);
+
+class Write16 : public CDB {
+ public:
+  explicit Write16(uint64_t lba, uint32_t transfer_length) : CDB(WRITE_16) {
+    lba_ = hton(lba);
+    transfer_length_ = hton(transfer_length);
+  }
+ private:
+  uint8_t flags_ = 0;
+  uint64_t lba_;
+  uint32_t transfer_length_; // number of blocks
+  uint8_t group_number_ = 0;
+  uint8_t control_ = 0;
+} __attribute__((packed));
+static_assert(sizeof(Write16) == 16);
+
 }
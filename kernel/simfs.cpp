@@ -1,5 +1,12 @@
 #include <kernel/simfs.h>
+#include <kernel/dcache.h>
+#include <kernel/inode.h>
+#include <kernel/phys_page.h>
+#ifndef HOST_OS
 #include <kernel/user_process.h>
+#include <kernel/paging.h>
+#include <kernel/asm_util.h>
+#endif
 #include <string.h>
 #include <stdlib.h>
 
@@ -16,24 +23,517 @@ DirEnt* DirEntIterator::operator*() {
   return (DirEnt*) (buf_ + (entIdx_ * sizeof(DirEnt)) % BLOCK_SIZE);
 }
 
-uint32_t DirEnt::logicalToPhysBlockId(uint32_t logicalBlockId) const {
-  uint32_t phys_blk = 0;
-  if (logicalBlockId < N_DIRECT_BLOCK) {
-    phys_blk = blktable[logicalBlockId];
-  } else if (logicalBlockId < N_DIRECT_BLOCK + BLOCK_SIZE / 4) {
-    // load the indirect block. 
-    // TODO Should we cache it?
+void BlockMapCache::init() {
+  gen_ = SimFs::get().mapGen();
+  blkid_[0] = blkid_[1] = 0;
+  base_ = 0;
+}
+
+void BlockMapCache::fini() {
+  for (int i = 0; i < 2; ++i) {
+    if (data_[i]) {
+      free_phys_page((phys_addr_t) data_[i]);
+      data_[i] = nullptr;
+    }
+    blkid_[i] = 0;
+  }
+}
+
+void BlockMapCache::checkGen() {
+  if (gen_ != SimFs::get().mapGen()) {
+    // some file has been truncated. The cached blocks may have been freed.
+    init();
+  }
+}
+
+uint32_t BlockMapCache::cachedBlkid(int slot) {
+  checkGen();
+  return blkid_[slot];
+}
+
+uint32_t* BlockMapCache::load(int slot, uint32_t blkid, bool force) {
+  assert(blkid > 0);
+  checkGen();
+  if (!data_[slot]) {
+    data_[slot] = (uint32_t*) alloc_phys_page();
+  }
+  if (force || blkid_[slot] != blkid) {
+    SimFs::get().readBlock(blkid, (uint8_t*) data_[slot]);
+    blkid_[slot] = blkid;
+  }
+  return data_[slot];
+}
+
+// return the idx'th block id stored in the block blkid
+static uint32_t readBlkidEntry(uint32_t blkid, int idx, BlockMapCache* cache, int slot) {
+  if (!blkid) {
+    // no block of block ids. All the entries are holes.
+    return 0;
+  }
+  if (!cache) {
     // TODO Can we not allocate the block on stack?
-    uint32_t buf[BLOCK_SIZE / 4];
-    SimFs::get().readBlock(blktable[IND_BLOCK_IDX_1], (uint8_t*) buf);
-    phys_blk = buf[logicalBlockId - N_DIRECT_BLOCK];
+    uint32_t buf[N_BLKID_PER_BLOCK];
+    SimFs::get().readBlock(blkid, (uint8_t*) buf);
+    return buf[idx];
+  }
+  uint32_t ret = cache->load(slot, blkid)[idx];
+  if (ret == 0) {
+    // the entry may be filled after the block was cached
+    ret = cache->load(slot, blkid, true)[idx];
+  }
+  return ret;
+}
+
+uint32_t DirEnt::logicalToPhysBlockId(uint32_t logicalBlockId, BlockMapCache* cache) const {
+  assert(!isInline() && "inline files have no data block");
+  uint32_t phys_blk = 0;
+  if (SimFs::get().useExtent()) {
+    phys_blk = extentLookup(logicalBlockId, cache);
   } else {
-    assert(false && "can not fully support level-2 indirect block yet");
+    phys_blk = blktableLookup(logicalBlockId, cache);
   }
-  assert(phys_blk > 0); // 0 is the super block
+  // 0 is the super block so it can't be a data block
   return phys_blk;
 }
 
+uint32_t DirEnt::blktableLookup(uint32_t lb, BlockMapCache* cache) const {
+  if (lb < N_DIRECT_BLOCK) {
+    return blktable[lb];
+  }
+  lb -= N_DIRECT_BLOCK;
+  if (lb < N_BLKID_PER_BLOCK) {
+    return readBlkidEntry(blktable[IND_BLOCK_IDX_1], lb, cache, 1);
+  }
+  lb -= N_BLKID_PER_BLOCK;
+  assert(lb < N_BLKID_PER_BLOCK * N_BLKID_PER_BLOCK && "file too large");
+  uint32_t l2 = readBlkidEntry(blktable[IND_BLOCK_IDX_2], lb / N_BLKID_PER_BLOCK, cache, 0);
+  return readBlkidEntry(l2, lb % N_BLKID_PER_BLOCK, cache, 1);
+}
+
+// allocate a zeroed block for block ids
+static uint32_t allocBlkidBlock() {
+  uint32_t buf[N_BLKID_PER_BLOCK];
+  memset(buf, 0, sizeof(buf));
+  // goal 0 so the indirect blocks don't break up the data blocks
+  uint32_t blkid = SimFs::get().allocPhysBlk(0);
+  SimFs::get().writeBlock(blkid, (const uint8_t*) buf);
+  return blkid;
+}
+
+// store [start, start + n) to entries [idx, idx + n) of the block blkid
+static void fillBlkidEntries(uint32_t blkid, int idx, uint32_t start, int n) {
+  uint32_t buf[N_BLKID_PER_BLOCK];
+  assert(idx + n <= N_BLKID_PER_BLOCK);
+  SimFs::get().readBlock(blkid, (uint8_t*) buf);
+  for (int i = 0; i < n; ++i) {
+    buf[idx + i] = start + i;
+  }
+  SimFs::get().writeBlock(blkid, (const uint8_t*) buf);
+}
+
+void DirEnt::mapBlocks(uint32_t lb, uint32_t start, int n) {
+  while (n > 0 && lb < N_DIRECT_BLOCK) {
+    blktable[lb++] = start++;
+    --n;
+  }
+  if (n > 0 && lb < N_DIRECT_BLOCK + N_BLKID_PER_BLOCK) {
+    if (!blktable[IND_BLOCK_IDX_1]) {
+      blktable[IND_BLOCK_IDX_1] = allocBlkidBlock();
+    }
+    int idx = lb - N_DIRECT_BLOCK;
+    int cnt = min(n, N_BLKID_PER_BLOCK - idx);
+    fillBlkidEntries(blktable[IND_BLOCK_IDX_1], idx, start, cnt);
+    lb += cnt;
+    start += cnt;
+    n -= cnt;
+  }
+  if (n == 0) {
+    return;
+  }
+
+  // level-2 indirect blocks. Update the IND_BLOCK_IDX_2 block once.
+  uint32_t l1[N_BLKID_PER_BLOCK];
+  bool l1_dirty = false;
+  if (!blktable[IND_BLOCK_IDX_2]) {
+    blktable[IND_BLOCK_IDX_2] = allocBlkidBlock();
+  }
+  SimFs::get().readBlock(blktable[IND_BLOCK_IDX_2], (uint8_t*) l1);
+  while (n > 0) {
+    uint32_t off = lb - N_DIRECT_BLOCK - N_BLKID_PER_BLOCK;
+    assert(off < N_BLKID_PER_BLOCK * N_BLKID_PER_BLOCK && "file too large");
+    int l1idx = off / N_BLKID_PER_BLOCK;
+    int idx = off % N_BLKID_PER_BLOCK;
+    if (!l1[l1idx]) {
+      l1[l1idx] = allocBlkidBlock();
+      l1_dirty = true;
+    }
+    int cnt = min(n, N_BLKID_PER_BLOCK - idx);
+    fillBlkidEntries(l1[l1idx], idx, start, cnt);
+    lb += cnt;
+    start += cnt;
+    n -= cnt;
+  }
+  if (l1_dirty) {
+    SimFs::get().writeBlock(blktable[IND_BLOCK_IDX_2], (const uint8_t*) l1);
+  }
+}
+
+/*
+ * Free the data blocks in entries [from, to) of the block blkid. Clear the
+ * entries unless the whole block is going to be freed by the caller.
+ */
+static void freeBlkidEntries(uint32_t blkid, int from, int to) {
+  uint32_t buf[N_BLKID_PER_BLOCK];
+  SimFs::get().readBlock(blkid, (uint8_t*) buf);
+  int i = from;
+  while (i < to) {
+    if (!buf[i]) {
+      // a hole
+      ++i;
+      continue;
+    }
+    // free runs of contiguous blocks together
+    int n = 1;
+    while (i + n < to && buf[i + n] == buf[i] + n) {
+      ++n;
+    }
+    SimFs::get().freePhysBlks(buf[i], n);
+    i += n;
+  }
+  if (from > 0) {
+    memset(buf + from, 0, (to - from) * sizeof(uint32_t));
+    SimFs::get().writeBlock(blkid, (const uint8_t*) buf);
+  }
+}
+
+void DirEnt::truncateBlktable(uint32_t old_nblk, uint32_t new_nblk) {
+  for (uint32_t lb = new_nblk; lb < min(old_nblk, (uint32_t) N_DIRECT_BLOCK); ++lb) {
+    if (blktable[lb]) {
+      SimFs::get().freePhysBlk(blktable[lb]);
+      blktable[lb] = 0;
+    }
+  }
+
+  const uint32_t ind1_start = N_DIRECT_BLOCK;
+  const uint32_t ind2_start = ind1_start + N_BLKID_PER_BLOCK;
+  if (old_nblk > ind1_start && blktable[IND_BLOCK_IDX_1]) {
+    uint32_t from = max(new_nblk, ind1_start) - ind1_start;
+    uint32_t to = min(old_nblk, ind2_start) - ind1_start;
+    if (from < to) {
+      freeBlkidEntries(blktable[IND_BLOCK_IDX_1], from, to);
+    }
+    if (from == 0) {
+      SimFs::get().freePhysBlk(blktable[IND_BLOCK_IDX_1]);
+      blktable[IND_BLOCK_IDX_1] = 0;
+    }
+  }
+
+  if (old_nblk > ind2_start && blktable[IND_BLOCK_IDX_2]) {
+    uint32_t from = max(new_nblk, ind2_start) - ind2_start;
+    uint32_t to = old_nblk - ind2_start;
+    uint32_t l1[N_BLKID_PER_BLOCK];
+    SimFs::get().readBlock(blktable[IND_BLOCK_IDX_2], (uint8_t*) l1);
+    for (uint32_t i = from / N_BLKID_PER_BLOCK; i <= (to - 1) / N_BLKID_PER_BLOCK; ++i) {
+      if (!l1[i]) {
+        continue;
+      }
+      uint32_t base = i * N_BLKID_PER_BLOCK;
+      uint32_t s = max(from, base) - base;
+      uint32_t e = min(to, base + N_BLKID_PER_BLOCK) - base;
+      freeBlkidEntries(l1[i], s, e);
+      if (s == 0) {
+        SimFs::get().freePhysBlk(l1[i]);
+        l1[i] = 0;
+      }
+    }
+    if (from == 0) {
+      SimFs::get().freePhysBlk(blktable[IND_BLOCK_IDX_2]);
+      blktable[IND_BLOCK_IDX_2] = 0;
+    } else {
+      SimFs::get().writeBlock(blktable[IND_BLOCK_IDX_2], (const uint8_t*) l1);
+    }
+  }
+}
+
+uint32_t DirEnt::extentLookup(uint32_t logicalBlockId, BlockMapCache* cache) const {
+  uint32_t base = 0; // logical start of the current extent
+  int ninline = min(exthdr.nextent, N_INLINE_EXTENT);
+  for (int i = 0; i < ninline; ++i) {
+    const Extent& ext = exthdr.extents[i];
+    if (logicalBlockId < base + ext.len) {
+      return ext.start ? ext.start + logicalBlockId - base : 0;
+    }
+    base += ext.len;
+  }
+
+  uint32_t blk = exthdr.overflow_blk;
+  if (cache && cache->cachedBlkid(0) && cache->base_ <= logicalBlockId) {
+    // skip the overflow blocks before the cached one
+    blk = cache->cachedBlkid(0);
+    base = cache->base_;
+  }
+  // only used without a cache
+  ExtentBlock local;
+  bool reloaded = false;
+  while (blk) {
+    const ExtentBlock* eb = &local;
+    if (cache) {
+      eb = (const ExtentBlock*) cache->load(0, blk, reloaded);
+      cache->base_ = base;
+    } else {
+      SimFs::get().readBlock(blk, (uint8_t*) &local);
+    }
+    uint32_t blkbase = base;
+    for (int i = 0; i < eb->nextent; ++i) {
+      const Extent& ext = eb->extents[i];
+      if (logicalBlockId < base + ext.len) {
+        return ext.start ? ext.start + logicalBlockId - base : 0;
+      }
+      base += ext.len;
+    }
+    if (!eb->next && cache && !reloaded) {
+      // the cached block may be out of date since the file has grown
+      reloaded = true;
+      base = blkbase;
+      continue;
+    }
+    reloaded = false;
+    blk = eb->next;
+  }
+  // past the last extent
+  return 0;
+}
+
+Extent DirEnt::getExtent(int idx) const {
+  assert(idx >= 0 && idx < exthdr.nextent);
+  if (idx < N_INLINE_EXTENT) {
+    return exthdr.extents[idx];
+  }
+  idx -= N_INLINE_EXTENT;
+  ExtentBlock eb;
+  uint32_t blk = exthdr.overflow_blk;
+  while (true) {
+    assert(blk);
+    SimFs::get().readBlock(blk, (uint8_t*) &eb);
+    if (idx < N_EXTENT_PER_BLOCK) {
+      return eb.extents[idx];
+    }
+    idx -= N_EXTENT_PER_BLOCK;
+    blk = eb.next;
+  }
+}
+
+void DirEnt::setExtent(int idx, const Extent& ext) {
+  assert(idx >= 0 && idx <= exthdr.nextent);
+  bool append = (idx == exthdr.nextent);
+  if (append) {
+    ++exthdr.nextent;
+  }
+  if (idx < N_INLINE_EXTENT) {
+    exthdr.extents[idx] = ext;
+    return;
+  }
+  idx -= N_INLINE_EXTENT;
+  ExtentBlock eb;
+  uint32_t blk = exthdr.overflow_blk;
+  if (!blk) {
+    assert(append && idx == 0);
+    blk = exthdr.overflow_blk = SimFs::get().allocPhysBlk(ext.start);
+    memset(&eb, 0, sizeof(eb));
+  } else {
+    SimFs::get().readBlock(blk, (uint8_t*) &eb);
+  }
+  while (idx >= N_EXTENT_PER_BLOCK) {
+    idx -= N_EXTENT_PER_BLOCK;
+    if (!eb.next) {
+      // chain a new overflow block
+      assert(append && idx == 0);
+      eb.next = SimFs::get().allocPhysBlk(ext.start);
+      SimFs::get().writeBlock(blk, (const uint8_t*) &eb);
+      blk = eb.next;
+      memset(&eb, 0, sizeof(eb));
+    } else {
+      blk = eb.next;
+      SimFs::get().readBlock(blk, (uint8_t*) &eb);
+    }
+  }
+  eb.extents[idx] = ext;
+  if (append) {
+    assert(eb.nextent == idx);
+    eb.nextent = idx + 1;
+  }
+  SimFs::get().writeBlock(blk, (const uint8_t*) &eb);
+}
+
+void DirEnt::appendExtent(uint32_t start, uint32_t len) {
+  int n = exthdr.nextent;
+  if (n > 0) {
+    Extent last = getExtent(n - 1);
+    bool hole = (start == 0);
+    if ((last.start == 0) == hole && (hole || last.start + last.len == start)) {
+      last.len += len;
+      setExtent(n - 1, last);
+      return;
+    }
+  }
+  setExtent(n, Extent{start, len});
+}
+
+void DirEnt::truncateExtents(uint32_t new_nblk) {
+  uint32_t nblk; // the blocks covered by the extents. The rest is a hole.
+  int n = findExtent((uint32_t) -1, &nblk);
+  // free blocks from the end
+  while (nblk > new_nblk) {
+    assert(n > 0);
+    Extent ext = getExtent(n - 1);
+    uint32_t nfree = min(ext.len, nblk - new_nblk);
+    if (ext.start) {
+      SimFs::get().freePhysBlks(ext.start + ext.len - nfree, nfree);
+    }
+    ext.len -= nfree;
+    nblk -= nfree;
+    if (ext.len == 0) {
+      --n;
+    } else {
+      setExtent(n - 1, ext);
+    }
+  }
+  trimExtents(n);
+}
+
+void DirEnt::trimExtents(int n) {
+  exthdr.nextent = n;
+
+  // release the overflow blocks that are not needed any more
+  int nkeep = n - N_INLINE_EXTENT; // number of extents kept in overflow blocks
+  uint32_t blk = exthdr.overflow_blk;
+  if (nkeep <= 0) {
+    exthdr.overflow_blk = 0;
+  }
+  ExtentBlock eb;
+  while (blk && nkeep > 0) {
+    SimFs::get().readBlock(blk, (uint8_t*) &eb);
+    uint32_t next = eb.next;
+    if (nkeep <= N_EXTENT_PER_BLOCK) {
+      // the last overflow block still needed
+      eb.nextent = nkeep;
+      eb.next = 0;
+      SimFs::get().writeBlock(blk, (const uint8_t*) &eb);
+    }
+    nkeep -= N_EXTENT_PER_BLOCK;
+    blk = next;
+  }
+  while (blk) {
+    SimFs::get().readBlock(blk, (uint8_t*) &eb);
+    SimFs::get().freePhysBlk(blk);
+    blk = eb.next;
+  }
+}
+
+int DirEnt::findExtent(uint32_t lb, uint32_t* pbase) const {
+  uint32_t base = 0;
+  int ninline = min(exthdr.nextent, N_INLINE_EXTENT);
+  for (int i = 0; i < ninline; ++i) {
+    if (lb < base + exthdr.extents[i].len) {
+      *pbase = base;
+      return i;
+    }
+    base += exthdr.extents[i].len;
+  }
+  ExtentBlock eb;
+  int idx = ninline;
+  for (uint32_t blk = exthdr.overflow_blk; blk; blk = eb.next) {
+    SimFs::get().readBlock(blk, (uint8_t*) &eb);
+    for (int i = 0; i < eb.nextent; ++i, ++idx) {
+      if (lb < base + eb.extents[i].len) {
+        *pbase = base;
+        return idx;
+      }
+      base += eb.extents[i].len;
+    }
+  }
+  assert(idx == exthdr.nextent);
+  *pbase = base;
+  return idx;
+}
+
+void DirEnt::fillExtentHole(uint32_t lb, uint32_t start, uint32_t n) {
+  uint32_t base;
+  int idx = findExtent(lb, &base);
+  if (idx == exthdr.nextent) {
+    // past the last extent
+    if (lb > base) {
+      appendExtent(0, lb - base);
+    }
+    appendExtent(start, n);
+    return;
+  }
+
+  // split the hole into up to 3 extents
+  Extent hole = getExtent(idx);
+  assert(hole.start == 0 && lb + n <= base + hole.len);
+  Extent exts[3];
+  int k = 0;
+  if (lb > base) {
+    exts[k++] = Extent{0, lb - base};
+  }
+  exts[k++] = Extent{start, n};
+  if (lb + n < base + hole.len) {
+    exts[k++] = Extent{0, base + hole.len - lb - n};
+  }
+
+  // merge with the neighbors if they are physically contiguous
+  int from = idx, nold = 1;
+  if (lb == base && idx > 0) {
+    Extent prev = getExtent(idx - 1);
+    if (prev.start && prev.start + prev.len == start) {
+      exts[0] = Extent{prev.start, prev.len + n};
+      --from;
+      ++nold;
+    }
+  }
+  if (lb + n == base + hole.len && idx + 1 < exthdr.nextent) {
+    Extent next = getExtent(idx + 1);
+    if (next.start == start + n) {
+      exts[k - 1].len += next.len;
+      ++nold;
+    }
+  }
+  replaceExtents(from, nold, exts, k);
+}
+
+/*
+ * The extents after the replaced ones are moved one by one. That reads and
+ * writes an overflow block per extent moved, which is fine since files with
+ * that many extents are rare.
+ */
+void DirEnt::replaceExtents(int idx, int nold, const Extent* exts, int k) {
+  int n = exthdr.nextent;
+  assert(idx >= 0 && idx + nold <= n);
+  int shift = k - nold;
+  if (shift > 0) {
+    for (int i = 0; i < shift; ++i) {
+      // placeholders to grow the list
+      setExtent(n + i, Extent{0, 0});
+    }
+    for (int i = n - 1; i >= idx + nold; --i) {
+      setExtent(i + shift, getExtent(i));
+    }
+  } else if (shift < 0) {
+    for (int i = idx + nold; i < n; ++i) {
+      setExtent(i + shift, getExtent(i));
+    }
+    trimExtents(n + shift);
+  }
+  for (int i = 0; i < k; ++i) {
+    setExtent(idx + i, exts[i]);
+  }
+  if (max(n, n + shift) > N_INLINE_EXTENT) {
+    // the overflow blocks cached by open files are out of date
+    SimFs::get().bumpMapGen();
+  }
+}
+
 DirEntIterator DirEnt::begin() const {
   assert(isdir());
   return DirEntIterator(this, 0);
@@ -44,98 +544,137 @@ DirEntIterator DirEnt::end() const {
   return DirEntIterator(this, file_size / sizeof(DirEnt));
 }
 
-DirEnt DirEnt::findEnt(const char *name, int len) const {
+DirEnt DirEnt::findEnt(const char *name, int len, int* pidx) const {
+  if (pidx) {
+    *pidx = -1;
+  }
   if (len < 0 || len > NAME_BUF_SIZE - 1) {
     return DirEnt(); // not found
   }
   assert(isdir());
   assert(file_size % sizeof(DirEnt) == 0);
 
-  for (auto curEntPtr : *this) {
-    if (!strncmp(curEntPtr->name, name, len) && curEntPtr->name[len] == '\0') {
-      return *curEntPtr;
+  if (index_blk) {
+    DirEnt ent;
+    int idx = indexLookup(name, len, &ent);
+    if (pidx) {
+      *pidx = idx;
     }
+    return ent;
   }
-  return DirEnt(); // not found
-}
-
-// TODO: avoid duplicate code with findEnt by returning a pair of DirEnt and index
-// for findEnt
-int DirEnt::findEntIdx(const char* name, int len) const {
-  if (len < 0 || len > NAME_BUF_SIZE - 1) {
-    return -1; // not found
-  }
-  assert(isdir());
-  assert(file_size % sizeof(DirEnt) == 0);
 
 	int idx = 0;
   for (auto curEntPtr : *this) {
     if (!strncmp(curEntPtr->name, name, len) && curEntPtr->name[len] == '\0') {
-      return idx;
+      if (pidx) {
+        *pidx = idx;
+      }
+      return *curEntPtr;
     }
 		++idx;
   }
-	return -1;
+  return DirEnt(); // not found
 }
 
-/*
- * TODO: current implement is very inefficient.
- * We should move most code in FileDesc::read to DirEnt::read (not exist yet) and call this new API here.
- * DirEnt::read should be the counterpart to DirEnt::write .
- */
-DirEnt DirEnt::getEntByIdx(int idx) const {
-  assert(idx >= 0 && idx < nchild());
-  auto itr = begin();
-  for (int i = 0; i < idx; ++i) {
-    ++itr;
-  }
-  // TODO avoid double star?
-  return **itr;
+int DirEnt::findEntIdx(const char* name, int len) const {
+  int idx;
+  findEnt(name, len, &idx);
+	return idx;
 }
 
-// fail if the entry already exists
-DirEnt DirEnt::createEnt(const char* path, int pathlen, const char *name, int namelen, int8_t ent_type) {
-	assert(!findEnt(name, namelen));
-	assert(this->ent_type == ET_DIR);
-	assert(file_size % sizeof(DirEnt) == 0);
-	int pos = file_size;
-
-	resize(file_size + sizeof(DirEnt)); // file_size changed
-  // flush the parent DirEnt to disk because of it's size change
-  // TODO: call flush inside resize after we add path into in-mem view of DirEnt
-	flush(path, pathlen);
-
-	assert(file_size == pos + sizeof(DirEnt));
-
-	DirEnt newent(name, namelen, ent_type);
-	write(pos, sizeof(DirEnt), &newent);
-	return newent;
+// only reads the block containing the entry
+DirEnt DirEnt::getEntByIdx(int idx) const {
+  assert(idx >= 0 && idx < nchild());
+  DirEnt ent;
+  uint32_t blkid = logicalToPhysBlockId(idx / NDIR_ENT_PER_BLOCK);
+  SimFs::get().readBlock(blkid, (uint8_t*) &ent, sizeof(DirEnt), (idx % NDIR_ENT_PER_BLOCK) * sizeof(DirEnt));
+  return ent;
 }
 
 void DirEnt::truncate(int newsize) {
   assert(newsize <= file_size);
+  JournalTx tx;
+
+  if (isInline()) {
+    // keep the bytes past the end zero so the file can grow in place
+    memset(inline_data + newsize, 0, DIRENT_INLINE_SIZE - newsize);
+    file_size = newsize;
+    if (newsize == 0) {
+      flags &= ~DIRENT_FLAG_INLINE;
+    }
+    return;
+  }
 
   // truncate
   int old_nblk = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  assert(old_nblk < N_DIRECT_BLOCK); // TODO support indirect block
-
   int new_nblk = (newsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-  for (int lb_idx = new_nblk; lb_idx < old_nblk; ++lb_idx) {
-    assert(blktable[lb_idx] > 0);
-    SimFs::get().freePhysBlk(blktable[lb_idx]);
-    blktable[lb_idx] = 0;
+  if (SimFs::get().useExtent()) {
+    truncateExtents(new_nblk);
+  } else {
+    truncateBlktable(old_nblk, new_nblk);
+  }
+  SimFs::get().flushBitmap();
+  if (new_nblk < old_nblk) {
+    // the freed mapping blocks may be cached by open files
+    SimFs::get().bumpMapGen();
+  }
+
+  uint32_t last = (newsize % BLOCK_SIZE && !isdir()) ? logicalToPhysBlockId(newsize / BLOCK_SIZE) : 0;
+  if (last) {
+    // the file may grow again with a hole. The bytes past the end must read
+    // as zero then.
+    char block_cont[BLOCK_SIZE];
+    SimFs::get().readBlock(last, (uint8_t*) block_cont);
+    memset(block_cont + newsize % BLOCK_SIZE, 0, BLOCK_SIZE - newsize % BLOCK_SIZE);
+    SimFs::get().writeBlocks(last, 1, (const uint8_t*) block_cont);
   }
 
   file_size = newsize;
   // caller need flush the DirEnt
 }
 
-void DirEnt::resize(int newsize) {
+void DirEnt::resize(int newsize, uint32_t goal) {
 	int oldsize = file_size;
-	file_size = newsize;
-
 	assert(newsize > oldsize);
+  JournalTx tx;
+
+  bool fits_inline = !isdir() && newsize <= DIRENT_INLINE_SIZE;
+  if (fits_inline && (isInline() || (oldsize == 0 && SimFs::get().useInline()))) {
+    if (!isInline()) {
+      memset(inline_data, 0, DIRENT_INLINE_SIZE);
+      flags |= DIRENT_FLAG_INLINE;
+    }
+    file_size = newsize;
+    return;
+  }
+
+  bool use_extent = SimFs::get().useExtent();
+	assert(use_extent || (newsize - 1) / BLOCK_SIZE < N_DIRECT_BLOCK + N_BLKID_PER_BLOCK
+    + N_BLKID_PER_BLOCK * N_BLKID_PER_BLOCK);
+
+  if (!isdir()) {
+    if (isInline()) {
+      // the file outgrows the DirEnt. Move the content to a data block.
+      char block_cont[BLOCK_SIZE];
+      memset(block_cont, 0, BLOCK_SIZE);
+      memmove(block_cont, inline_data, oldsize);
+      memset(inline_data, 0, DIRENT_INLINE_SIZE);
+      flags &= ~DIRENT_FLAG_INLINE;
+      uint32_t blkid = SimFs::get().allocPhysBlk(goal);
+      if (use_extent) {
+        appendExtent(blkid, 1);
+      } else {
+        mapBlocks(0, blkid, 1);
+      }
+      SimFs::get().flushBitmap();
+      SimFs::get().writeBlocks(blkid, 1, (const uint8_t*) block_cont);
+    }
+    // the rest is a hole until it's written
+    file_size = newsize;
+    return;
+  }
+	file_size = newsize;
 
 	// may need to allocate more blocks
 	int oldLastLogBlk = (oldsize - 1) / BLOCK_SIZE;
@@ -144,72 +683,200 @@ void DirEnt::resize(int newsize) {
 	}
 	int newLastLogBlk = (newsize - 1) / BLOCK_SIZE;
 
-	assert(newLastLogBlk < N_DIRECT_BLOCK); // TODO support indirect block
+  if (oldLastLogBlk >= 0) {
+    // keep the file sequential on disk
+    goal = logicalToPhysBlockId(oldLastLogBlk) + 1;
+  }
 
   // it's possible that no new blocks need to be allocated
-	for (int lb_idx = oldLastLogBlk + 1; lb_idx <= newLastLogBlk; ++lb_idx) {
-		blktable[lb_idx] = SimFs::get().allocPhysBlk();
+  int lb_idx = oldLastLogBlk + 1;
+	while (lb_idx <= newLastLogBlk) {
+    int nalloc;
+    uint32_t start = SimFs::get().allocPhysBlks(newLastLogBlk - lb_idx + 1, goal, &nalloc);
+    if (use_extent) {
+      appendExtent(start, nalloc);
+      lb_idx += nalloc;
+    } else {
+      mapBlocks(lb_idx, start, nalloc);
+      lb_idx += nalloc;
+    }
+    goal = start + nalloc;
 	}
+  SimFs::get().flushBitmap();
 }
 
-void DirEnt::flush(const char* path, int pathlen) {
-  auto wpres = SimFs::get().walkPath(path, pathlen, true);
-  if (wpres.pathIsRoot) {
-    SimFs::get().updateRootDirEnt(*this);
-    return;
+bool DirEnt::allocBlocks(int pos, int size, uint32_t goal, BlockMapCache* cache) {
+  assert(!isdir() && !isInline());
+  if (size <= 0) {
+    return false;
+  }
+  uint32_t lb = pos / BLOCK_SIZE;
+  uint32_t end = (pos + size - 1) / BLOCK_SIZE + 1;
+  if (lb > 0) {
+    uint32_t prev = logicalToPhysBlockId(lb - 1, cache);
+    if (prev) {
+      // keep the file sequential on disk
+      goal = prev + 1;
+    }
+  }
+  bool use_extent = SimFs::get().useExtent();
+  bool allocated = false;
+  while (lb < end) {
+    uint32_t phys = logicalToPhysBlockId(lb, cache);
+    if (phys) {
+      goal = phys + 1;
+      ++lb;
+      continue;
+    }
+    int nhole = 1;
+    while (lb + nhole < end && !logicalToPhysBlockId(lb + nhole, cache)) {
+      ++nhole;
+    }
+    int nalloc;
+    uint32_t start = SimFs::get().allocPhysBlks(nhole, goal, &nalloc);
+    if (use_extent) {
+      fillExtentHole(lb, start, nalloc);
+    } else {
+      mapBlocks(lb, start, nalloc);
+    }
+    // the write will only cover part of the first or the last block. The
+    // rest of the block must read as zero like the hole did.
+    char zero[BLOCK_SIZE];
+    memset(zero, 0, BLOCK_SIZE);
+    bool head = (lb == pos / BLOCK_SIZE && pos % BLOCK_SIZE != 0);
+    if (head) {
+      SimFs::get().writeBlocks(start, 1, (const uint8_t*) zero);
+    }
+    bool tail = (lb + nalloc == end && (pos + size) % BLOCK_SIZE != 0);
+    if (tail && !(head && nalloc == 1)) {
+      SimFs::get().writeBlocks(start + nalloc - 1, 1, (const uint8_t*) zero);
+    }
+    lb += nalloc;
+    goal = start + nalloc;
+    allocated = true;
+  }
+  if (allocated) {
+    SimFs::get().flushBitmap();
+  }
+  return allocated;
+}
+
+int DirEnt::seekData(int off, bool hole, BlockMapCache* cache) const {
+  if (off < 0 || off >= file_size) {
+    return -1;
+  }
+  if (isInline()) {
+    return hole ? file_size : off;
   }
-  assert(wpres.dirent);
-  int child_idx = wpres.dirent.findEntIdx(wpres.lastItemPtr, wpres.lastItemLen);
-  wpres.dirent.write(child_idx * sizeof(DirEnt), sizeof(DirEnt), (const char*) this);
+  uint32_t nblk = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (uint32_t lb = off / BLOCK_SIZE; lb < nblk; ++lb) {
+    if ((logicalToPhysBlockId(lb, cache) == 0) == hole) {
+      return max(off, (int) (lb * BLOCK_SIZE));
+    }
+  }
+  // the implicit hole at the end of the file
+  return hole ? file_size : -1;
 }
 
-int DirEnt::write(int pos, int size, const void* buf) {
+int DirEnt::write(int pos, int size, const void* buf, BlockMapCache* cache) {
 	assert(pos >= 0);
 	assert(size >= 0);
 	assert(pos + size - 1 < file_size);
-	if (size == 0) {
-		return 0;
+	const char* src = (const char*) buf;
+	int left = size;
+
+	if (isInline()) {
+		// caller need flush the DirEnt
+		memmove(inline_data + pos, src, size);
+		return size;
 	}
 
 	char block_cont[BLOCK_SIZE];
-	if (pos % BLOCK_SIZE != 0 || size < BLOCK_SIZE) {
-		// partial block
+	if (left > 0 && (pos % BLOCK_SIZE != 0 || left < BLOCK_SIZE)) {
+		// partial head block
 		// read first, apply the update, then write back to the disk
-		readBlockForOff(pos, block_cont);
-		int ncpy = min(size, BLOCK_SIZE - pos % BLOCK_SIZE);
-		memmove(block_cont + pos % BLOCK_SIZE, buf, ncpy);
-		writeBlockForOff(pos, block_cont);
-		return write(pos + ncpy, size - ncpy, buf + ncpy) + ncpy;
-	} else {
-    #if 0
-		// whole block. no need to read the block from the disk first
-    writeBlockForOff(pos, (const char*) buf);
-    #else
-    // NOTE: even if we don't really need to copy a block from buf to block_cont,
-    // we still do that.
-    // The reason is buf may be an address from user space, which does not equal
-    // to the physical address. Copy the content over to the kernel buffer so
-    // we can use the virtual address as physically address directly.
-    //
-    // A physical address is needed to do DMA for USB drive.
-    //
-    // TODO: create a function to return physical address given a virtual address
-    memmove(block_cont, buf, BLOCK_SIZE);
-    writeBlockForOff(pos, block_cont);
-    #endif
-    return write(pos + BLOCK_SIZE, size - BLOCK_SIZE, buf + BLOCK_SIZE) + BLOCK_SIZE;
+		readBlockForOff(pos, block_cont, cache);
+		int ncpy = min(left, BLOCK_SIZE - pos % BLOCK_SIZE);
+		memmove(block_cont + pos % BLOCK_SIZE, src, ncpy);
+		writeBlockForOff(pos, block_cont, cache);
+		pos += ncpy;
+		src += ncpy;
+		left -= ncpy;
+	}
+
+	// whole blocks. No need to read them from the disk first. Each physically
+	// contiguous run is handed over at once so it can go to the device with a
+	// single command, straight from buf if the alignment allows.
+	while (left >= BLOCK_SIZE) {
+		uint32_t lb = pos / BLOCK_SIZE;
+		uint32_t start = logicalToPhysBlockId(lb, cache);
+		assert(start > 0 && "call allocBlocks before writing to a hole");
+		int n = 1;
+		while ((n + 1) * BLOCK_SIZE <= left && logicalToPhysBlockId(lb + n, cache) == start + n) {
+			++n;
+		}
+		SimFs::get().writeBlocks(start, n, (const uint8_t*) src);
+		pos += n * BLOCK_SIZE;
+		src += n * BLOCK_SIZE;
+		left -= n * BLOCK_SIZE;
 	}
+
+	if (left > 0) {
+		// partial tail block
+		readBlockForOff(pos, block_cont, cache);
+		memmove(block_cont, src, left);
+		writeBlockForOff(pos, block_cont, cache);
+	}
+	return size;
 }
 
-void DirEnt::readBlockForOff(int off, char *buf) {
+void DirEnt::readBlocks(uint32_t lb, int n, void* buf, BlockMapCache* cache) const {
+	uint8_t* dst = (uint8_t*) buf;
+	if (isInline()) {
+		assert(lb == 0 && n == 1);
+		memmove(dst, inline_data, DIRENT_INLINE_SIZE);
+		memset(dst + DIRENT_INLINE_SIZE, 0, BLOCK_SIZE - DIRENT_INLINE_SIZE);
+		return;
+	}
+	// hand each physically contiguous run over at once like write
+	while (n > 0) {
+		uint32_t start = logicalToPhysBlockId(lb, cache);
+		int cnt = 1;
+		if (!start) {
+			// holes read as zeros without I/O
+			while (cnt < n && !logicalToPhysBlockId(lb + cnt, cache)) {
+				++cnt;
+			}
+			memset(dst, 0, cnt * BLOCK_SIZE);
+			lb += cnt;
+			dst += cnt * BLOCK_SIZE;
+			n -= cnt;
+			continue;
+		}
+		while (cnt < n && logicalToPhysBlockId(lb + cnt, cache) == start + cnt) {
+			++cnt;
+		}
+		SimFs::get().readBlocks(start, cnt, dst);
+		lb += cnt;
+		dst += cnt * BLOCK_SIZE;
+		n -= cnt;
+	}
+}
+
+void DirEnt::readBlockForOff(int off, char *buf, BlockMapCache* cache) {
 	int log_blk_idx = off / BLOCK_SIZE;
-	int phys_blk_idx = logicalToPhysBlockId(log_blk_idx);
+	int phys_blk_idx = logicalToPhysBlockId(log_blk_idx, cache);
+	if (!phys_blk_idx) {
+		memset(buf, 0, BLOCK_SIZE);
+		return;
+	}
 	SimFs::get().readBlock(phys_blk_idx, (uint8_t*) buf);
 }
 
-void DirEnt::writeBlockForOff(int off, const char *buf) {
+void DirEnt::writeBlockForOff(int off, const char *buf, BlockMapCache* cache) {
 	int log_blk_idx = off / BLOCK_SIZE;
-	int phys_blk_idx = logicalToPhysBlockId(log_blk_idx);
+	int phys_blk_idx = logicalToPhysBlockId(log_blk_idx, cache);
+	assert(phys_blk_idx > 0 && "call allocBlocks before writing to a hole");
 	SimFs::get().writeBlock(phys_blk_idx, (const uint8_t*) buf);
 }
 
@@ -229,39 +896,108 @@ int SimFs::blockIdToSectorNo(int blockId) {
  * len < BLOCK_SIZE. Treat len as an hint so readBlock can read less
  * data if possible.
  */
-void SimFs::readBlock(int blockId, uint8_t buf[], int len) {
-  assert(len > 0 && len <= BLOCK_SIZE);
+void SimFs::readBlock(int blockId, uint8_t buf[], int len, int off) {
+  bufCache_.read(blockId, buf, off, len);
+}
+
+int SimFs::writeBlock(int blockId, const uint8_t* buf) {
+  if (bufCache_.write(blockId, buf) < 0) {
+    return -1;
+  }
+  if (journal_.enabled() && journal_.inTransaction()) {
+    return journal_.addBlock(blockId);
+  }
+  return 0;
+}
 
-  // TODO take advantage of len
+void SimFs::readBlocks(int blockId, int n, uint8_t* buf) {
+  bufCache_.readRun(blockId, n, buf);
+}
 
+void SimFs::writeBlocks(int blockId, int n, const uint8_t* buf) {
+  bufCache_.writeRun(blockId, n, buf);
+}
+
+void SimFs::readBlockFromDev(int blockId, uint8_t* buf) {
+  readBlocksFromDev(blockId, 1, buf);
+}
+
+void SimFs::readBlocksFromDev(int blockId, int n, uint8_t* buf) {
+  assert(n > 0);
+  assert(n <= maxDevIOBlocks());
+  DevBusyScope dev_busy;
 #if USB_BOOT
+  phys_addr_t pgdir = asm_get_cr3();
+  bool pinned = pin_pages(pgdir, (uint32_t) buf, n * BLOCK_SIZE, true);
+  assert(pinned && "readBlocksFromDev buffer not mapped");
   // a usb block is actually a sector
-  dev_.readBlocks(blockIdToUSBSectorNo(blockId), SECTORS_PER_BLOCK, buf);
+  dev_.readBlocks(blockIdToUSBSectorNo(blockId), n * SECTORS_PER_BLOCK, buf);
+  unpin_pages(pgdir, (uint32_t) buf, n * BLOCK_SIZE);
 #else
-  dev_.read(buf, blockIdToSectorNo(blockId), SECTORS_PER_BLOCK);
+  dev_.read(buf, blockIdToSectorNo(blockId), n * SECTORS_PER_BLOCK);
 #endif
 }
 
-void SimFs::writeBlock(int blockId, const uint8_t* buf) {
+void SimFs::readaheadBlocks(int blockId, int n) {
+  bufCache_.readahead(blockId, n);
+}
+
+void SimFs::writeBlockToDev(int blockId, const uint8_t* buf) {
+  writeBlocksToDev(blockId, 1, buf);
+}
+
+void SimFs::writeBlocksToDev(int blockId, int n, const uint8_t* buf) {
+  assert(n > 0);
+  assert(n <= maxDevIOBlocks());
+  DevBusyScope dev_busy;
 #if USB_BOOT
-  dev_.writeBlocks(blockIdToUSBSectorNo(blockId), SECTORS_PER_BLOCK, buf);
+  phys_addr_t pgdir = asm_get_cr3();
+  bool pinned = pin_pages(pgdir, (uint32_t) buf, n * BLOCK_SIZE, false);
+  assert(pinned && "writeBlocksToDev buffer not mapped");
+  dev_.writeBlocks(blockIdToUSBSectorNo(blockId), n * SECTORS_PER_BLOCK, buf);
+  unpin_pages(pgdir, (uint32_t) buf, n * BLOCK_SIZE);
 #else
-	dev_.write(buf, blockIdToSectorNo(blockId), SECTORS_PER_BLOCK);
+	dev_.write(buf, blockIdToSectorNo(blockId), n * SECTORS_PER_BLOCK);
 #endif
 }
 
+void SimFs::sync() {
+  assert(!journal_.inTransaction());
+  DevBusyScope dev_busy;
+  flushBitmap();
+  journal_.commit();
+  bufCache_.sync();
+}
+
 void SimFs::init() {
   uint8_t buf[BLOCK_SIZE];
 #if USB_BOOT
   extern MassStorageDevice<XHCIDriver> msd_dev;
   dev_ = msd_dev;
+#elif defined(HOST_OS)
+  dev_ = host_dev;
 #else
   // hardcode to use the slave IDE device for the filesystem for now
   dev_ = createSlaveIDE();
 #endif
+  bufCache_.init();
   readBlock(0, buf, sizeof(SuperBlock));
 
   superBlock_ = *((SuperBlock*) buf);
+  if (useJournal()) {
+    assert(useBitmap() && "the journal requires the bitmap allocator");
+    journal_.init(superBlock_.journal_start, superBlock_.journal_nblocks);
+    journal_.replay();
+    // the super block may have been replayed
+    readBlock(0, buf, sizeof(SuperBlock));
+    superBlock_ = *((SuperBlock*) buf);
+  }
+  if (useBitmap()) {
+    bitmap_.init(superBlock_.bitmap_start, superBlock_.bitmap_nblocks, superBlock_.tot_block, useJournal());
+  }
+  InodeTable::get().init(superBlock_.rootdir);
+  DentryCache::get().init();
+  PageCache::get().init();
   printf("Total number of block in super block %d\n", superBlock_.tot_block);
 }
 
@@ -270,19 +1006,77 @@ DirEnt SimFs::walkPath(const char* path) {
 }
 
 WalkPathResult SimFs::walkPath(const char* path, int pathlen, bool returnParent) {
+  WalkPathResult wpres;
+  Dentry* d = walkDentry(path, pathlen, returnParent, &wpres.lastItemPtr, &wpres.lastItemLen);
+  wpres.pathIsRoot = (d == DentryCache::get().root() && !wpres.lastItemPtr);
+  if (!d || d->negative()) {
+    return wpres;
+  }
+  if (returnParent && (wpres.pathIsRoot || !d->inode_->dirent_.isdir())) {
+    // the root dir does not have a parent and a file can not be a parent
+    return wpres;
+  }
+  wpres.dirent = d->inode_->dirent_;
+  return wpres;
+}
+
+Dentry* SimFs::lookupDentry(const char* path, int pathlen) {
+  return walkDentry(path, pathlen, false, nullptr, nullptr);
+}
+
+Inode* SimFs::lookupInode(const char* path) {
+  Dentry* d = lookupDentry(path, strlen(path));
+  if (!d || d->negative()) {
+    return nullptr;
+  }
+  d->inode_->incref();
+  return d->inode_;
+}
+
+Dentry* SimFs::walkOneLevel(Dentry* parent, const char* name, int len) {
+  if (parent->negative() || !parent->inode_->dirent_.isdir()) {
+    return nullptr;
+  }
+  auto& dcache = DentryCache::get();
+  Dentry* d = dcache.lookup(parent, name, len);
+  if (d) {
+    return d;
+  }
+  if (len > NAME_BUF_SIZE - 1) {
+    // such a name can not exist. Don't bother caching it.
+    return nullptr;
+  }
+  const DirEnt& parent_dirent = parent->inode_->dirent_;
+  int idx;
+  DirEnt ent = parent_dirent.findEnt(name, len, &idx);
+  Inode* ino = nullptr;
+  if (ent) {
+    uint32_t blkid = parent_dirent.logicalToPhysBlockId(idx / NDIR_ENT_PER_BLOCK);
+    // the inode may already exist if the file is open
+    ino = InodeTable::get().acquire(blkid, idx, ent);
+  }
+  d = dcache.add(parent, name, len, ino);
+  if (ino) {
+    // the dentry holds its own reference
+    ino->decref();
+  }
+  return d;
+}
+
+Dentry* SimFs::walkDentry(const char* path, int pathlen, bool returnParent, const char** plastItemPtr, int* plastItemLen) {
   assert(pathlen >= 0);
   const char* end = path + pathlen;
   const char* cur = path;
-  WalkPathResult wpres;
+  Dentry* parent = DentryCache::get().root();
+  if (plastItemPtr) {
+    *plastItemPtr = nullptr;
+    *plastItemLen = 0;
+  }
   while (cur != end && *cur == '/') {
     ++cur;
   }
   if (cur == end) {
-    wpres.pathIsRoot = true;
-    if (!returnParent) {
-      wpres.dirent = superBlock_.rootdir;
-    }
-    return wpres;
+    return parent;
   }
   const char* curend = cur;
   while (curend != end && *curend != '/') {
@@ -290,10 +1084,9 @@ WalkPathResult SimFs::walkPath(const char* path, int pathlen, bool returnParent)
   }
   assert(curend - cur > 0);
 
-  DirEnt parentDirEnt = superBlock_.rootdir;
   // loop invariant:
   // - [cur, curend) represents the current path item
-  // - parentDirEnt is for the parent direcotry of it.
+  // - parent is the dentry for the parent direcotry of it.
   // exit the loop if there is no more path items
   const char* next;
   while (true) {
@@ -305,10 +1098,9 @@ WalkPathResult SimFs::walkPath(const char* path, int pathlen, bool returnParent)
       break;
     }
     // walk the path one level
-    parentDirEnt = parentDirEnt.findEnt(cur, curend - cur);
-    if (!parentDirEnt) {
-      assert(!wpres.dirent);
-      return wpres;
+    parent = walkOneLevel(parent, cur, curend - cur);
+    if (!parent || parent->negative()) {
+      return nullptr;
     }
     cur = next;
     curend = cur;
@@ -318,68 +1110,93 @@ WalkPathResult SimFs::walkPath(const char* path, int pathlen, bool returnParent)
   }
 
   if (returnParent) {
-    wpres.dirent = parentDirEnt;
-    wpres.lastItemPtr = cur;
-    wpres.lastItemLen = curend - cur;
+    *plastItemPtr = cur;
+    *plastItemLen = curend - cur;
+    return parent;
   } else {
-    wpres.dirent = parentDirEnt.findEnt(cur, curend - cur); 
+    return walkOneLevel(parent, cur, curend - cur);
   }
-  return wpres;
 }
 
-DirEnt SimFs::createFile(const char* path) {
-  auto wpres = walkPath(path, strlen(path), true);
-  if (!wpres.dirent) { // fail to walk to the parent directory
-    return wpres.dirent;
+// the caller should make sure the entry does not exist yet
+Inode* SimFs::createEnt(Inode* parent, const char *name, int namelen, int8_t ent_type) {
+  DirEnt& parent_dirent = parent->dirent_;
+	assert(parent_dirent.ent_type == ET_DIR);
+	assert(parent_dirent.file_size % sizeof(DirEnt) == 0);
+	int pos = parent_dirent.file_size;
+  JournalTx tx;
+
+	parent_dirent.resize(pos + sizeof(DirEnt), parent->blkid_); // file_size changed
+  // flush the parent DirEnt to disk because of it's size change
+	parent->flush();
+
+	assert(parent_dirent.file_size == pos + sizeof(DirEnt));
+
+	DirEnt newent(name, namelen, ent_type);
+	parent_dirent.write(pos, sizeof(DirEnt), &newent);
+
+  int idx = pos / sizeof(DirEnt);
+  uint32_t old_index_blk = parent_dirent.index_blk;
+  if (parent_dirent.index_blk) {
+    parent_dirent.indexAdd(name, namelen, idx);
+  } else if (SimFs::get().useDirIndex() && parent_dirent.nchild() >= DIRINDEX_MIN_NCHILD) {
+    // the directory becomes large. Index all the entries including the new one
+    parent_dirent.buildIndex();
+  }
+  if (parent_dirent.index_blk != old_index_blk) {
+    parent->flush();
+  }
+  uint32_t blkid = parent_dirent.logicalToPhysBlockId(idx / NDIR_ENT_PER_BLOCK);
+  return InodeTable::get().acquire(blkid, idx, newent);
+}
+
+Inode* SimFs::createPath(const char* path, int8_t ent_type, bool* pexisted) {
+  const char* name;
+  int namelen;
+  *pexisted = false;
+  Dentry* parent = walkDentry(path, strlen(path), true, &name, &namelen);
+  if (!parent || parent->negative() || !name) {
+    // fail to walk to the parent directory or path is the root directory
+    return nullptr;
+  }
+  Dentry* d = walkOneLevel(parent, name, namelen);
+  if (!d) {
+    // the parent is not a directory or the name is too long
+    return nullptr;
+  }
+  if (!d->negative()) {
+    *pexisted = true;
+    d->inode_->incref();
+    return d->inode_;
   }
-  /*
-   * TODO: we need pass the path fragment for parent to createFile since so we
-   * can use it to keep the DirEnt on disk up to date.
-   *
-   * It's much better and straightforward if we record the path for an file/dir in
-   * it's DirEnt. The problem here is:
-   * 1. we don't want to store the path on disk since that's a waste of space
-   * 2. we need store the path in DirEnt when it's loaded to memory
-   *
-   * That being said, we would need 2 views of DirEnt:
-   * - an on-disk view WITHOUT the path field
-   * - an in-memory view WITH the path field
-   */
-  return wpres.dirent.createFile(path, wpres.lastItemPtr - path, wpres.lastItemPtr, wpres.lastItemLen);
+  Inode* ino = createEnt(parent->inode_, name, namelen, ent_type);
+  // turn the negative dentry into a positive one
+  DentryCache::get().add(parent, name, namelen, ino);
+  return ino;
+}
+
+Inode* SimFs::createFile(const char* path) {
+  bool existed;
+  return createPath(path, ET_FILE, &existed);
 }
 
 int SimFs::mkdir(const char* path) {
   char* fullpath = normalizePath(path);
-  auto wpres = walkPath(fullpath, strlen(fullpath), true);
-  DirEnt sub, newent;
-  int r = -1;
+  bool existed;
   // TODO: add an option to create parent directory if not exists yet.
-  if (!wpres.dirent) {
+  Inode* ino = createPath(fullpath, ET_DIR, &existed);
+  int r = -1;
+  if (!ino) {
     r = -1;
-    goto out;
-  }
-
-  sub = wpres.dirent.findEnt(wpres.lastItemPtr, wpres.lastItemLen);
-  if (sub) {
-    // already exist
-    if (sub.ent_type == ET_DIR) {
-      r = 0;
-      goto out;
-    } else {
-      r = -1; // already exist as a non-dir
-      goto out;
-    }
-  }
-
-  newent = wpres.dirent.createEnt(fullpath, wpres.lastItemPtr - fullpath, wpres.lastItemPtr, wpres.lastItemLen, ET_DIR);
-  if (newent) {
-    r = 1;
-    goto out;
+  } else if (existed) {
+    // return 0 if already exist as a dir; -1 if already exist as a non-dir
+    r = ino->dirent_.ent_type == ET_DIR ? 0 : -1;
   } else {
-    r = -1;
-    goto out;
+    r = 1;
+  }
+  if (ino) {
+    ino->decref();
   }
-out:
   free(fullpath);
   return r;
 }
@@ -394,34 +1211,62 @@ int SimFs::removeDirEnt(const char* path) {
     // can not remove the root directory
     return -1;
   }
-  auto wpres = SimFs::get().walkPath(path, strlen(path), true);
-  assert(!wpres.pathIsRoot);
-  assert(wpres.dirent);
-
-  auto& parent_dirent = wpres.dirent;
-  int cur_idx = parent_dirent.findEntIdx(wpres.lastItemPtr, wpres.lastItemLen);
-  assert(cur_idx >= 0 && cur_idx < parent_dirent.nchild());
-
+  const char* name;
+  int namelen;
+  Dentry* parent_dentry = walkDentry(path, strlen(path), true, &name, &namelen);
+  assert(parent_dentry && !parent_dentry->negative() && name);
+  Dentry* cur_dentry = walkOneLevel(parent_dentry, name, namelen);
+  assert(cur_dentry && !cur_dentry->negative());
+
+  Inode* parent = parent_dentry->inode_;
+  Inode* cur = cur_dentry->inode_;
+  auto& parent_dirent = parent->dirent_;
+  JournalTx tx;
+  auto& itab = InodeTable::get();
+  int cur_idx = cur->idx_;
   int last_idx = parent_dirent.nchild() - 1;
+  assert(cur_idx >= 0 && cur_idx <= last_idx);
 
-  auto cur_ent = parent_dirent.getEntByIdx(cur_idx);
-  auto last_ent = parent_dirent.getEntByIdx(last_idx);
-
-  if (cur_ent.ent_type == ET_FILE) {
-    cur_ent.truncate();
-  } else if (cur_ent.ent_type == ET_DIR) {
-    assert(cur_ent.file_size == 0 && "directory should already be empty");
+  if (cur->dirent_.ent_type == ET_FILE) {
+    cur->dirent_.truncate();
+    PageCache::get().truncate(cur, 0);
+  } else if (cur->dirent_.ent_type == ET_DIR) {
+    assert(cur->dirent_.file_size == 0 && "directory should already be empty");
   } else {
     assert(false && "invalid ent type");
   }
-  // no need to flush cur_ent since it will be overriden right away
-
-  parent_dirent.write(cur_idx * sizeof(DirEnt), sizeof(DirEnt), &last_ent);
+  // no need to flush cur since it will be overriden right away. The inode
+  // may be kept alive by open files; make sure it's not found by the location
+  // any more.
+  itab.unlink(cur);
+
+  if (cur_idx != last_idx) {
+    // move the last entry into the hole
+    uint32_t last_blkid = parent_dirent.logicalToPhysBlockId(last_idx / NDIR_ENT_PER_BLOCK);
+    Inode* moved = itab.find(last_blkid, last_idx);
+    // the inode is more up to date than the disk if it exists
+    DirEnt last_ent = moved ? moved->dirent_ : parent_dirent.getEntByIdx(last_idx);
+    parent_dirent.write(cur_idx * sizeof(DirEnt), sizeof(DirEnt), &last_ent);
+    if (moved) {
+      itab.relocate(moved, cur->blkid_, cur_idx);
+    }
+    if (parent_dirent.index_blk) {
+      parent_dirent.indexRemove(name, namelen, cur_idx);
+      parent_dirent.indexMove(last_ent.name, strlen(last_ent.name), last_idx, cur_idx);
+    }
+  } else if (parent_dirent.index_blk) {
+    parent_dirent.indexRemove(name, namelen, cur_idx);
+  }
   parent_dirent.truncate(parent_dirent.file_size - sizeof(DirEnt));
+  if (parent_dirent.index_blk && parent_dirent.nchild() == 0) {
+    parent_dirent.freeIndex();
+  }
 
   // flush the size change of parent_dirent
-  parent_dirent.flush(path, wpres.lastItemPtr - path);
+  parent->flush();
 
+  // this releases the reference to cur held by the dentry
+  DentryCache::get().makeNegative(cur_dentry);
   return 0;
 }
 
@@ -474,7 +1319,21 @@ out:
   return r;
 }
 
-uint32_t SimFs::allocPhysBlk() {
+uint32_t SimFs::allocPhysBlk(uint32_t goal) {
+  int nalloc;
+  return allocPhysBlks(1, goal, &nalloc);
+}
+
+uint32_t SimFs::allocPhysBlks(int n, uint32_t goal, int* pnalloc) {
+  if (useBitmap()) {
+    uint32_t ret = bitmap_.alloc(n, goal, pnalloc);
+    assert(*pnalloc > 0 && "Out of disk space");
+    #if DEBUG
+    printf("Allocate phys blk %d-%d\n", ret, ret + *pnalloc - 1);
+    #endif
+    return ret;
+  }
+  *pnalloc = 1;
 	assert(superBlock_.freelist != 0 && "Out of disk space");
 	int ret = superBlock_.freelist;
 	char buf[BLOCK_SIZE];
@@ -493,6 +1352,10 @@ void SimFs::freePhysBlk(int phys_blkid) {
   #if DEBUG
   printf("Free phys blk %d\n", phys_blkid);
   #endif
+  if (useBitmap()) {
+    bitmap_.free(phys_blkid);
+    return;
+  }
   char buf[BLOCK_SIZE];
 
   // TODO: only need write the first 4 bytes
@@ -503,8 +1366,42 @@ void SimFs::freePhysBlk(int phys_blkid) {
   flushSuperBlock(); // TODO: do this lazily?
 }
 
+void SimFs::freePhysBlks(uint32_t start, int n) {
+  if (useBitmap()) {
+    bitmap_.free(start, n);
+    return;
+  }
+  for (int i = 0; i < n; ++i) {
+    freePhysBlk(start + i);
+  }
+}
+
+void SimFs::flushBitmap() {
+  if (useBitmap()) {
+    // the bitmap may say a block is free only after the metadata referring to
+    // it is gone, so it always goes through the journal
+    JournalTx tx;
+    bitmap_.flush();
+  }
+}
+
+void SimFs::releaseFreedBlocks() {
+  if (useBitmap()) {
+    bitmap_.releasePending();
+  }
+}
+
+int SimFs::countFreeBlocks() {
+  if (useBitmap()) {
+    return bitmap_.countFree();
+  }
+  // walking the free list costs a read per free block
+  return -1;
+}
+
 void SimFs::updateRootDirEnt(const DirEnt& newent) {
 	superBlock_.rootdir = newent;
+  InodeTable::get().root()->dirent_ = newent;
 	flushSuperBlock();
 }
 
@@ -515,27 +1412,20 @@ void SimFs::flushSuperBlock() {
 	writeBlock(0, (const uint8_t*) buf);
 }
 
-static uint8_t a_phys_buf[BLOCK_SIZE];
 uint8_t* SimFs::readFile(const char* path, int* psize) {
   auto dent = walkPath(path);
   if (!dent) {
     printf("Path does not exist %s\n", path);
     return nullptr;
   }
-  uint8_t* buf = (uint8_t*) malloc(ROUND_UP(dent.file_size, BLOCK_SIZE));
-  uint8_t* ptr = buf;
-  for (int i = 0; i < dent.file_size; i += BLOCK_SIZE) {
-    uint32_t logical_blkid = i / BLOCK_SIZE;
-    uint32_t phys_blkid = dent.logicalToPhysBlockId(logical_blkid);
-
-    // TODO since readBlock requires a physical memory, we can not read into
-    // 'ptr' directly. Use a_phys_buf as a bridge.
-    // An alternative is to create an API to map virtual address to physical
-    // address. In that case, we should be able to avoid the memmove.
-    readBlock(phys_blkid, a_phys_buf);
-    memmove(ptr, a_phys_buf, BLOCK_SIZE);
-    ptr += BLOCK_SIZE;
+  int nblk = (dent.file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint8_t* buf = (uint8_t*) malloc(nblk * BLOCK_SIZE);
+  BlockMapCache cache;
+  cache.init();
+  if (nblk > 0) {
+    dent.readBlocks(0, nblk, buf, &cache);
   }
+  cache.fini();
   if (psize) {
     *psize = dent.file_size;
   }
@@ -544,7 +1434,12 @@ uint8_t* SimFs::readFile(const char* path, int* psize) {
 
 // caller should free the returned buffer;
 char *SimFs::normalizePath(const char* path) {
+#ifdef HOST_OS
+  // the host program works from the root
+  const char* cwd = "/";
+#else
   const char* cwd = UserProcess::current()->getCwd();
+#endif
   char* fullpath = nullptr;
   if (path[0] == '/') {
     // absolute path
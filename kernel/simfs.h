@@ -11,12 +11,20 @@
 
 #include <stdint.h>
 #include <string.h>
+#ifdef HOST_OS
+#include <kernel/host_os.h>
+#include <cinc/dirent.h>
+#else
 #include <dirent.h>
+#endif
+#include <kernel/bufcache.h>
+#include <kernel/blkbitmap.h>
+#include <kernel/journal.h>
 
 #if USB_BOOT
 #include <kernel/usb/xhci.h>
 #include <kernel/usb/msd.h>
-#else
+#elif !defined(HOST_OS)
 #include <kernel/ide.h>
 #endif
 
@@ -27,6 +35,8 @@
 #define NAME_BUF_SIZE 64
 #define BLOCK_SIZE 4096
 #define SECTORS_PER_BLOCK ((BLOCK_SIZE / SECTOR_SIZE))
+// max number of blocks per device I/O to the caller's buffer (8MB)
+#define SIMFS_MAX_DEV_IO_BLOCKS 2048
 /*
  * The max file will contains N_DIRECT_BLOCK + BLOCK_SIZE / 4 + BLOCK_SIZE / 4 * BLOCK_SIZE / 4 = 1049610 blocks
  * which is 4299202560 bytes (~= 4GiB)
@@ -35,8 +45,130 @@
 // indirect block index
 #define IND_BLOCK_IDX_1 (N_DIRECT_BLOCK)
 #define IND_BLOCK_IDX_2 (IND_BLOCK_IDX_1 + 1)
+// number of block ids in an indirect block
+#define N_BLKID_PER_BLOCK (BLOCK_SIZE / 4)
 
 class DirEntIterator;
+class Dentry;
+class Inode;
+
+/*
+ * Caches the block mapping metadata read by the last lookups of a file: the
+ * indirect blocks for the blktable format or an overflow block for the extent
+ * format. Sequential access to a big file then reads the metadata once per
+ * N_BLKID_PER_BLOCK blocks rather than once per block.
+ *
+ * Each open file owns one. A cached block can become stale after the file
+ * changes size:
+ * - growing a file only fills entries that were empty before. Lookups reload
+ *   the block when they hit an empty entry.
+ * - truncating any file bumps SimFs::mapGen(), which invalidates all caches.
+ * - filling a hole only fills entries that were empty before as well, except
+ *   for extent overflow blocks which may shift. That bumps SimFs::mapGen().
+ */
+class BlockMapCache {
+ public:
+  void init();
+  // release the pages
+  void fini();
+  // return the cached content of blkid in the slot. Read the block if it's
+  // not cached yet or force is true.
+  uint32_t* load(int slot, uint32_t blkid, bool force = false);
+  // return 0 if nothing is cached in the slot
+  uint32_t cachedBlkid(int slot);
+
+  // extent format only: logical block id of the first extent in the cached
+  // overflow block
+  uint32_t base_;
+ private:
+  void checkGen();
+
+  uint32_t gen_;
+  // blktable format: slot 0 for the IND_BLOCK_IDX_2 block; slot 1 for the
+  // block of block ids (IND_BLOCK_IDX_1 block or a level-2 block).
+  // extent format: slot 0 for an overflow block.
+  uint32_t blkid_[2];
+  uint32_t* data_[2] = {nullptr, nullptr}; // physical pages allocated on demand
+};
+
+/*
+ * Format v2 (SB_FLAG_EXTENT) maps a file with extents rather than per-block
+ * pointers. An extent is a run of physically contiguous blocks. Extents are
+ * stored in logical order; the logical start of an extent is the sum of the
+ * lengths of the extents before it.
+ *
+ * The first N_INLINE_EXTENT extents are stored inside the DirEnt in place of
+ * blktable. The rest are stored in a chain of overflow blocks.
+ *
+ * An extent with start 0 is a hole. Blocks past the last extent are holes as
+ * well.
+ */
+struct Extent {
+  uint32_t start; // first physical block
+  uint32_t len; // number of blocks
+} __attribute__((packed));
+
+#define N_INLINE_EXTENT 5
+
+struct ExtentHeader {
+  uint32_t nextent; // total number of extents including those in the overflow blocks
+  uint32_t overflow_blk; // the first overflow block. 0 if there is none
+  Extent extents[N_INLINE_EXTENT];
+} __attribute__((packed));
+
+#define N_EXTENT_PER_BLOCK ((BLOCK_SIZE - 8) / sizeof(Extent))
+
+struct ExtentBlock {
+  uint32_t nextent; // number of extents in this block
+  uint32_t next; // the next overflow block. 0 if this is the last one
+  Extent extents[N_EXTENT_PER_BLOCK];
+} __attribute__((packed));
+
+static_assert(sizeof(ExtentHeader) == (IND_BLOCK_IDX_2 + 1) * 4); // the size of blktable
+static_assert(sizeof(ExtentBlock) == BLOCK_SIZE);
+
+// hashed directory index. Check kernel/dirindex.cpp
+// max number of hash buckets. Must be a power of 2.
+#define DIRINDEX_MAX_NBUCKET 512
+// a directory gets an index once it has this many entries
+#define DIRINDEX_MIN_NCHILD (NDIR_ENT_PER_BLOCK * 4)
+
+struct DirIndexRoot {
+  uint32_t nbucket; // a power of 2
+  uint32_t leaves[DIRINDEX_MAX_NBUCKET]; // the first leaf of each bucket
+  // buckets [0, nsplit) have been split into themselves and
+  // [nbucket, nbucket + nsplit)
+  uint32_t nsplit;
+  uint8_t padding[BLOCK_SIZE - 8 - DIRINDEX_MAX_NBUCKET * 4];
+} __attribute__((packed));
+
+struct DirIndexSlot {
+  uint32_t hash; // hash of the name
+  uint32_t idx; // index of the entry in the directory
+} __attribute__((packed));
+
+#define N_DIRINDEX_SLOT_PER_BLOCK ((BLOCK_SIZE - 8) / sizeof(DirIndexSlot))
+
+struct DirIndexLeaf {
+  uint32_t nslot; // number of slots used in this block
+  uint32_t next; // the next leaf in the chain. 0 if this is the last one
+  DirIndexSlot slots[N_DIRINDEX_SLOT_PER_BLOCK];
+} __attribute__((packed));
+
+static_assert(sizeof(DirIndexLeaf) == BLOCK_SIZE);
+static_assert(sizeof(DirIndexRoot) == BLOCK_SIZE);
+
+/*
+ * On SB_FLAG_INLINE images a regular file of at most DIRENT_INLINE_SIZE bytes
+ * keeps its content inside the DirEnt in place of blktable/exthdr and has no
+ * data block. Reading it costs no I/O beyond the lookup. The file is moved to
+ * a data block once it grows past DIRENT_INLINE_SIZE. Since the content is
+ * part of the DirEnt, writes to it go through the journal like other metadata.
+ */
+#define DIRENT_INLINE_SIZE ((IND_BLOCK_IDX_2 + 1) * 4)
+
+// DirEnt::flags
+#define DIRENT_FLAG_INLINE 1
 
 // like an inode in linux.
 class DirEnt {
@@ -51,13 +183,24 @@ class DirEnt {
 		file_size = 0;
 		memset((void*) blktable, 0, sizeof(blktable));
 		this->ent_type = ent_type;
+		index_blk = 0;
+		flags = 0;
+		memset(padding, 0, sizeof(padding));
   }
 
   char name[NAME_BUF_SIZE]; // 64 bytes. This is the component name rather than the full path
   uint32_t file_size; // 4 bytes
-  uint32_t blktable[IND_BLOCK_IDX_2 + 1]; // 12 * 4 = 48 bytes
+  union {
+    uint32_t blktable[IND_BLOCK_IDX_2 + 1]; // 12 * 4 = 48 bytes
+    ExtentHeader exthdr; // for SB_FLAG_EXTENT images
+    char inline_data[DIRENT_INLINE_SIZE]; // for DIRENT_FLAG_INLINE files
+  };
   int8_t ent_type; // check DIR_ENT_TYPE
-  char padding[128 - (NAME_BUF_SIZE + 4 + (IND_BLOCK_IDX_2 + 1) * 4 + 1)]; // pad to 128 bytes
+  // directories only: the root block of the hashed index. 0 if the directory
+  // is not indexed.
+  uint32_t index_blk;
+  uint8_t flags; // check DIRENT_FLAG_*
+  char padding[128 - (NAME_BUF_SIZE + 4 + (IND_BLOCK_IDX_2 + 1) * 4 + 1 + 4 + 1)]; // pad to 128 bytes
 
   const char* typestr() const {
     switch (ent_type) {
@@ -80,34 +223,97 @@ class DirEnt {
   DirEntIterator end() const;
 
   DirEnt getEntByIdx(int idx) const;
-  DirEnt findEnt(const char *name, int len) const;
+  // if pidx is not null, the index of the found entry is stored there.
+  DirEnt findEnt(const char *name, int len, int* pidx = nullptr) const;
 	int findEntIdx(const char *name, int len) const;
-	// the name should not contains slash and not empty
-	DirEnt createFile(const char *path, int pathlen, const char *name, int namelen) {
-		return createEnt(path, pathlen, name, namelen, ET_FILE);
-  }
-	DirEnt createEnt(const char *path, int pathlen, const char *name, int namelen, int8_t ent_type);
-
-  void flush(const char* path, int pathlen);
   // assumes the range [pos, pos + size) is completed inside the file
-	int write(int pos, int size, const void* buf);
+	int write(int pos, int size, const void* buf, BlockMapCache* cache = nullptr);
+  // read n whole blocks starting from logical block lb. Check BufCache::readRun
+  void readBlocks(uint32_t lb, int n, void* buf, BlockMapCache* cache = nullptr) const;
   // TODO: combine the following 2 APIs to a general resize call
   // only support growing the size for now.
-  // Let caller handle flushing since flushing requires full path of the file. We don't want to pass in the full path for this API.
-	void resize(int newsize);
-  // Let caller handle flushing since flushing requires full path of the file. We don't want to pass in the full path for this API.
+  // Let caller handle flushing by calling Inode::flush since a DirEnt does not know where it's stored on disk.
+  // A directory gets the new blocks right away: near goal if it's empty so
+  // far; otherwise right after the current last block. A regular file grows
+  // with a hole. Check allocBlocks.
+	void resize(int newsize, uint32_t goal = 0);
+  // allocate blocks for the holes in the byte range [pos, pos + size) of a
+  // regular file before writing to it. A new block only partially covered by
+  // the range is zeroed. Blocks go right after the preceding block of the
+  // file or near goal if there is none. Return true if any block is
+  // allocated. Let caller handle flushing like resize.
+  bool allocBlocks(int pos, int size, uint32_t goal, BlockMapCache* cache = nullptr);
+  // SEEK_DATA / SEEK_HOLE: return the offset of the first data (or hole)
+  // byte at or after off. The end of the file counts as a hole. Return -1 if
+  // there is no such byte.
+  int seekData(int off, bool hole, BlockMapCache* cache = nullptr) const;
+  // Let caller handle flushing by calling Inode::flush since a DirEnt does not know where it's stored on disk.
   void truncate(int newsize=0);
 
   bool isdir() const {
     return ent_type == ET_DIR;
   }
 
-  uint32_t logicalToPhysBlockId(uint32_t logicalBlockId) const;
+  bool isInline() const {
+    return flags & DIRENT_FLAG_INLINE;
+  }
+
+  // cache is optional. Pass one for repeated lookups of the same file.
+  // Return 0 for a hole. Reading a hole gets zeros.
+  uint32_t logicalToPhysBlockId(uint32_t logicalBlockId, BlockMapCache* cache = nullptr) const;
+
+  // blktable based block mapping
+  uint32_t blktableLookup(uint32_t logicalBlockId, BlockMapCache* cache) const;
+  // map logical blocks [lb, lb + n) to physical blocks [start, start + n).
+  // Indirect blocks are allocated as needed.
+  void mapBlocks(uint32_t lb, uint32_t start, int n);
+  void truncateBlktable(uint32_t old_nblk, uint32_t new_nblk);
+
+  // extent based block mapping for SB_FLAG_EXTENT images
+  uint32_t extentLookup(uint32_t logicalBlockId, BlockMapCache* cache) const;
+  Extent getExtent(int idx) const;
+  // idx can be exthdr.nextent to add a new extent. An overflow block is
+  // allocated if needed.
+  void setExtent(int idx, const Extent& ext);
+  // add the blocks to the end of the file. Merge with the last extent if
+  // possible. start 0 adds a hole.
+  void appendExtent(uint32_t start, uint32_t len);
+  void truncateExtents(uint32_t new_nblk);
+  // return the index of the extent containing logical block lb and store the
+  // logical start of the extent to *pbase. Return exthdr.nextent if lb is past
+  // the last extent; *pbase is the number of blocks covered by the extents
+  // then.
+  int findExtent(uint32_t lb, uint32_t* pbase) const;
+  // map logical blocks [lb, lb + n), which must be in a hole, to physical
+  // blocks [start, start + n)
+  void fillExtentHole(uint32_t lb, uint32_t start, uint32_t n);
+  // replace the nold extents from idx with the k extents in exts
+  void replaceExtents(int idx, int nold, const Extent* exts, int k);
+  // keep the first n extents and release the overflow blocks not needed
+  void trimExtents(int n);
+
+  // hashed directory index. Check kernel/dirindex.cpp
+  static uint32_t nameHash(const char* name, int len);
+  // return the index of the entry and store it to *pent. Return -1 if not
+  // found.
+  int indexLookup(const char* name, int len, DirEnt* pent) const;
+  // a bucket is split if the index becomes too crowded
+  void indexAdd(const char* name, int len, int idx);
+  void indexRemove(const char* name, int len, int idx);
+  // the entry is moved from oldidx to newidx
+  void indexMove(const char* name, int len, int oldidx, int newidx);
+  // index all the existing entries
+  void buildIndex();
+  // indexAdd without checking the load
+  void indexInsert(const char* name, int len, int idx);
+  // split the next bucket in root and write root back
+  void indexSplit(DirIndexRoot& root);
+  void freeIndex();
 
   // read the whole block for file offset off
-	void readBlockForOff(int off, char* buf);
+	void readBlockForOff(int off, char* buf, BlockMapCache* cache = nullptr);
   // write the whole block for file offset off
-	void writeBlockForOff(int off, const char* buf);
+	void writeBlockForOff(int off, const char* buf, BlockMapCache* cache = nullptr);
 
   // use ent_type == ET_NOEXIST to identify a returned DirEnt does not exist
   operator bool() const {
@@ -173,15 +379,35 @@ class DirEntIterator {
  * requires a disk write for each of the blocks freed.
  * Also for the second strategy, if any free block is corrupted, the damage is huge.
  *
- * I'll still go on to implement strategy 2 though. The main purpose is to experiment the idea and see how that works
- * in practice. We should have multiple alternative filesystem implementations later on anyways.
- * So it's not a big deal.
+ * I implemented strategy 2 first to experiment the idea and see how that works in practice.
+ * Strategy 1 is supported as well now: images created by 'mkfs.py --bitmap' set SB_FLAG_BITMAP
+ * and store the bitmap right after the super block. The bitmap allocator can also find runs of
+ * contiguous free blocks so big files are laid out sequentially on disk.
  */
+
+// SuperBlock::flags
+// free blocks are tracked by the bitmap rather than the free list
+#define SB_FLAG_BITMAP 1
+// format v2: files are mapped with extents rather than blktable
+#define SB_FLAG_EXTENT 2
+// large directories are indexed by name hash. Check kernel/dirindex.cpp
+#define SB_FLAG_DIRINDEX 4
+// metadata changes go through the journal. Check kernel/journal.h
+#define SB_FLAG_JOURNAL 8
+// small files are stored inside their DirEnt. Check DIRENT_INLINE_SIZE
+#define SB_FLAG_INLINE 16
+
 class SuperBlock {
  public:
   DirEnt rootdir;
-  uint32_t freelist;
+  uint32_t freelist; // not used if SB_FLAG_BITMAP is set
   uint32_t tot_block;
+  // The following fields are 0 for images created before they are added.
+  uint32_t flags;
+  uint32_t bitmap_start; // the first block of the bitmap
+  uint32_t bitmap_nblocks;
+  uint32_t journal_start; // the journal header block
+  uint32_t journal_nblocks; // including the header block
 } __attribute__((packed));
 
 static_assert(sizeof(SuperBlock) <= BLOCK_SIZE); // make sure the SuperBlock can be put inside the first block
@@ -203,9 +429,70 @@ class SimFs {
   }
   // initialize the superblock
   void init();
-  // the blockId here is a physical block id
-  void readBlock(int blockId, uint8_t buf[], int len = BLOCK_SIZE);
-	void writeBlock(int blockId, const uint8_t* buf);
+  // the blockId here is a physical block id.
+  // Both APIs go through the buffer cache. readBlock reads [off, off + len)
+  // of the block. writeBlock returns -1 if the block can not be logged in the
+  // running journal transaction.
+  void readBlock(int blockId, uint8_t buf[], int len = BLOCK_SIZE, int off = 0);
+	int writeBlock(int blockId, const uint8_t* buf);
+  // read/write n contiguous blocks. Check BufCache::readRun/writeRun
+  void readBlocks(int blockId, int n, uint8_t* buf);
+  void writeBlocks(int blockId, int n, const uint8_t* buf);
+
+  // access the device directly bypassing the buffer cache. buf is a virtual
+  // address, possibly in user space; the pages are pinned during the
+  // transfer. It has no alignment requirement: PIO works with any address
+  // and the xHCI driver builds TRBs from the physically contiguous pieces.
+  void readBlockFromDev(int blockId, uint8_t* buf);
+  // read n contiguous blocks with a single device command, or as few as the
+  // device allows. n is at most maxDevIOBlocks().
+  void readBlocksFromDev(int blockId, int n, uint8_t* buf);
+  // bring blocks [blockId, blockId + n) into the buffer cache ahead of use
+  void readaheadBlocks(int blockId, int n);
+  void writeBlockToDev(int blockId, const uint8_t* buf);
+  // write n contiguous blocks with a single device command, or as few as the
+  // device allows. n is at most maxDevIOBlocks().
+  void writeBlocksToDev(int blockId, int n, const uint8_t* buf);
+
+  // max number of blocks per readBlocksFromDev/writeBlocksToDev call
+  int maxDevIOBlocks() const {
+#if USB_BOOT || defined(HOST_OS)
+    // the mass storage driver splits larger requests into commands itself
+    return SIMFS_MAX_DEV_IO_BLOCKS;
+#else
+    // the IDE sector count register is 8 bits
+    return 256 / SECTORS_PER_BLOCK;
+#endif
+  }
+
+  // commit the journal and write back all dirty blocks in the buffer cache
+  void sync();
+
+  // non-zero while the device is in use by something that does not go through
+  // BufCache: a device command, a journal commit or replay, or a sync. The
+  // timer interrupt can arrive in the middle of one if it's triggered from
+  // kshell which runs with interrupt enabled. The periodic flushes are
+  // skipped in that case. Check DevBusyScope.
+  bool devBusy() const {
+    return devBusy_ > 0;
+  }
+  void devBegin() {
+    ++devBusy_;
+  }
+  void devEnd() {
+    assert(devBusy_ > 0);
+    --devBusy_;
+  }
+
+  BufCache& bufCache() {
+    return bufCache_;
+  }
+
+#ifdef HOST_OS
+  HostBlockDevice& dev() {
+    return dev_;
+  }
+#endif
 
   // read the content of file. The caller is responsible to free the buffer.
   uint8_t* readFile(const char* path, int* psize=nullptr);
@@ -222,10 +509,23 @@ class SimFs {
   // If path is the root dir in this case (there is no parent), the returned DirEnt will be DirEnt() .
   WalkPathResult walkPath(const char* path, int pathlen, bool returnParent);
 
-  // if the path (file/dir) exists, return the corresponding DirEnt;
-  // otherwise, try to create the file. Return the created DirEnt if succeed and return 
-  // DirEnt() if fail (e.g. if the parent directory does not exist).
-	DirEnt createFile(const char* path);
+  // return the dentry for path. Return nullptr if some intermediate directory
+  // does not exist. The returned dentry can be negative if only the last path
+  // item does not exist.
+  //
+  // NOTE: the returned pointer is only valid until the next change to the
+  // dentry cache.
+  Dentry* lookupDentry(const char* path, int pathlen);
+
+  // return the inode for path with the refcount increased. Return nullptr if
+  // the path does not exist.
+  Inode* lookupInode(const char* path);
+
+  // if the path (file/dir) exists, return the corresponding inode;
+  // otherwise, try to create the file. Return the inode of the created file if succeed and return
+  // nullptr if fail (e.g. if the parent directory does not exist).
+  // The refcount of the returned inode is increased.
+	Inode* createFile(const char* path);
   // return negative value on faiure.
   // >=0 on success. Return 0 if the dir already exists; Return 1 if a
   // new dir is created.
@@ -235,21 +535,98 @@ class SimFs {
   // remove an empty directory.
   int rmdir(const char* path);
   int removeDirEnt(const char* path);
-	uint32_t allocPhysBlk();
+	uint32_t allocPhysBlk(uint32_t goal = 0);
+  // allocate up to n contiguous blocks near goal and return the first one.
+  // The number of allocated blocks is stored in *pnalloc. Without the
+  // bitmap only 1 block is allocated each time.
+  uint32_t allocPhysBlks(int n, uint32_t goal, int* pnalloc);
   void freePhysBlk(int phys_blkid);
+  void freePhysBlks(uint32_t start, int n);
+  // write the changes to the block allocation bitmap to the buffer cache.
+  // No-op when the free list is used.
+  void flushBitmap();
+  // called when a journal group is committed. The blocks freed so far can be
+  // reused.
+  void releaseFreedBlocks();
+  // return -1 if unknown
+  int countFreeBlocks();
+  uint32_t totBlocks() const {
+    return superBlock_.tot_block;
+  }
+  bool useBitmap() const {
+    return superBlock_.flags & SB_FLAG_BITMAP;
+  }
+  bool useExtent() const {
+    return superBlock_.flags & SB_FLAG_EXTENT;
+  }
+
+  bool useDirIndex() const {
+    return superBlock_.flags & SB_FLAG_DIRINDEX;
+  }
+
+  bool useJournal() const {
+    return superBlock_.flags & SB_FLAG_JOURNAL;
+  }
+
+  bool useInline() const {
+    return superBlock_.flags & SB_FLAG_INLINE;
+  }
+
+  Journal& journal() {
+    return journal_;
+  }
+
+  // the generation of block mappings. Bumped whenever any file is truncated.
+  // Check BlockMapCache.
+  uint32_t mapGen() const {
+    return mapGen_;
+  }
+  void bumpMapGen() {
+    ++mapGen_;
+  }
 
   void updateRootDirEnt(const DirEnt& newent);
 	void flushSuperBlock();
  private:
   static int blockIdToSectorNo(int blockId);
+  // create an entry named name in the parent directory. Return the inode of
+  // the new entry with the refcount increased.
+  Inode* createEnt(Inode* parent, const char *name, int namelen, int8_t ent_type);
+  // if path exists, return its inode and set *pexisted to true; otherwise
+  // create an entry of ent_type for it.
+  Inode* createPath(const char* path, int8_t ent_type, bool* pexisted);
+  // walk one level down from parent. Return nullptr if parent is not a
+  // directory.
+  Dentry* walkOneLevel(Dentry* parent, const char* name, int len);
+  // if returnParent is true, return the dentry for the parent of path and
+  // store the last path item in *plastItemPtr/*plastItemLen.
+  Dentry* walkDentry(const char* path, int pathlen, bool returnParent, const char** plastItemPtr, int* plastItemLen);
 
   static SimFs instance_;
 #if USB_BOOT
   MassStorageDevice<XHCIDriver> dev_;
+#elif defined(HOST_OS)
+  HostBlockDevice dev_;
 #else
   IDEDevice dev_;
 #endif
   SuperBlock superBlock_;
+  BufCache bufCache_;
+  BlockBitmap bitmap_; // only used when useBitmap() is true
+  Journal journal_; // only enabled when useJournal() is true
+  uint32_t mapGen_ = 0;
+  int devBusy_ = 0;
+};
+
+// mark the filesystem device busy for the scope
+class DevBusyScope {
+ public:
+  DevBusyScope() {
+    SimFs::get().devBegin();
+  }
+  ~DevBusyScope() {
+    SimFs::get().devEnd();
+  }
 };
 
 int ls(char* path);
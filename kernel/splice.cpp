@@ -0,0 +1,109 @@
+#include <kernel/splice.h>
+#include <kernel/user_process.h>
+#include <kernel/pipe.h>
+#include <kernel/inode.h>
+#include <kernel/paging.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdlib.h>
+
+static FileDescBase* get_fdptr(int fd) {
+  if (fd < 0 || fd >= MAX_OPEN_FILE) {
+    return nullptr;
+  }
+  return UserProcess::current()->filetab_[fd];
+}
+
+// the console descriptor does not set flags_
+static bool can_write(FileDescBase* fdptr) {
+  return fdptr->fdtype_ == FD_CONSOLE || (fdptr->flags_ & FD_FLAG_WR);
+}
+
+static bool at_eof(FileDescBase* fdptr) {
+  if (fdptr->fdtype_ != FD_FILE) {
+    return false;
+  }
+  FileDesc* fd = (FileDesc*) fdptr;
+  flush_write_behind(fd->inode_);
+  return fd->off_ == fd->inode_->dirent_.file_size;
+}
+
+// in is a file or a pipe. out is not the same pipe.
+static int move(FileDescBase* in, FileDescBase* out, int count) {
+  if (out->fdtype_ == FD_PIPE) {
+    Pipe* pipeobj = ((PipeFileDesc*) out)->pipeobj_;
+    if (!pipeobj->read_desc_) {
+      // nobody will read the data
+      return -1;
+    }
+    int r = pipeobj->writeFrom(in, count);
+    return r == 0 && !at_eof(in) ? EAGAIN : r;
+  }
+  if (in->fdtype_ == FD_PIPE) {
+    Pipe* pipeobj = ((PipeFileDesc*) in)->pipeobj_;
+    int r = pipeobj->readTo(out, count);
+    return r == 0 && pipeobj->write_desc_ ? EAGAIN : r;
+  }
+
+  uint8_t* page = (uint8_t*) alloc_phys_page();
+  int cnt = 0;
+  while (cnt < count) {
+    int r = in->read(page, min(count - cnt, PAGE_SIZE));
+    if (r <= 0) {
+      break;
+    }
+    int w = out->write(page, r);
+    if (w > 0) {
+      cnt += w;
+    }
+    if (w < r) {
+      break;
+    }
+  }
+  free_phys_page((phys_addr_t) page);
+  return cnt;
+}
+
+int sendfile(int out_fd, int in_fd, int off, int count) {
+  FileDescBase* in = get_fdptr(in_fd);
+  FileDescBase* out = get_fdptr(out_fd);
+  if (!in || !out || in->fdtype_ != FD_FILE || !(in->flags_ & FD_FLAG_RD) || !can_write(out)) {
+    return -1;
+  }
+  if (count < 0 || off < -1) {
+    return -1;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  FileDesc* infile = (FileDesc*) in;
+  if (off == -1) {
+    return move(in, out, count);
+  }
+  flush_write_behind(infile->inode_);
+  if (off >= infile->inode_->dirent_.file_size) {
+    return 0;
+  }
+  int saved_off = infile->off_;
+  infile->off_ = off;
+  int r = move(in, out, count);
+  infile->off_ = saved_off;
+  return r;
+}
+
+int splice(int in_fd, int out_fd, int count) {
+  FileDescBase* in = get_fdptr(in_fd);
+  FileDescBase* out = get_fdptr(out_fd);
+  if (!in || !out || !(in->flags_ & FD_FLAG_RD) || !can_write(out) || count < 0) {
+    return -1;
+  }
+  // a pipe can not feed another pipe since Pipe::read does not return a
+  // plain byte count when the pipe is empty
+  if ((in->fdtype_ == FD_PIPE) == (out->fdtype_ == FD_PIPE)) {
+    return -1;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  return move(in, out, count);
+}
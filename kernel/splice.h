@@ -0,0 +1,24 @@
+#pragma once
+
+/*
+ * Move data between file descriptors inside the kernel.
+ *
+ * When one side is a pipe, the other side reads into or writes from the pipe
+ * buffer directly. The data is copied once rather than into a user buffer and
+ * back. Between two non-pipe descriptors the data goes through a kernel page.
+ *
+ * Neither call blocks: they move what can be moved now and return EAGAIN
+ * (check errno.h) if nothing can move until the other end of the pipe runs.
+ */
+
+// Move up to count bytes from the file in_fd to out_fd. If off is not -1, the
+// file is read from off and the offset of in_fd does not change. Return the
+// number of bytes moved, 0 at the end of the file, EAGAIN if out_fd is a full
+// pipe and -1 on error.
+int sendfile(int out_fd, int in_fd, int off, int count);
+
+// Move up to count bytes between a pipe and a file descriptor. Exactly one of
+// in_fd and out_fd must be a pipe. Return the number of bytes moved, 0 when
+// in_fd is at the end (the end of the file, or an empty pipe without writer),
+// EAGAIN if the pipe is full or empty and -1 on error.
+int splice(int in_fd, int out_fd, int count);
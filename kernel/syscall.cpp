@@ -4,6 +4,9 @@
 #include <kernel/fileapi.h>
 #include <kernel/simfs.h>
 #include <kernel/pipe.h>
+#include <kernel/mmap.h>
+#include <kernel/ioring.h>
+#include <kernel/splice.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
@@ -52,30 +55,8 @@ int sys_close(int fd) {
   return file_close(fd);
 }
 
-// TODO dedup with ls function under kernel/simfs.cpp
-int sys_readdir(const char* path, struct dirent* entlist, int capa) {
-  auto dent = SimFs::get().walkPath(path);
-  if (!dent) {
-    printf("Path does not exist %s\n", path);
-    return -1;
-  }
-  int cnt = 0;
-  for (auto itr : dent) {
-    if (cnt >= capa) {
-      printf("dirent list out of capacity\n");
-      return -1;
-    }
-
-    DirEnt* curEnt = &(*itr);
-    struct dirent* dstEnt = entlist + cnt;
-
-    strcpy(dstEnt->name, curEnt->name);
-    dstEnt->file_size = curEnt->file_size;
-    dstEnt->ent_type = curEnt->ent_type;
-
-    ++cnt;
-  }
-  return cnt;
+int sys_readdir(const char* path, struct dirent* entlist, int capa, int off) {
+  return file_readdir(path, entlist, capa, off);
 }
 
 /*
@@ -120,6 +101,42 @@ int sys_rmdir(const char* path) {
   return SimFs::get().rmdir(path);
 }
 
+int sys_mmap(int len, int prot, int flags, int fd, int off) {
+  return mmap(len, prot, flags, fd, off);
+}
+
+int sys_munmap(void* addr, int len) {
+  return munmap((uint32_t) addr, len);
+}
+
+int sys_ioring_setup(struct ioring* ring) {
+  return ioring_setup(ring);
+}
+
+int sys_ioring_enter(int to_submit) {
+  return ioring_enter(to_submit);
+}
+
+int sys_sendfile(int out_fd, int in_fd, int off, int count) {
+  return sendfile(out_fd, in_fd, off, count);
+}
+
+int sys_splice(int in_fd, int out_fd, int count) {
+  return splice(in_fd, out_fd, count);
+}
+
+int sys_lseek(int fd, int off, int whence) {
+  return file_lseek(fd, off, whence);
+}
+
+int sys_fsync(int fd) {
+  return file_fsync(fd);
+}
+
+int sys_sync() {
+  return file_sync();
+}
+
 void *sc_handlers[NUM_SYS_CALL] = {
   nullptr, // number 0
   // "[SC_WRITE] = fptr; " seems work in C but is not supported by C++.
@@ -141,6 +158,15 @@ void *sc_handlers[NUM_SYS_CALL] = {
   /* SC_PIPE */ (void *) sys_pipe,
   /* SC_UNLINK */ (void *) sys_unlink,
   /* SC_RMDIR */ (void *) sys_rmdir,
+  /* SC_MMAP */ (void *) sys_mmap,
+  /* SC_MUNMAP */ (void *) sys_munmap,
+  /* SC_IORING_SETUP */ (void *) sys_ioring_setup,
+  /* SC_IORING_ENTER */ (void *) sys_ioring_enter,
+  /* SC_SENDFILE */ (void *) sys_sendfile,
+  /* SC_SPLICE */ (void *) sys_splice,
+  /* SC_LSEEK */ (void *) sys_lseek,
+  /* SC_FSYNC */ (void *) sys_fsync,
+  /* SC_SYNC */ (void *) sys_sync,
 };
 
 typedef int (*sc_handler_type)(int arg1, int arg2, int arg3, int arg4, int arg5);
@@ -9,6 +9,8 @@
 #define CSW_SIGNATURE 0x53425355 // 'USBS' in little endian
 
 struct CommandBlockWrapper {
+  CommandBlockWrapper() = default;
+
   // TODO: assume LUN (logical unit number) to be 0 for now. We should pass LUN
   // in.
   explicit CommandBlockWrapper(
@@ -61,6 +63,62 @@ struct CommandStatusWrapper {
 
 static_assert(sizeof(CommandStatusWrapper) == 13);
 
+// Information units of USB Attached SCSI (UAS). Multi-byte fields are in
+// big-endian order. Check the UAS spec section 6.2
+#define UAS_IU_COMMAND 0x01
+#define UAS_IU_SENSE 0x03
+
+struct UASCommandIU {
+  UASCommandIU() = default;
+
+  explicit UASCommandIU(uint16_t _tag, uint8_t _cmd_len, const uint8_t* cmdptr) : tag(hton(_tag)) {
+    assert(_cmd_len <= 16);
+    memset(lun, 0, sizeof(lun));
+    for (int i = 0; i < 16; ++i) {
+      cmd[i] = i < _cmd_len ? cmdptr[i] : 0;
+    }
+  }
+
+  uint8_t iu_id = UAS_IU_COMMAND;
+  uint8_t reserved = 0;
+  uint16_t tag; // the stream carrying the data and status of the command
+  uint8_t task_attribute = 0; // simple
+  uint8_t reserved2 = 0;
+  uint8_t additional_cdb_length = 0;
+  uint8_t reserved3 = 0;
+  uint8_t lun[8];
+  uint8_t cmd[16];
+} __attribute__((packed));
+
+static_assert(sizeof(UASCommandIU) == 32);
+
+// the device sends a sense IU on the status pipe when a command completes
+struct UASSenseIU {
+  void print() const {
+    printf("Sense IU: id 0x%x, tag %d, status %d\n", iu_id, ntoh(tag), status);
+  }
+
+  uint8_t iu_id;
+  uint8_t reserved;
+  uint16_t tag;
+  uint16_t status_qualifier;
+  uint8_t status; // 0 for GOOD
+  uint8_t reserved2[7];
+  uint16_t sense_length;
+  uint8_t sense_data[18]; // fixed format sense data
+} __attribute__((packed));
+
+static_assert(sizeof(UASSenseIU) == 34);
+
+// the max number of commands in flight
+#define MSD_QUEUE_DEPTH 4
+// Bulk-only transport runs one command at a time. The host must not send the
+// next CBW before it has the CSW of the current command (usbmassbulk 5.3), so
+// only UAS gets more than one command in flight.
+#define MSD_BOT_QUEUE_DEPTH 1
+// the max payload of a READ/WRITE(16) command. Keeps the length in an int.
+#define MSD_MAX_CMD_BYTES (1 << 30)
+
 // #define FIXED_TAG 0x06180618
 #ifdef FIXED_TAG
 #define GENERATE_TAG FIXED_TAG
@@ -79,70 +137,80 @@ class MassStorageDevice : public USBDevice<ControllerDriver> {
     scsi::ReadCapacity10Response resp;
     handleInCommand((uint8_t*) &cmd, sizeof(cmd), (uint8_t*) &resp, sizeof(resp));
     blockSize_ = resp.block_length_in_bytes();
-    totalNumBlocks_ = resp.returned_logical_block_address() + 1;
-    printf("block size %d, total number of blocks %d\n", blockSize_, totalNumBlocks_);
+    totalNumBlocks_ = (uint64_t) resp.returned_logical_block_address() + 1;
+    use16_ = resp.returned_logical_block_address() == 0xFFFFFFFF;
+    if (use16_) {
+      // the device is too large for READ CAPACITY(10)
+      scsi::ReadCapacity16 cmd16;
+      scsi::ReadCapacity16Response resp16;
+      handleInCommand((uint8_t*) &cmd16, sizeof(cmd16), (uint8_t*) &resp16, sizeof(resp16));
+      blockSize_ = resp16.block_length_in_bytes();
+      totalNumBlocks_ = resp16.returned_logical_block_address() + 1;
+    }
+    // printf can't print 64 bit numbers
+    printf("block size %d, capacity %d MB\n", blockSize_, (uint32_t) ((totalNumBlocks_ * blockSize_) >> 20));
   }
 
   // assumes buf has enough capacity to store nblock's of data
-  void readBlocks(uint32_t lba_start, uint32_t nblock, uint8_t* buf) {
-    assert(lba_start >= 0);
+  void readBlocks(uint64_t lba_start, uint32_t nblock, uint8_t* buf) {
     assert(nblock > 0);
     if (lba_start + nblock - 1 >= totalNumBlocks_) {
-      printf("readBlocks lba_start %d, nblock %d, totalNumBlocks_ %d\n", lba_start, nblock, totalNumBlocks_);
+      printf("readBlocks lba_start 0x%x:0x%x (high:low), nblock %d\n", (uint32_t) (lba_start >> 32), (uint32_t) lba_start, nblock);
       assert(false && "readBlocks out of range");
     }
-
-    scsi::Read10 cmd(lba_start, nblock);
-    handleInCommand((uint8_t*) &cmd, sizeof(cmd), buf, nblock * blockSize_);
+    transferBlocks(lba_start, nblock, buf, true);
   }
 
   // assumes buf has enough capacity to store nblock's of data
-  void writeBlocks(uint32_t lba_start, uint32_t nblock, const uint8_t* buf) {
-    assert(lba_start >= 0);
+  void writeBlocks(uint64_t lba_start, uint32_t nblock, const uint8_t* buf) {
     assert(nblock > 0);
     assert(lba_start + nblock - 1 < totalNumBlocks_);
-    scsi::Write10 cmd(lba_start, nblock);
-    handleOutCommand((uint8_t*) &cmd, sizeof(cmd), buf, nblock * blockSize_);
+    transferBlocks(lba_start, nblock, (uint8_t*) buf, false);
   }
 
   /*
    * Handle a SCSI command that read content from the device.
    */
   void handleInCommand(uint8_t* cmdptr, int cmdlen, uint8_t* payloadPtr, int payloadLen) {
-    CommandBlockWrapper cbw(
-      GENERATE_TAG,
-      payloadLen,
-      true, // in request
-      cmdlen,
-      cmdptr);
-    bulkSend((uint8_t*) &cbw, sizeof(cbw));
-    bulkRecv(payloadPtr, payloadLen);
-
-    CommandStatusWrapper csw;
-    bulkRecv((uint8_t*) &csw, sizeof(csw));
-    assert(csw.signature == CSW_SIGNATURE);
-    assert(csw.tag == cbw.tag);
-    assert(csw.success());
+    submitCommand(cmdptr, cmdlen, payloadPtr, payloadLen, true);
+    flush();
   }
 
   /*
    * Handle a SCSI command that send content to the device.
    */
   void handleOutCommand(uint8_t* cmdptr, int cmdlen, const uint8_t* payloadPtr, int payloadLen) {
-    CommandBlockWrapper cbw(
-      GENERATE_TAG,
-      payloadLen,
-      false, // out request
-      cmdlen,
-      cmdptr);
-    bulkSend((uint8_t*) &cbw, sizeof(cbw));
-    bulkSend(payloadPtr, payloadLen);
+    submitCommand(cmdptr, cmdlen, (uint8_t*) payloadPtr, payloadLen, false);
+    flush();
+  }
 
-    CommandStatusWrapper csw;
-    bulkRecv((uint8_t*) &csw, sizeof(csw));
-    assert(csw.signature == CSW_SIGNATURE);
-    assert(csw.tag == cbw.tag);
-    assert(csw.success());
+  /*
+   * Queue a SCSI command and return without waiting for it unless the queue
+   * is full. The payload must stay valid until flush returns. Commands
+   * complete in the order they are submitted.
+   */
+  void submitCommand(uint8_t* cmdptr, int cmdlen, uint8_t* payloadPtr, int payloadLen, bool in) {
+    if (count_ == queueDepth()) {
+      completeOldest();
+    }
+    // the tag of an UAS command names its stream, so slots must stay below
+    // the number of streams the device has
+    int slot = (head_ + count_) % queueDepth();
+    Request& req = requests_[slot];
+    req.ncomp = 0;
+    if (this->uasNumStreams_) {
+      submitUASCommand(req, slot + 1, cmdptr, cmdlen, payloadPtr, payloadLen, in);
+    } else {
+      submitBOTCommand(req, cmdptr, cmdlen, payloadPtr, payloadLen, in);
+    }
+    ++count_;
+  }
+
+  // wait for all the submitted commands
+  void flush() {
+    while (count_ > 0) {
+      completeOldest();
+    }
   }
 
   void bulkSend(const uint8_t *buf, int bufsize) {
@@ -156,7 +224,128 @@ class MassStorageDevice : public USBDevice<ControllerDriver> {
   uint32_t blockSize() const {
     return blockSize_;
   }
+
+  uint64_t totalNumBlocks() const {
+    return totalNumBlocks_;
+  }
  private:
+  typedef typename ControllerDriver::Completion Completion;
+
+  // a submitted command and the transfers it waits for
+  struct Request {
+    CommandBlockWrapper cbw;
+    CommandStatusWrapper csw;
+    UASCommandIU command_iu;
+    UASSenseIU sense_iu;
+    // the last TD of each transfer in queue order
+    Completion comps[3];
+    int ncomp;
+  };
+
+  // Split the request into commands as large as the CDB allows and queue
+  // them all before waiting. READ/WRITE(16) are only used on devices READ
+  // CAPACITY(10) can't describe, like Linux does. Some USB bridges don't
+  // implement them.
+  void transferBlocks(uint64_t lba, uint32_t nblock, uint8_t* buf, bool in) {
+    uint32_t max_blocks = use16_ ? MSD_MAX_CMD_BYTES / blockSize_ : SCSI_MAX_BLOCKS_10;
+    while (nblock > 0) {
+      uint32_t n = min(nblock, max_blocks);
+      if (use16_) {
+        scsi::Read16 read_cmd(lba, n);
+        scsi::Write16 write_cmd(lba, n);
+        submitCommand(in ? (uint8_t*) &read_cmd : (uint8_t*) &write_cmd, sizeof(read_cmd), buf, n * blockSize_, in);
+      } else {
+        scsi::Read10 read_cmd(lba, n);
+        scsi::Write10 write_cmd(lba, n);
+        submitCommand(in ? (uint8_t*) &read_cmd : (uint8_t*) &write_cmd, sizeof(read_cmd), buf, n * blockSize_, in);
+      }
+      lba += n;
+      nblock -= n;
+      buf += n * blockSize_;
+    }
+    flush();
+  }
+
+  int queueDepth() const {
+    return this->uasNumStreams_ ? min(MSD_QUEUE_DEPTH, (int) this->uasNumStreams_) : MSD_BOT_QUEUE_DEPTH;
+  }
+
+  // queue a transfer. A transfer that does not fit in the ring in one TD is
+  // queued piecewise and all but the last TD are waited for here.
+  void queueTransfer(Request& req, const EndpointDescriptor& desc, uint32_t& toggle, uint8_t* buf, int len, uint32_t stream_id) {
+    Completion* comp = &req.comps[req.ncomp++];
+    while (true) {
+      int queued = this->controller_driver_->bulkTransferAsync(this, desc, toggle, buf, len, comp, stream_id);
+      if (queued == len) {
+        return;
+      }
+      if (queued == 0) {
+        // the ring is full of the TDs of earlier commands
+        assert(count_ > 0);
+        completeOldest();
+        continue;
+      }
+      this->controller_driver_->waitTransfer(comp);
+      buf += queued;
+      len -= queued;
+    }
+  }
+
+  // CBW, data and CSW go back to back. The CSW is in the ring before the
+  // device gets to it.
+  void submitBOTCommand(Request& req, uint8_t* cmdptr, int cmdlen, uint8_t* payloadPtr, int payloadLen, bool in) {
+    req.cbw = CommandBlockWrapper(GENERATE_TAG, payloadLen, in, cmdlen, cmdptr);
+    queueTransfer(req, this->bulkOut_, this->bulkOutDataToggle_, (uint8_t*) &req.cbw, sizeof(req.cbw), 0);
+    if (payloadLen > 0) {
+      if (in) {
+        queueTransfer(req, this->bulkIn_, this->bulkInDataToggle_, payloadPtr, payloadLen, 0);
+      } else {
+        queueTransfer(req, this->bulkOut_, this->bulkOutDataToggle_, payloadPtr, payloadLen, 0);
+      }
+    }
+    queueTransfer(req, this->bulkIn_, this->bulkInDataToggle_, (uint8_t*) &req.csw, sizeof(req.csw), 0);
+  }
+
+  // the data and status of the command go to the stream named by its tag.
+  // The status is queued before the command so the device can send the sense
+  // IU as soon as it is done.
+  void submitUASCommand(Request& req, uint16_t tag, uint8_t* cmdptr, int cmdlen, uint8_t* payloadPtr, int payloadLen, bool in) {
+    uint32_t toggle = 0; // streams are xHCI only which does not use toggles
+    queueTransfer(req, this->uasPipe(UASPipe::STATUS), toggle, (uint8_t*) &req.sense_iu, sizeof(req.sense_iu), tag);
+    req.command_iu = UASCommandIU(tag, cmdlen, cmdptr);
+    queueTransfer(req, this->uasPipe(UASPipe::COMMAND), toggle, (uint8_t*) &req.command_iu, sizeof(req.command_iu), 0);
+    if (payloadLen > 0) {
+      queueTransfer(req, this->uasPipe(in ? UASPipe::DATA_IN : UASPipe::DATA_OUT), toggle, payloadPtr, payloadLen, tag);
+    }
+  }
+
+  void completeOldest() {
+    assert(count_ > 0);
+    Request& req = requests_[head_];
+    for (int i = 0; i < req.ncomp; ++i) {
+      this->controller_driver_->waitTransfer(&req.comps[i]);
+    }
+    if (this->uasNumStreams_) {
+      if (req.sense_iu.iu_id != UAS_IU_SENSE || req.sense_iu.tag != req.command_iu.tag || req.sense_iu.status != 0) {
+        req.sense_iu.print();
+        assert(false && "UAS command failed");
+      }
+    } else {
+      assert(req.csw.signature == CSW_SIGNATURE);
+      assert(req.csw.tag == req.cbw.tag);
+      assert(req.csw.success());
+    }
+    head_ = (head_ + 1) % queueDepth();
+    --count_;
+  }
+
   uint32_t blockSize_;
-  uint32_t totalNumBlocks_;
+  uint64_t totalNumBlocks_;
+  // use the 16 byte CDBs with 64 bit LBAs
+  bool use16_ = false;
+
+  // a ring buffer of the commands in flight starting from head_
+  Request requests_[MSD_QUEUE_DEPTH];
+  int head_ = 0;
+  int count_ = 0;
 };
@@ -20,8 +20,15 @@ enum class UHCIRegOff {
 template <typename ControllerDriver>
 class USBDevice;
 
+// UHCI bulk transfers are synchronous. The completion lets
+// MassStorageDevice queue commands the same way as with xHCI.
+class UHCICompletion {
+};
+
 class UHCIDriver : public USBControllerDriver {
  public:
+  typedef UHCICompletion Completion;
+
   explicit UHCIDriver(const PCIFunction& pci_func = PCIFunction()) : USBControllerDriver(pci_func) {
     if (pci_func_) {
       printf("UHCI interrupt line %d, interrupt pin %d\n", pci_func_.interrupt_line(), pci_func_.interrupt_pin());
@@ -127,6 +134,21 @@ class UHCIDriver : public USBControllerDriver {
   void bulkSend(USBDevice<UHCIDriver>* device, const EndpointDescriptor& desc, uint32_t& toggle, const uint8_t* buf, int bufsize);
   void bulkRecv(USBDevice<UHCIDriver>* device, const EndpointDescriptor& desc, uint32_t& toggle, uint8_t* buf, int bufsize);
 
+  // run the transfer to the end. Streams are not supported.
+  int bulkTransferAsync(USBDevice<UHCIDriver>* device, const EndpointDescriptor& desc, uint32_t& toggle, const uint8_t* buf, int bufsize, UHCICompletion* /* comp */, uint32_t stream_id = 0) {
+    assert(stream_id == 0);
+    if (desc.bEndpointAddress & 0x80) {
+      bulkRecv(device, desc, toggle, (uint8_t*) buf, bufsize);
+    } else {
+      bulkSend(device, desc, toggle, buf, bufsize);
+    }
+    return bufsize;
+  }
+
+  int waitTransfer(UHCICompletion* /* comp */) {
+    return 0;
+  }
+
   // a simple implementation that only do allocation but no reclamation
   uint8_t acquireAvailAddr() const {
     static uint8_t next_addr = 1;
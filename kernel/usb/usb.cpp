@@ -4,6 +4,8 @@
 #include <kernel/usb/usb_proto.h>
 #include <kernel/usb/usb_device.h>
 #include <kernel/usb/msd.h>
+#include <kernel/idt.h>
+#include <kernel/simfs.h>
 
 // for usb initialization
 PCIFunction uhci_func, ohci_func, ehci_func, xhci_func;
@@ -140,3 +142,39 @@ void usb_init() {
   setup_xhci();
   #endif
 }
+
+#define USB_BENCH_CHUNK (64 << 10)
+static uint8_t bench_buf[USB_BENCH_CHUNK] __attribute__((aligned(4096)));
+
+// return the throughput in KB/s
+static int read_throughput(int nmb) {
+  uint32_t nblock_per_chunk = USB_BENCH_CHUNK / msd_dev.blockSize();
+  int nchunk = nmb * ((1 << 20) / USB_BENCH_CHUNK);
+  int64_t start = getTick();
+  for (int i = 0; i < nchunk; ++i) {
+    msd_dev.readBlocks((uint64_t) i * nblock_per_chunk, nblock_per_chunk, bench_buf);
+  }
+  // 1 tick == 10 ms
+  int nticks = max((int) (getTick() - start), 1);
+  return nmb * 1024 * 100 / nticks;
+}
+
+void usb_burst_bench(int nmb) {
+  // keep it within the drive and the int math above
+  nmb = min(nmb, 1024);
+  nmb = min((uint64_t) nmb, (msd_dev.totalNumBlocks() * msd_dev.blockSize()) >> 20);
+  if (nmb <= 0) {
+    printf("Nothing to read\n");
+    return;
+  }
+  // msd_dev is driven directly. Keep the timer from flushing the filesystem
+  // to the same drive in the middle.
+  DevBusyScope dev_busy;
+  bool use_burst = xhci_driver.useBurst();
+  xhci_driver.setMaxBurst(&msd_dev, false);
+  int kbps_no_burst = read_throughput(nmb);
+  xhci_driver.setMaxBurst(&msd_dev, true);
+  int kbps_burst = read_throughput(nmb);
+  xhci_driver.setMaxBurst(&msd_dev, use_burst);
+  printf("Read %d MB: burst 0 %d KB/s, advertised burst %d KB/s\n", nmb, kbps_no_burst, kbps_burst);
+}
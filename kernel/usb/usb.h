@@ -9,3 +9,7 @@ extern PCIFunction ehci_func;
 extern PCIFunction xhci_func;
 
 void usb_init();
+
+// compare the sequential read throughput of the USB drive with SuperSpeed
+// bursts off and on. Reads nmb MB from the start of the drive.
+void usb_burst_bench(int nmb);
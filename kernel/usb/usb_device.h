@@ -68,53 +68,117 @@ class USBDevice {
     // endpoints.
     assert(config_desc.bNumInterfaces > 0);
 
-    // at least 2 more bytes for length and type
-    assert(off + 1 < config_desc.wTotalLength);
-
     // From usb3 spec section 9.6.5, endpoint descriptors follows the corresponding
     // interface descriptor. I.e., the data is ordered following a pre-order DFS
-    // traversal.
-    for (int if_idx = 0; if_idx < config_desc.bNumInterfaces; ++if_idx) {
+    // traversal. An interface may have alternate settings, each of which comes
+    // with its own interface descriptor. They are not counted in bNumInterfaces.
+    // Descriptors of other types (e.g. class specific ones) may show up in
+    // between.
+    InterfaceProtocol protocol = InterfaceProtocol::OTHER;
+    int ep_idx = -1; // index in uasPipes_ of the last UAS endpoint
+    SuperSpeedEndpointCompanionDescriptor* last_companion = nullptr;
+    while (off < config_desc.wTotalLength) {
+      // at least 2 more bytes for length and type
+      assert(off + 1 < config_desc.wTotalLength);
       uint8_t len = *(buf + off);
       uint8_t type = *(buf + off + 1);
-      assert(off + len <= config_desc.wTotalLength);
-
-      InterfaceDescriptor* ifdesc_ptr = (InterfaceDescriptor*) (buf + off);
-      ifdesc_ptr->print(); // ensure the type and length inside print method
-      off += len;
-      visitInterfaceDesc(ifdesc_ptr);
-
-      // NOTE: default control pipe does not show up in the endpoint descriptor list.
-      for (int ep_idx = 0; ep_idx < ifdesc_ptr->bNumEndpoints; ++ep_idx) {
-        assert(off + 1 < config_desc.wTotalLength);
-        len = *(buf + off);
-        type = *(buf + off + 1);
-        assert(off + len <= config_desc.wTotalLength);
-
+      assert(len >= 2 && off + len <= config_desc.wTotalLength);
+
+      switch ((DescriptorType) type) {
+      case DescriptorType::INTERFACE: {
+        InterfaceDescriptor* ifdesc_ptr = (InterfaceDescriptor*) (buf + off);
+        ifdesc_ptr->print(); // ensure the type and length inside print method
+        protocol = visitInterfaceDesc(ifdesc_ptr);
+        ep_idx = -1;
+        last_companion = nullptr;
+        break;
+      }
+      case DescriptorType::ENDPOINT: {
+        // NOTE: default control pipe does not show up in the endpoint descriptor list.
         EndpointDescriptor* eddesc_ptr = (EndpointDescriptor*) (buf + off);
         eddesc_ptr->print();
-        off += len;
-        // TODO: don't support endpoint companion descriptors following endpoint descriptors so far.
-        // usb3 spec section 9.6.5 mentions when this will happen.
-        visitEndpointDesc(eddesc_ptr);
-
-        // an endpoint descriptor may be followed by a SuperSpeedEndpointCompanionDescriptor.
-        // TODO: should we not simply ignore SuperSpeedEndpointCompanionDescriptor?
-        if (off + 2 <= config_desc.wTotalLength) {
-          uint8_t nextlen = *(buf + off);
-          uint8_t nexttype = *(buf + off + 1);
-          if (nexttype == (int) DescriptorType::SUPERSPEED_USB_ENDPOINT_COMPANION) {
-            assert(nextlen == sizeof(SuperSpeedEndpointCompanionDescriptor));
-            assert(off + nextlen <= config_desc.wTotalLength);
-            off += nextlen;
-          }
+        last_companion = nullptr;
+        if (protocol == InterfaceProtocol::BOT) {
+          visitEndpointDesc(eddesc_ptr);
+          last_companion = (eddesc_ptr->bEndpointAddress & 0x80) ? &bulkInCompanion_ : &bulkOutCompanion_;
+        } else if (protocol == InterfaceProtocol::UAS) {
+          // the pipe usage descriptor following it tells the role
+          assert(nUASEndpoints_ < UAS_NPIPE);
+          ep_idx = nUASEndpoints_++;
+          uasEndpoints_[ep_idx] = *eddesc_ptr;
+          last_companion = &uasCompanions_[ep_idx];
         }
+        break;
       }
+      case DescriptorType::SUPERSPEED_USB_ENDPOINT_COMPANION:
+        // usb3 spec section 9.6.7: an endpoint descriptor may be followed by a
+        // SuperSpeedEndpointCompanionDescriptor.
+        assert(len == sizeof(SuperSpeedEndpointCompanionDescriptor));
+        if (last_companion) {
+          *last_companion = *(SuperSpeedEndpointCompanionDescriptor*) (buf + off);
+        }
+        break;
+      case DescriptorType::PIPE_USAGE: {
+        PipeUsageDescriptor* pipe_desc = (PipeUsageDescriptor*) (buf + off);
+        assert(len == sizeof(PipeUsageDescriptor));
+        if (protocol == InterfaceProtocol::UAS && ep_idx >= 0) {
+          int pipe_id = pipe_desc->bPipeID;
+          assert(pipe_id >= 1 && pipe_id <= UAS_NPIPE);
+          uasPipes_[pipe_id - 1] = ep_idx;
+        }
+        break;
+      }
+      default:
+        printf("Skip descriptor type %d\n", type);
+        break;
+      }
+      off += len;
     }
 
     assert(off == config_desc.wTotalLength);
   }
 
+  // whether the device provides all the UAS pipes. UAS support is optional.
+  bool hasUAS() const {
+    if (uasInterface_ < 0) {
+      return false;
+    }
+    for (int i = 0; i < UAS_NPIPE; ++i) {
+      if (uasPipes_[i] < 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const EndpointDescriptor& uasPipe(UASPipe pipe) const {
+    return uasEndpoints_[uasPipes_[(int) pipe - 1]];
+  }
+
+  const SuperSpeedEndpointCompanionDescriptor& uasCompanion(UASPipe pipe) const {
+    return uasCompanions_[uasPipes_[(int) pipe - 1]];
+  }
+
+  // switch to the UAS alternate setting
+  void selectUAS() {
+    assert(hasUAS());
+    DeviceRequest req = createSetInterfaceRequest(uasInterface_, uasAltSetting_);
+    controller_driver_->sendDeviceRequest(this, &req, nullptr);
+  }
+
+  // the number of streams set up on the UAS status and data pipes. Each
+  // stream carries a command in flight. 0 if bulk-only transport is used.
+  uint32_t& uasNumStreams() {
+    return uasNumStreams_;
+  }
+
+  // reset the data toggle or sequence number of an endpoint on the device
+  // side after the host resets its copy
+  void clearHalt(const EndpointDescriptor& desc) {
+    DeviceRequest req = createClearEndpointHaltRequest(desc.bEndpointAddress);
+    controller_driver_->sendDeviceRequest(this, &req, nullptr);
+  }
+
   void setConfiguration(uint8_t configVal) {
     DeviceRequest req = createSetConfigurationRequest(configVal);
     controller_driver_->sendDeviceRequest(this, &req, nullptr);
@@ -154,6 +218,12 @@ class USBDevice {
     }
   }
 
+  // the device descriptor may tell a size other than what the port speed
+  // implies
+  void setMaxPacketSize(int max_packet_size) {
+    max_packet_size_ = max_packet_size;
+  }
+
   // max packet length for endpoint 0
   uint16_t getMaxPacketSize() {
     assert(max_packet_size_ > 0);
@@ -168,6 +238,9 @@ class USBDevice {
 
   EndpointDescriptor& get_bulk_out_endpoint_desc() { return bulkOut_; }
   EndpointDescriptor& get_bulk_in_endpoint_desc() { return bulkIn_; }
+  // empty if the device does not run at SuperSpeed
+  const SuperSpeedEndpointCompanionDescriptor& get_bulk_out_companion() const { return bulkOutCompanion_; }
+  const SuperSpeedEndpointCompanionDescriptor& get_bulk_in_companion() const { return bulkInCompanion_; }
  private:
   // short hands to create DeviceRequest
   DeviceRequest createGetDeviceDescriptorRequest() {
@@ -212,6 +285,26 @@ class USBDevice {
     );
   }
 
+  DeviceRequest createClearEndpointHaltRequest(uint8_t endpoint_address) {
+    return DeviceRequest(
+      0x02, // the recipient is an endpoint
+      (uint8_t) DeviceRequestCode::CLEAR_FEATURE,
+      0, // ENDPOINT_HALT
+      endpoint_address,
+      0
+    );
+  }
+
+  DeviceRequest createSetInterfaceRequest(uint8_t interface, uint8_t alt_setting) {
+    return DeviceRequest(
+      0x01, // the recipient is an interface
+      (uint8_t) DeviceRequestCode::SET_INTERFACE,
+      alt_setting,
+      interface,
+      0
+    );
+  }
+
   DeviceRequest createSetAddressRequest(uint8_t addr) {
     return DeviceRequest(
       0x0,
@@ -222,14 +315,34 @@ class USBDevice {
     );
   }
 
-  void visitInterfaceDesc(InterfaceDescriptor* descPtr) {
+  enum class InterfaceProtocol {
+    OTHER,
+    BOT = 0x50, // BULK-ONLY Transport
+    UAS = 0x62, // USB Attached SCSI
+  };
+
+  // return the protocol the endpoints following the interface descriptor
+  // are for
+  InterfaceProtocol visitInterfaceDesc(InterfaceDescriptor* descPtr) {
     // TODO: we only support MSD so far
     assert(descPtr->bInterfaceClass == 0x08); // MASS STORAGE class
     // 0x06 is the subclass code USB-IF assigns to SCSI. The definition of
     // SCSI command sets is out of the scope of USB spec. Need refer to SCSI
     // spec to understand how to setup the command in a CommandBlockWrapper
     assert(descPtr->bInterfaceSubClass == 0x06);
-    assert(descPtr->bInterfaceProtocol == 0x50); // BULK-ONLY Transport
+    switch (descPtr->bInterfaceProtocol) {
+    case (int) InterfaceProtocol::BOT:
+      // the default alternate setting of a UAS device is BOT too
+      return InterfaceProtocol::BOT;
+    case (int) InterfaceProtocol::UAS:
+      assert(uasInterface_ < 0 && "multiple UAS alternate settings");
+      uasInterface_ = descPtr->bInterfaceNumber;
+      uasAltSetting_ = descPtr->bAlternateSetting;
+      return InterfaceProtocol::UAS;
+    default:
+      printf("Ignore interface protocol 0x%x\n", descPtr->bInterfaceProtocol);
+      return InterfaceProtocol::OTHER;
+    }
   }
 
   void visitEndpointDesc(EndpointDescriptor* descPtr) {
@@ -253,6 +366,18 @@ class USBDevice {
   EndpointDescriptor bulkOut_;
   uint32_t bulkInDataToggle_ = 0;
   EndpointDescriptor bulkIn_;
+  SuperSpeedEndpointCompanionDescriptor bulkOutCompanion_;
+  SuperSpeedEndpointCompanionDescriptor bulkInCompanion_;
+
+  // UAS endpoints in the order they show up and their companion descriptors.
+  // uasPipes_ maps a UASPipe (minus 1) to the index of its endpoint.
+  int nUASEndpoints_ = 0;
+  EndpointDescriptor uasEndpoints_[UAS_NPIPE];
+  SuperSpeedEndpointCompanionDescriptor uasCompanions_[UAS_NPIPE];
+  int uasPipes_[UAS_NPIPE] = {-1, -1, -1, -1};
+  int uasInterface_ = -1;
+  int uasAltSetting_ = 0;
+  uint32_t uasNumStreams_ = 0;
 
   // only needed for XHCI
   uint32_t slot_id_ = -1;
@@ -14,6 +14,8 @@ enum class DescriptorType : uint8_t {
   DEVICE_QUALIFIER = 6,
   OTHER_SPEED_CONFIGURATION = 7,
   INTERFACE_POWER = 8,
+  // class specific. Used by UAS to tell the role of each endpoint.
+  PIPE_USAGE = 0x24,
   SUPERSPEED_USB_ENDPOINT_COMPANION = 48,
 };
 
@@ -21,15 +23,57 @@ enum class DescriptorType : uint8_t {
  * Per xhci spec 9.6.7 an endpoint companion descriptor (if exist) should immediately
  * follow an endpoint descriptor it is associated with in the configuration
  * information.
- * TODO: We just ignore this descriptor for now.
  */
 class SuperSpeedEndpointCompanionDescriptor {
  public:
-  uint8_t dummy[6];
-};
+  SuperSpeedEndpointCompanionDescriptor() : bLength(0) {
+  }
+
+  operator bool() const {
+    return bLength != 0;
+  }
+
+  // the number of streams a bulk endpoint supports. 0 if streams are not
+  // supported.
+  uint32_t maxStreams() const {
+    if (!*this) {
+      return 0;
+    }
+    int n = bmAttributes & 0x1F;
+    return n ? 1 << n : 0;
+  }
+
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  // the number of packets the endpoint can send or receive in a burst minus 1
+  uint8_t bMaxBurst;
+  // bulk: bit 4..0 is MaxStreams. The endpoint supports 2^MaxStreams streams.
+  uint8_t bmAttributes;
+  uint16_t wBytesPerInterval;
+} __attribute__((packed));
 
 static_assert(sizeof(SuperSpeedEndpointCompanionDescriptor) == 6);
 
+// the pipes of an UAS interface. Check the UAS spec table 13
+enum class UASPipe : uint8_t {
+  COMMAND = 1,
+  STATUS = 2,
+  DATA_IN = 3,
+  DATA_OUT = 4,
+};
+
+#define UAS_NPIPE 4
+
+class PipeUsageDescriptor {
+ public:
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint8_t bPipeID; // check UASPipe
+  uint8_t reserved;
+};
+
+static_assert(sizeof(PipeUsageDescriptor) == 4);
+
 class EndpointDescriptor {
  public:
   EndpointDescriptor() : bLength(0) {
@@ -126,6 +170,12 @@ static_assert(sizeof(ConfigurationDescriptor) == 9);
 
 class DeviceDescriptor {
  public:
+  // bMaxPacketSize0 is an exponent for devices running at SuperSpeed, which
+  // report bcdUSB 0x300 or above. Check usb3 spec 9.6.1
+  int ep0MaxPacketSize() const {
+    return bcdUSB >= 0x300 ? 1 << bMaxPacketSize0 : bMaxPacketSize0;
+  }
+
   uint8_t bLength;
   uint8_t bDescriptorType; // should be Device Descriptor Type
   uint16_t bcdUSB; // USB spec release number in BCD form
@@ -139,6 +189,9 @@ class DeviceDescriptor {
   // For a MSD QEMU simulated, this field returns 8. I can read a 8 bytes packet but
   // not 18 bytes packet for the DeviceDescriptor. So I think for this device
   // it conforms to what osdev wiki says.
+  //
+  // Both are right. The exponent form is only for SuperSpeed. Check
+  // ep0MaxPacketSize.
   uint8_t bMaxPacketSize0; // max packet size for endpoint 0
   uint16_t idVendor;
   uint16_t idProduct;
@@ -152,10 +205,12 @@ class DeviceDescriptor {
 static_assert(sizeof(DeviceDescriptor) == 18);
 
 enum class DeviceRequestCode : uint8_t {
+  CLEAR_FEATURE = 1,
   SET_ADDRESS = 5,
   GET_DESCRIPTOR = 6,
   GET_CONFIGURATION = 8,
   SET_CONFIGURATION = 9,
+  SET_INTERFACE = 11,
 };
 
 // a device request is the payload of the Setup packet.
@@ -2,6 +2,9 @@
 #include <kernel/usb/xhci_ring.h>
 #include <kernel/usb/usb_device.h>
 #include <kernel/usb/msd.h>
+#include <kernel/paging.h>
+#include <kernel/asm_util.h>
+#include <kernel/idt.h>
 
 TRBTemplate TRBCommon::toTemplate() const {
   return *(TRBTemplate*) this;
@@ -20,6 +23,25 @@ ProducerTRBRing& allocate_transfer_ring() {
   return transfer_ring_pool[next_avail++];
 }
 
+// the status and data pipes of an UAS device. The controller updates the
+// dequeue pointers in the stream contexts, so the ring of each stream is
+// remembered in stream_ring_pool.
+#define AVAIL_STREAM_CTX_ARRAYS 4
+StreamContext stream_ctx_array_pool[AVAIL_STREAM_CTX_ARRAYS][XHCI_MAX_STREAM_CTX] __attribute__((aligned(16)));
+ProducerTRBRing* stream_ring_pool[AVAIL_STREAM_CTX_ARRAYS][XHCI_MAX_STREAM_CTX];
+StreamContext* allocate_stream_ctx_array() {
+  static int next_avail = 0;
+  assert(next_avail < AVAIL_STREAM_CTX_ARRAYS);
+  return stream_ctx_array_pool[next_avail++];
+}
+
+static ProducerTRBRing*& stream_ring(EndpointContext& input_ctx, uint32_t stream_id) {
+  assert(stream_id > 0 && stream_id < (2U << input_ctx.max_pstreams));
+  int idx = (StreamContext (*)[XHCI_MAX_STREAM_CTX]) input_ctx.get_stream_ctx_array() - stream_ctx_array_pool;
+  assert(idx >= 0 && idx < AVAIL_STREAM_CTX_ARRAYS);
+  return stream_ring_pool[idx][stream_id];
+}
+
 // initialize the command ring. Setup CRCR to point to it.
 void XHCIDriver::initializeCommandRing() {
   // set RCS to 1 so the C bit of all TRBS on the command ring
@@ -95,12 +117,19 @@ EventRingSegmentTableEntry::EventRingSegmentTableEntry(const TRBRing& trb_ring)
 // TODO consolidate with xhch_driver in usb.cpp
 XHCIDriver* gcontroller = nullptr;
 
+// also clears the event handler busy bit so the controller can raise the next
+// interrupt
 void update_hc_event_ring_dequeue_ptr(TRBTemplate *dequeue_ptr) {
   assert(gcontroller);
-  gcontroller->setERDPLow(0, (uint32_t) dequeue_ptr);
+  gcontroller->setERDPLow(0, (uint32_t) dequeue_ptr | ERDP_EHB);
   gcontroller->setERDPHigh(0, 0);
 }
 
+static void xhci_irq_handler() {
+  assert(gcontroller);
+  gcontroller->handleInterrupt();
+}
+
 /*
  * According to xhci spec 5.5.2, secondary interrupters can be initialized
  * after R/S is set to 1 but before a event targeting it is generated.
@@ -122,6 +151,10 @@ void XHCIDriver::initializeInterrupter() {
   setERSTBAHigh(0, 0);
 
   update_hc_event_ring_dequeue_ptr(event_ring.begin());
+
+  setInterruptModeration(XHCI_IMOD_INTERVAL);
+  // clear a stale pending interrupt as well
+  setIMan(0, IMAN_IE | IMAN_IP);
 }
 
 void XHCIDriver::initialize() {
@@ -129,6 +162,119 @@ void XHCIDriver::initialize() {
   initializeCommandRing();
   initializeContext();
   initializeInterrupter();
+
+  // 0xFF means the interrupt line is not connected
+  int irq = pci_func_.interrupt_line();
+  printf("xHCI interrupt line %d\n", irq);
+  if (irq > 0 && irq < 16) {
+    register_irq_handler(irq, (void*) xhci_irq_handler);
+    irq_enabled_ = true;
+    setUSBCmdFlags(USBCMD_INTE);
+  }
+}
+
+void XHCIDriver::submit(XHCICompletion* comp) {
+  comp->done_ = false;
+  comp->next_ = nullptr;
+  uint32_t flags = asm_cli_save();
+  XHCICompletion** pp = &pending_;
+  while (*pp) {
+    pp = &(*pp)->next_;
+  }
+  *pp = comp;
+  asm_restore_flags(flags);
+}
+
+XHCICompletion* XHCIDriver::takeCompletion(const TRBTemplate& event_trb) {
+  uint32_t trb_addr;
+  bool is_transfer = false;
+  if (auto* comp_event = event_trb.to_trb_type<CommandCompletionEventTRB>()) {
+    trb_addr = comp_event->command_trb_pointer_low;
+  } else if (auto* xfer_event = event_trb.to_trb_type<TransferEventTRB>()) {
+    trb_addr = xfer_event->trb_pointer_low;
+    is_transfer = true;
+  } else {
+    return nullptr;
+  }
+  XHCICompletion** found = nullptr;
+  for (XHCICompletion** pp = &pending_; *pp; pp = &(*pp)->next_) {
+    if ((uint32_t) (*pp)->trb_ == trb_addr) {
+      found = pp;
+      break;
+    }
+    // a transfer that fails or ends with a short packet in the middle of a TD
+    // reports that TRB rather than the last one. Hand the event to the oldest
+    // transfer on the same ring. Each stream of an endpoint has its own ring.
+    if (!found && is_transfer && (*pp)->ring_->get_addr() == (trb_addr & ~0xFFF)) {
+      found = pp;
+    }
+  }
+  if (!found) {
+    return nullptr;
+  }
+  XHCICompletion* comp = *found;
+  *found = comp->next_;
+  return comp;
+}
+
+void XHCIDriver::handleEvents() {
+  uint32_t flags = asm_cli_save();
+  // acknowledge the interrupt before looking at the ring. An event arriving
+  // after this raises a new one.
+  setIMan(0, getIMan(0) | IMAN_IP);
+  *getOpRegPtr(XHCIOpRegOff::USBSTS) = USBSTS_EINT;
+  bool drained = false;
+  while (event_ring.hasItem()) {
+    TRBTemplate event_trb = event_ring.dequeue();
+    drained = true;
+    XHCICompletion* comp = takeCompletion(event_trb);
+    if (!comp) {
+      if (auto* hce_trb = event_trb.to_trb_type<HostControllerEventTRB>()) {
+        printf("HostControllerEventTRB completion code %d\n", hce_trb->completion_code);
+      } else {
+        printf("Skip event trb %d\n", event_trb.trb_type);
+      }
+      continue;
+    }
+    comp->event_ = event_trb;
+    comp->ring_->update_shadow_dequeue_ptr(comp->trb_);
+    comp->done_ = true;
+    if (comp->callback_) {
+      comp->callback_(comp);
+    }
+  }
+  if (drained) {
+    update_hc_event_ring_dequeue_ptr(event_ring.dequeue_ptr());
+  }
+  asm_restore_flags(flags);
+}
+
+void XHCIDriver::handleInterrupt() {
+  // the IRQ line may be shared with other devices
+  if ((getUSBSts() & USBSTS_EINT) == 0 && (getIMan(0) & IMAN_IP) == 0) {
+    return;
+  }
+  handleEvents();
+}
+
+void XHCIDriver::wait(XHCICompletion* comp) {
+  while (true) {
+    uint32_t flags = asm_cli_save();
+    // this also picks up the events whose interrupt is missed, e.g. the IRQ
+    // line was asserted before the handler got registered.
+    handleEvents();
+    if (comp->done_) {
+      asm_restore_flags(flags);
+      return;
+    }
+    if (irq_enabled_ && (flags & EFLAGS_IF)) {
+      // sleep until the IRQ handler (or the timer) wakes us up. Interrupts
+      // stay enabled afterwards which matches flags.
+      asm_sti_hlt();
+    } else {
+      asm_restore_flags(flags);
+    }
+  }
 }
 
 void XHCIDriver::resetPort(int port_no) {
@@ -152,19 +298,12 @@ void XHCIDriver::resetPort(int port_no) {
 }
 
 uint32_t XHCIDriver::allocate_device_slot() {
-  event_ring.skip_queued_trbs();
-  TRBTemplate* req = command_ring.enqueue(EnableSlotCommandTRB().toTemplate());
-  ringDoorbell(0, 0);
-  TRBTemplate resp = event_ring.dequeue();
-
-  CommandCompletionEventTRB command_comp = resp.expect_trb_type<CommandCompletionEventTRB>();
-  command_comp.assert_trb_addr(req);
-  assert(command_comp.success());
+  // skip the port status change events left by the port reset
+  handleEvents();
+  CommandCompletionEventTRB command_comp = sendCommand(EnableSlotCommandTRB().toTemplate());
   int slot_id = command_comp.slot_id;
   // According to xhci spec 4.6.3, slot id 0 represents no slots available.
   assert(slot_id > 0);
-
-  command_ring.update_shadow_dequeue_ptr(req);
   return slot_id;
 }
 
@@ -174,6 +313,7 @@ void XHCIDriver::initEndpoint0Context(InputContext& input_context, int max_packe
   ep0_context.ep_type = EndpointType::CONTROL;
   ep0_context.max_packet_size = max_packet_size;
   printf("ep0 max packet size is %d\n", max_packet_size);
+  // control endpoints don't burst and have no companion descriptor
   ep0_context.max_burst_size = 0;
   ep0_context.set_tr_dequeue_pointer(transfer_ring.get_addr());
   ep0_context.dcs = 1;
@@ -181,10 +321,28 @@ void XHCIDriver::initEndpoint0Context(InputContext& input_context, int max_packe
   ep0_context.max_pstreams = 0;
   ep0_context.mult = 0;
   ep0_context.cerr = 3;
+  // xhci spec 4.14.1.1 suggests 8 for control endpoints
+  ep0_context.average_trb_length = 8;
 }
 
-void XHCIDriver::initEndpointContext(InputContext& input_context, EndpointDescriptor& endpoint_descriptor) {
-  ProducerTRBRing& transfer_ring = allocate_transfer_ring();
+void XHCIDriver::updateEndpoint0MaxPacketSize(USBDevice<XHCIDriver>* dev, int max_packet_size) {
+  printf("ep0 max packet size is %d rather than %d\n", max_packet_size, dev->getMaxPacketSize());
+  uint32_t slot_id = dev->slot_id();
+  InputContext& input_context = globalInputContextList[slot_id];
+  input_context.device_context().endpoint_context(0).max_packet_size = max_packet_size;
+  InputControlContext& control_context = input_context.control_context();
+  control_context.drop_context_flags() = 0;
+  control_context.add_context_flags() = 1 << 1; // ep0
+  sendCommand(EvaluateContextCommandTRB((uint32_t) &input_context, slot_id).toTemplate());
+  dev->setMaxPacketSize(max_packet_size);
+}
+
+// the max burst size to program for an endpoint
+static uint32_t max_burst_size(const SuperSpeedEndpointCompanionDescriptor& companion, bool use_burst) {
+  return companion && use_burst ? companion.bMaxBurst : 0;
+}
+
+void XHCIDriver::initEndpointContext(InputContext& input_context, const EndpointDescriptor& endpoint_descriptor, const SuperSpeedEndpointCompanionDescriptor& companion, uint32_t nstreams) {
   bool is_in = (endpoint_descriptor.bEndpointAddress & 0x80);
   EndpointContext& ep_context = input_context.device_context().endpoint_context(
     endpoint_descriptor.bEndpointAddress & 0xF,
@@ -193,13 +351,55 @@ void XHCIDriver::initEndpointContext(InputContext& input_context, EndpointDescri
   // TODO: only support bulk endpoint for now
   ep_context.ep_type = is_in ? EndpointType::BULK_IN : EndpointType::BULK_OUT;
   ep_context.max_packet_size = endpoint_descriptor.wMaxPacketSize;
-  ep_context.max_burst_size = 0;  // TODO use the information in SuperSpeedEndpointCompanionDescriptor to initialize it?
-  ep_context.set_tr_dequeue_pointer(transfer_ring.get_addr());
-  ep_context.dcs = 1;
+  // a SuperSpeed endpoint moves up to max_burst_size + 1 packets before
+  // waiting for an acknowledgement. Check usb3 spec 9.6.7
+  ep_context.max_burst_size = max_burst_size(companion, use_burst_);
+  // Mult and Max ESIT Payload only apply to periodic endpoints. For bulk
+  // endpoints, the low bits of the companion bmAttributes are MaxStreams.
+  // Check xhci spec 6.2.3
+  int transfer_type = endpoint_descriptor.bmAttributes & 3;
+  bool isoch = transfer_type == 1;
+  bool periodic = isoch || transfer_type == 3;
+  ep_context.mult = isoch && companion ? companion.bmAttributes & 3 : 0;
+  uint32_t max_esit_payload = 0;
+  if (periodic) {
+    max_esit_payload = companion ? companion.wBytesPerInterval
+      : endpoint_descriptor.wMaxPacketSize * (ep_context.max_burst_size + 1);
+  }
+  ep_context.max_esit_payload_lo = max_esit_payload & 0xFFFF;
+  ep_context.max_esit_payload_hi = max_esit_payload >> 16;
+  // xhci spec 4.14.1.1 suggests 3KB for bulk endpoints
+  ep_context.average_trb_length = 3072;
   ep_context.interval = 0;
-  ep_context.max_pstreams = 0;
-  ep_context.mult = 0;
   ep_context.cerr = 3;
+  if (nstreams == 0) {
+    ProducerTRBRing& transfer_ring = allocate_transfer_ring();
+    ep_context.set_tr_dequeue_pointer(transfer_ring.get_addr());
+    ep_context.dcs = 1;
+    ep_context.max_pstreams = 0;
+    ep_context.lsa = 0;
+    return;
+  }
+
+  // a linear stream context array of 2^(max_pstreams + 1) entries. Stream 0
+  // is reserved. Check xhci spec 4.12.2
+  uint32_t max_pstreams = 1;
+  while ((2U << max_pstreams) < nstreams + 1) {
+    ++max_pstreams;
+  }
+  assert((2U << max_pstreams) <= XHCI_MAX_STREAM_CTX);
+  assert(max_pstreams <= getMaxPSASize());
+  StreamContext* stream_ctx_array = allocate_stream_ctx_array();
+  memset(stream_ctx_array, 0, sizeof(StreamContext) * XHCI_MAX_STREAM_CTX);
+  ep_context.set_tr_dequeue_pointer((uint32_t) stream_ctx_array);
+  ep_context.dcs = 0; // must be 0 when the pointer is a stream context array
+  ep_context.max_pstreams = max_pstreams;
+  ep_context.lsa = 1;
+  for (uint32_t stream_id = 1; stream_id <= nstreams; ++stream_id) {
+    ProducerTRBRing& transfer_ring = allocate_transfer_ring();
+    stream_ring(ep_context, stream_id) = &transfer_ring;
+    stream_ctx_array[stream_id].set_tr_dequeue_pointer(transfer_ring.get_addr());
+  }
 }
 
 void XHCIDriver::setup_slot(uint32_t slot_id, int port_no, int max_packet_size) {
@@ -231,17 +431,40 @@ uint32_t XHCIDriver::assign_usb_device_address(uint32_t slot_id) {
   return usb_device_address;
 }
 
-void XHCIDriver::sendCommand(TRBTemplate req) {
-  TRBTemplate* req_addr = command_ring.enqueue(req);
+CommandCompletionEventTRB XHCIDriver::sendCommand(TRBTemplate req) {
+  XHCICompletion comp;
+  comp.trb_ = command_ring.enqueue(req);
+  comp.ring_ = &command_ring;
+  submit(&comp);
   ringDoorbell(0, 0); 
-  TRBTemplate resp = event_ring.dequeue();
-  CommandCompletionEventTRB command_comp = resp.expect_trb_type<CommandCompletionEventTRB>();
-  command_comp.assert_trb_addr(req_addr);
+  wait(&comp);
+  CommandCompletionEventTRB command_comp = comp.event_.expect_trb_type<CommandCompletionEventTRB>();
+  command_comp.assert_trb_addr(comp.trb_);
   assert(command_comp.success());
-  command_ring.update_shadow_dequeue_ptr(req_addr);
+  return command_comp;
 }
 
-static uint32_t add_context_flags_for_configure_endpoint(EndpointDescriptor& bulk_in, EndpointDescriptor bulk_out) {
+static int get_endpoint_context_idx(const EndpointDescriptor& desc) {
+  int ep_num = (desc.bEndpointAddress & 0xF);
+  bool is_in = (desc.bEndpointAddress & 0x80);
+  return DeviceContext::endpoint_context_index(ep_num, is_in);
+}
+
+static EndpointContext& get_endpoint_context(USBDevice<XHCIDriver>* device, const EndpointDescriptor& desc, bool input_context) {
+  DeviceContext* device_context_ptr = nullptr;
+  if (input_context) {
+    device_context_ptr = &globalInputContextList[device->slot_id()].device_context();
+  } else {
+    device_context_ptr = &globalDeviceContextList[device->slot_id()];
+  }
+  DeviceContext& device_context = *device_context_ptr;
+  int ep_num = (desc.bEndpointAddress & 0xF);
+  bool is_in = (desc.bEndpointAddress & 0x80);
+  EndpointContext& endpoint_context = device_context.endpoint_context(ep_num, is_in);
+  return endpoint_context;
+}
+
+static uint32_t add_context_flags_for_configure_endpoint(const EndpointDescriptor& bulk_in, const EndpointDescriptor& bulk_out) {
   uint32_t flags = 0;
   flags |= 1; // pick the slot context
   flags |= (1 << DeviceContext::endpoint_context_index(bulk_in.bEndpointAddress & 0xF, true));
@@ -261,8 +484,8 @@ void XHCIDriver::configureEndpoints(USBDevice<XHCIDriver>* dev) {
   // follow Haiku OS
   input_slot_context.context_entries = 31;
 
-  initEndpointContext(input_context, dev->get_bulk_in_endpoint_desc());
-  initEndpointContext(input_context, dev->get_bulk_out_endpoint_desc());
+  initEndpointContext(input_context, dev->get_bulk_in_endpoint_desc(), dev->get_bulk_in_companion());
+  initEndpointContext(input_context, dev->get_bulk_out_endpoint_desc(), dev->get_bulk_out_companion());
 
   InputControlContext& control_context = input_context.control_context();
   control_context.drop_context_flags() = 0;
@@ -273,6 +496,95 @@ void XHCIDriver::configureEndpoints(USBDevice<XHCIDriver>* dev) {
   sendCommand(req);
 }
 
+uint32_t XHCIDriver::uasStreams(USBDevice<XHCIDriver>* dev, int port_no) {
+  // UAS over USB 2 sends READ READY/WRITE READY IUs in place of streams.
+  // Only the SuperSpeed flavor is supported.
+  if (!dev->hasUAS() || getPortSpeed(port_no) != 4 || getMaxPSASize() == 0) {
+    return 0;
+  }
+  uint32_t nstreams = min(MSD_QUEUE_DEPTH, XHCI_MAX_STREAM_CTX - 1);
+  nstreams = min(nstreams, (2U << getMaxPSASize()) - 1);
+  UASPipe stream_pipes[] = {UASPipe::STATUS, UASPipe::DATA_IN, UASPipe::DATA_OUT};
+  for (UASPipe pipe : stream_pipes) {
+    nstreams = min(nstreams, dev->uasCompanion(pipe).maxStreams());
+  }
+  return nstreams;
+}
+
+void XHCIDriver::configureUASEndpoints(USBDevice<XHCIDriver>* dev, uint32_t nstreams) {
+  uint32_t slot_id = dev->slot_id();
+  InputContext& input_context = globalInputContextList[slot_id];
+  input_context.device_context().slot_context().context_entries = 31;
+
+  InputControlContext& control_context = input_context.control_context();
+  control_context.drop_context_flags() = 0;
+  control_context.add_context_flags() = 1; // the slot context
+  UASPipe pipes[] = {UASPipe::COMMAND, UASPipe::STATUS, UASPipe::DATA_IN, UASPipe::DATA_OUT};
+  for (UASPipe pipe : pipes) {
+    const EndpointDescriptor& desc = dev->uasPipe(pipe);
+    // commands are not tagged by stream
+    initEndpointContext(input_context, desc, dev->uasCompanion(pipe), pipe == UASPipe::COMMAND ? 0 : nstreams);
+    control_context.add_context_flags() |= (1 << get_endpoint_context_idx(desc));
+  }
+
+  TRBTemplate req = ConfigureEndpointCommandTRB((uint32_t) &input_context, slot_id).toTemplate();
+  sendCommand(req);
+}
+
+void XHCIDriver::setMaxBurst(USBDevice<XHCIDriver>* dev, bool use_burst) {
+  if (use_burst == use_burst_) {
+    return;
+  }
+  use_burst_ = use_burst;
+
+  const EndpointDescriptor* descs[UAS_NPIPE];
+  const SuperSpeedEndpointCompanionDescriptor* companions[UAS_NPIPE];
+  int nep = 0;
+  if (dev->uasNumStreams()) {
+    UASPipe pipes[] = {UASPipe::COMMAND, UASPipe::STATUS, UASPipe::DATA_IN, UASPipe::DATA_OUT};
+    for (UASPipe pipe : pipes) {
+      descs[nep] = &dev->uasPipe(pipe);
+      companions[nep++] = &dev->uasCompanion(pipe);
+    }
+  } else {
+    descs[nep] = &dev->get_bulk_in_endpoint_desc();
+    companions[nep++] = &dev->get_bulk_in_companion();
+    descs[nep] = &dev->get_bulk_out_endpoint_desc();
+    companions[nep++] = &dev->get_bulk_out_companion();
+  }
+
+  // drop and add the endpoints with the new burst size. They restart from
+  // the beginning of their rings, which are idle. Check xhci spec 4.6.6
+  uint32_t slot_id = dev->slot_id();
+  InputContext& input_context = globalInputContextList[slot_id];
+  InputControlContext& control_context = input_context.control_context();
+  control_context.drop_context_flags() = 0;
+  control_context.add_context_flags() = 1; // the slot context
+  for (int i = 0; i < nep; ++i) {
+    EndpointContext& ep_context = get_endpoint_context(dev, *descs[i], true);
+    ep_context.max_burst_size = max_burst_size(*companions[i], use_burst_);
+    if (ep_context.max_pstreams == 0) {
+      ep_context.get_tr_dequeue_pointer().reset();
+      ep_context.dcs = 1;
+    } else {
+      for (uint32_t stream_id = 1; stream_id <= dev->uasNumStreams(); ++stream_id) {
+        ProducerTRBRing* ring = stream_ring(ep_context, stream_id);
+        ring->reset();
+        ep_context.get_stream_ctx_array()[stream_id].set_tr_dequeue_pointer(ring->get_addr());
+      }
+    }
+    uint32_t flag = 1 << get_endpoint_context_idx(*descs[i]);
+    control_context.drop_context_flags() |= flag;
+    control_context.add_context_flags() |= flag;
+  }
+  sendCommand(ConfigureEndpointCommandTRB((uint32_t) &input_context, slot_id).toTemplate());
+
+  // the device restarts its sequence numbers too
+  for (int i = 0; i < nep; ++i) {
+    dev->clearHalt(*descs[i]);
+  }
+}
+
 void XHCIDriver::initializeDevice(USBDevice<XHCIDriver> *dev) {
   uint32_t slot_id = allocate_device_slot();
   printf("Got device slot %d\n", slot_id);
@@ -289,6 +601,10 @@ void XHCIDriver::initializeDevice(USBDevice<XHCIDriver> *dev) {
 
   DeviceDescriptor device_desc = dev->getDeviceDescriptor();
   printf("Device USB version 0x%x\n", device_desc.bcdUSB);
+  // the port speed only tells the default max packet size of ep0
+  if (device_desc.ep0MaxPacketSize() != dev->getMaxPacketSize()) {
+    updateEndpoint0MaxPacketSize(dev, device_desc.ep0MaxPacketSize());
+  }
   ConfigurationDescriptor config_desc = dev->getConfigurationDescriptor();
 
   // set configuration
@@ -298,8 +614,17 @@ void XHCIDriver::initializeDevice(USBDevice<XHCIDriver> *dev) {
 
   dev->collectEndpointDescriptors();
 
-  // configure endpoints
-  configureEndpoints(dev);
+  // configure endpoints. Prefer UAS which can have multiple commands in
+  // flight.
+  uint32_t nstreams = uasStreams(dev, port_no);
+  if (nstreams > 0) {
+    configureUASEndpoints(dev, nstreams);
+    dev->selectUAS();
+    dev->uasNumStreams() = nstreams;
+    printf("Use UAS with %d streams\n", nstreams);
+  } else {
+    configureEndpoints(dev);
+  }
 
   printf("Current slot state: %s\n", globalDeviceContextList[slot_id].slot_context().get_state_str());
 }
@@ -329,76 +654,135 @@ void XHCIDriver::sendDeviceRequest(USBDevice<XHCIDriver>* device, DeviceRequest*
 
   // Refert to XHCI spec table 4-7 for how to define DIR bit of StatusStageTRB
   auto status_trb = StatusStageTRB(!(device_req->bmRequestType & 0x80) || device_req->wLength == 0);
-  auto* status_trb_addr = transfer_ring.enqueue(status_trb.toTemplate());
+  XHCICompletion comp;
+  comp.trb_ = transfer_ring.enqueue(status_trb.toTemplate());
+  comp.ring_ = &transfer_ring;
+  comp.slot_id_ = device->slot_id();
+  comp.endpoint_id_ = 1;
+  submit(&comp);
   ringDoorbell(device->slot_id(), 1 /* for control endpoint 0 */);
+  wait(&comp);
 
-  TRBTemplate event_trb_template = event_ring.dequeue();
-  TransferEventTRB event_trb = event_trb_template.expect_trb_type<TransferEventTRB>();
+  TransferEventTRB event_trb = comp.event_.expect_trb_type<TransferEventTRB>();
   assert(event_trb.success());
-  event_trb.assert_trb_addr(status_trb_addr);
+  event_trb.assert_trb_addr(comp.trb_);
   assert(!event_trb.has_residue());
   assert(event_trb.endpoint_id == 1);
   assert(event_trb.slot_id == device->slot_id());
-
-  transfer_ring.update_shadow_dequeue_ptr(status_trb_addr);
 }
 
-static int get_endpoint_context_idx(const EndpointDescriptor& desc) {
-  int ep_num = (desc.bEndpointAddress & 0xF);
-  bool is_in = (desc.bEndpointAddress & 0x80);
-  return DeviceContext::endpoint_context_index(ep_num, is_in);
-}
-
-static EndpointContext& get_endpoint_context(USBDevice<XHCIDriver>* device, const EndpointDescriptor& desc, bool input_context) {
-  DeviceContext* device_context_ptr = nullptr;
-  if (input_context) {
-    device_context_ptr = &globalInputContextList[device->slot_id()].device_context();
-  } else {
-    device_context_ptr = &globalDeviceContextList[device->slot_id()];
+// return the number of bytes starting from la that are physically contiguous
+// and don't cross a 64KB boundary, up to len. *ppa is set to the physical
+// address of la.
+static int contiguous_run(phys_addr_t pgdir, uint32_t la, int len, phys_addr_t* ppa) {
+  phys_addr_t pa = virt_to_phys(pgdir, la & ~0xFFF);
+  assert(pa && "bulkTransfer buffer not mapped");
+  pa |= la & 0xFFF;
+  *ppa = pa;
+  // a TRB buffer must not cross a 64KB boundary. Check xHCI spec 6.4.1
+  int run = min(len, XHCI_TRB_MAX_TRANSFER - (int) (pa & (XHCI_TRB_MAX_TRANSFER - 1)));
+  int cur = 4096 - (la & 0xFFF);
+  while (cur < run && virt_to_phys(pgdir, la + cur) == pa + cur) {
+    cur += 4096;
   }
-  DeviceContext& device_context = *device_context_ptr;
-  int ep_num = (desc.bEndpointAddress & 0xF);
-  bool is_in = (desc.bEndpointAddress & 0x80);
-  EndpointContext& endpoint_context = device_context.endpoint_context(ep_num, is_in);
-  return endpoint_context;
+  return min(cur, run);
 }
 
-// common code for bulkSend/bulkRecv
-void XHCIDriver::bulkTransfer(USBDevice<XHCIDriver>* device, const EndpointDescriptor& desc, const uint8_t* buf, int bufsize) {
+int XHCIDriver::bulkTransferAsync(USBDevice<XHCIDriver>* device, const EndpointDescriptor& desc, uint32_t& /* toggle */, const uint8_t* buf, int bufsize, XHCICompletion* comp, uint32_t stream_id) {
   EndpointContext& input_ctx = get_endpoint_context(device, desc, true);
 
   int maxPacketSize = desc.wMaxPacketSize;
-  int ntd = (bufsize + maxPacketSize - 1) / maxPacketSize;
   assert(bufsize > 0);
 
-  ProducerTRBRing &transfer_ring = input_ctx.get_tr_dequeue_pointer();
+  ProducerTRBRing* ring = stream_id ? stream_ring(input_ctx, stream_id) : &input_ctx.get_tr_dequeue_pointer();
+  assert(ring && "stream not set up");
+  ProducerTRBRing &transfer_ring = *ring;
+
+  // buf is a virtual address. It may come from user space or the kernel
+  // heap and is not necessarily physically contiguous. Each TRB covers a
+  // physically contiguous piece of it.
+  phys_addr_t pgdir = asm_get_cr3();
+  int avail = transfer_ring.available();
+  // with 2 TRBs, the TD can always be trimmed to whole packets below
+  if (avail < 2) {
+    return 0;
+  }
+  phys_addr_t trb_pa[XHCI_MAX_TD_TRBS];
+  int trb_len[XHCI_MAX_TD_TRBS];
+  int ntrb = 0;
+  int tdsize = 0;
+  while (tdsize < bufsize && ntrb < min(avail, XHCI_MAX_TD_TRBS)) {
+    trb_len[ntrb] = contiguous_run(pgdir, (uint32_t) buf + tdsize, bufsize - tdsize, &trb_pa[ntrb]);
+    tdsize += trb_len[ntrb++];
+  }
+  if (tdsize < bufsize) {
+    // the rest goes to the next TD. Only the last TD of the transfer may end
+    // with a short packet.
+    int extra = tdsize % maxPacketSize;
+    while (ntrb > 1 && extra >= trb_len[ntrb - 1]) {
+      extra -= trb_len[--ntrb];
+      tdsize -= trb_len[ntrb];
+    }
+    trb_len[ntrb - 1] -= extra;
+    tdsize -= extra;
+    assert(ntrb > 0 && tdsize > 0);
+  }
 
-  int off = 0, len;
+  int off = 0;
   TRBTemplate* expected_trb = nullptr;
-  for (int i = 0; i < ntd; ++i) {
-    len = min(maxPacketSize, bufsize - off);
-    NormalTRB normal_trb((uint32_t) buf + off, len, i == ntd - 1);
+  for (int i = 0; i < ntrb; ++i) {
+    off += trb_len[i];
+    bool last = i == ntrb - 1;
+    NormalTRB normal_trb(trb_pa[i], trb_len[i], last);
+    normal_trb.ch = !last;
+    // the number of packets after this TRB. Check xHCI spec 4.11.2.4
+    normal_trb.td_size = min(31, (tdsize - off + maxPacketSize - 1) / maxPacketSize);
     expected_trb = transfer_ring.enqueue(normal_trb.toTemplate()); // only the last assignment matters
-    off += len;
   }
 
-  ringDoorbell(device->slot_id(), get_endpoint_context_idx(desc));
+  comp->trb_ = expected_trb;
+  comp->ring_ = &transfer_ring;
+  comp->slot_id_ = device->slot_id();
+  comp->endpoint_id_ = get_endpoint_context_idx(desc);
+  submit(comp);
+  // the stream id goes to DB Stream ID. Check xhci spec 5.6
+  ringDoorbell(device->slot_id(), get_endpoint_context_idx(desc) | (stream_id << 16));
+  return tdsize;
+}
 
-  TRBTemplate event_trb_template = event_ring.dequeue();
-  if (!event_trb_template.to_trb_type<TransferEventTRB>()) {
-    HostControllerEventTRB* hce_trb = event_trb_template.to_trb_type<HostControllerEventTRB>();
-    if (hce_trb) {
-      printf("HostControllerEventTRB completion code %d\n", hce_trb->completion_code);
-    }
-    assert(false && "bulkTransfer fail to get a transfer event trb\n");
+int XHCIDriver::waitTransfer(XHCICompletion* comp) {
+  wait(comp);
+  TransferEventTRB event_trb = comp->event_.expect_trb_type<TransferEventTRB>();
+  assert(event_trb.slot_id == comp->slot_id_);
+  assert(event_trb.endpoint_id == comp->endpoint_id_);
+  // an IN transfer may end with a short packet, e.g. a sense IU shorter than
+  // the buffer. Without ISP the event still comes from the last TRB.
+  if (event_trb.completion_code != (int) TRBCompletionCode::SHORT_PACKET) {
+    assert(event_trb.success());
+  }
+  event_trb.assert_trb_addr(comp->trb_);
+  return event_trb.trb_transfer_length;
+}
+
+// common code for bulkSend/bulkRecv
+void XHCIDriver::bulkTransfer(USBDevice<XHCIDriver>* device, const EndpointDescriptor& desc, const uint8_t* buf, int bufsize) {
+  // a transfer larger than what the ring can take is split into TDs
+  uint32_t toggle = 0; // unused by xHCI
+  while (bufsize > 0) {
+    XHCICompletion comp;
+    int len = bulkTransferAsync(device, desc, toggle, buf, bufsize, &comp);
+    assert(len > 0 && "transfer ring is full");
+    wait(&comp);
+
+    TransferEventTRB event_trb = comp.event_.expect_trb_type<TransferEventTRB>();
+    event_trb.assert_trb_addr(comp.trb_);
+    assert(!event_trb.has_residue());
+    assert(event_trb.success());
+    assert(event_trb.endpoint_id == get_endpoint_context_idx(desc));
+    assert(event_trb.slot_id == device->slot_id());
+    buf += len;
+    bufsize -= len;
   }
-  TransferEventTRB event_trb = event_trb_template.expect_trb_type<TransferEventTRB>();
-  event_trb.assert_trb_addr(expected_trb);
-  transfer_ring.update_shadow_dequeue_ptr(expected_trb);
-  assert(!event_trb.has_residue());
-  assert(event_trb.success());
-  assert(event_trb.endpoint_id == get_endpoint_context_idx(desc));
-  assert(event_trb.slot_id == device->slot_id());
 }
 
 void XHCIDriver::bulkSend(USBDevice<XHCIDriver>* device, const EndpointDescriptor& desc, uint32_t& /* toggle */, const uint8_t* buf, int bufsize) {
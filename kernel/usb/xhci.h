@@ -41,6 +41,32 @@ enum class XHCIOpRegOff {
   PORTHLPMC = 0x40C,
 };
 
+// USBCMD bits
+#define USBCMD_INTE (1 << 2) // interrupter enable
+// USBSTS bits
+#define USBSTS_EINT (1 << 3) // event interrupt. Write 1 to clear.
+// IMAN bits
+#define IMAN_IP (1 << 0) // interrupt pending. Write 1 to clear.
+#define IMAN_IE (1 << 1) // interrupt enable
+// ERDP bits
+#define ERDP_EHB (1 << 3) // event handler busy. Write 1 to clear.
+
+// max bytes a single TRB can transfer. A TRB buffer can't cross a 64KB
+// boundary either.
+#define XHCI_TRB_MAX_TRANSFER (64 << 10)
+// max number of TRBs in a TD queued by bulkTransferAsync
+#define XHCI_MAX_TD_TRBS 64
+// max number of entries in a stream context array. Stream 0 is reserved.
+#define XHCI_MAX_STREAM_CTX 16
+
+// The interrupt moderation interval in 250ns units. The controller raises at
+// most one interrupt per interval; the events in between are handled as a
+// batch. 0 disables moderation. Can be overriden at build time or changed
+// with XHCIDriver::setInterruptModeration.
+#ifndef XHCI_IMOD_INTERVAL
+#define XHCI_IMOD_INTERVAL 160 // 40us
+#endif
+
 enum class XHCIRuntimeRegOff {
   IMAN = 0x20, // interrupter management register, 4 bytes
   IMOD = 0x24, // interrupter moderation register, 4 bytes
@@ -107,8 +133,35 @@ static_assert(sizeof(EventRingSegmentTableEntry) == 16);
 template <typename ControllerDriver>
 class USBDevice;
 
+class ProducerTRBRing;
+
+/*
+ * An outstanding command or transfer. The event handler matches the event
+ * generated for trb_ with the completion, copies the event to event_, moves
+ * the shadow dequeue ptr of ring_ and sets done_. If callback_ is set, it's
+ * called after that, possibly in the IRQ handler, and may submit new work.
+ */
+class XHCICompletion {
+ public:
+  explicit XHCICompletion(void (*callback)(XHCICompletion*) = nullptr, void* arg = nullptr)
+    : callback_(callback), arg_(arg) { }
+
+  TRBTemplate* trb_ = nullptr;
+  ProducerTRBRing* ring_ = nullptr;
+  uint32_t slot_id_ = 0; // 0 for commands
+  uint32_t endpoint_id_ = 0;
+  volatile bool done_ = false;
+  TRBTemplate event_;
+  void (*callback_)(XHCICompletion* comp);
+  void* arg_;
+
+  XHCICompletion* next_ = nullptr; // the list of pending completions
+};
+
 class XHCIDriver : public USBControllerDriver {
  public:
+  typedef XHCICompletion Completion;
+
   explicit XHCIDriver(const PCIFunction& pci_func = PCIFunction()) : USBControllerDriver(pci_func) {
     if (pci_func_) {
       membar_ = setupMembar();
@@ -131,6 +184,29 @@ class XHCIDriver : public USBControllerDriver {
   void bulkSend(USBDevice<XHCIDriver>* device, const EndpointDescriptor& desc, uint32_t& /* toggle */, const uint8_t* buf, int bufsize);
   void bulkRecv(USBDevice<XHCIDriver>* device, const EndpointDescriptor& desc, uint32_t& /* toggle */, uint8_t* buf, int bufsize);
 
+  // queue a bulk transfer as a single TD and return without waiting for it.
+  // comp is signaled when the TD completes. Return the number of bytes
+  // queued, which is less than bufsize if the transfer ring can't take all
+  // of it; queue the rest after the TD completes. 0 if the ring is full.
+  // stream_id selects the transfer ring of an endpoint with streams.
+  int bulkTransferAsync(USBDevice<XHCIDriver>* device, const EndpointDescriptor& desc, uint32_t& /* toggle */, const uint8_t* buf, int bufsize, XHCICompletion* comp, uint32_t stream_id = 0);
+  // wait for a transfer queued by bulkTransferAsync and check it succeeded.
+  // Return the residue the controller reports, which is non-zero after a
+  // short packet.
+  int waitTransfer(XHCICompletion* comp);
+  // wait until comp is signaled. With interrupts enabled the CPU halts
+  // between the interrupts. Otherwise (e.g. in a syscall) the event ring is
+  // polled.
+  void wait(XHCICompletion* comp);
+  // drain the event ring and signal the completions the events are for
+  void handleEvents();
+  // called by the IRQ handler
+  void handleInterrupt();
+  // interval is in 250ns units. Check XHCI_IMOD_INTERVAL
+  void setInterruptModeration(uint32_t interval) {
+    setIMod(0, interval & 0xFFFF);
+  }
+
   // refer to xHCI spec 4.2 for the initialization process.
   void reset() {
     printf("CAPLENGTH %d\n", getCapLength());
@@ -223,6 +299,18 @@ class XHCIDriver : public USBControllerDriver {
  
   void initializeDevice(USBDevice<XHCIDriver>* dev);
   void configureEndpoints(USBDevice<XHCIDriver>* dev);
+  // return the number of streams to use for UAS or 0 if UAS can't be used
+  uint32_t uasStreams(USBDevice<XHCIDriver>* dev, int port_no);
+  // configure the UAS endpoints. The status and data pipes get nstreams
+  // streams.
+  void configureUASEndpoints(USBDevice<XHCIDriver>* dev, uint32_t nstreams);
+  // program the bulk endpoints of dev with the max burst size their
+  // companion descriptors advertise, or with 0 if use_burst is false. The
+  // endpoints must be idle.
+  void setMaxBurst(USBDevice<XHCIDriver>* dev, bool use_burst);
+  bool useBurst() const {
+    return use_burst_;
+  }
   void resetPort(int port_no);
 
   void initializeContext();
@@ -276,6 +364,12 @@ class XHCIDriver : public USBControllerDriver {
     return *(uint32_t*) getCapRegPtr(XHCICapRegOff::HCCPARAMS1);
   }
 
+  // the max size of a primary stream array is 2^(MaxPSASize + 1). 0 if
+  // streams are not supported.
+  uint32_t getMaxPSASize() {
+    return (getHCCParams1() >> 12) & 0xF;
+  }
+
   // get extended capabilities pointer. 0 means no extended capabilities
   // If non zero, this pointer specifies the offset to membar base in dword
   // unit.
@@ -394,10 +488,18 @@ class XHCIDriver : public USBControllerDriver {
     return *(uint32_t*) ((uint8_t*) getRuntimeRegPtr(XHCIRuntimeRegOff::IMAN) + interrupter_id * INTERRUPTER_REGISTER_REGION_SIZE);
   }
 
+  void setIMan(uint32_t interrupter_id, uint32_t val) {
+    *(uint32_t*) ((uint8_t*) getRuntimeRegPtr(XHCIRuntimeRegOff::IMAN) + interrupter_id * INTERRUPTER_REGISTER_REGION_SIZE) = val;
+  }
+
   uint32_t getIMod(uint32_t interrupter_id) {
     return *(uint32_t*) ((uint8_t*) getRuntimeRegPtr(XHCIRuntimeRegOff::IMOD) + interrupter_id * INTERRUPTER_REGISTER_REGION_SIZE);
   }
 
+  void setIMod(uint32_t interrupter_id, uint32_t val) {
+    *(uint32_t*) ((uint8_t*) getRuntimeRegPtr(XHCIRuntimeRegOff::IMOD) + interrupter_id * INTERRUPTER_REGISTER_REGION_SIZE) = val;
+  }
+
   uint32_t getERSTSZ(uint32_t interrupter_id) {
     return *(uint32_t*) ((uint8_t*) getRuntimeRegPtr(XHCIRuntimeRegOff::ERSTSZ) + interrupter_id * INTERRUPTER_REGISTER_REGION_SIZE);
   }
@@ -415,8 +517,9 @@ class XHCIDriver : public USBControllerDriver {
     *(uint32_t*) ((uint8_t*) getRuntimeRegPtr(XHCIRuntimeRegOff::ERSTBA_HIGH) + interrupter_id * INTERRUPTER_REGISTER_REGION_SIZE) = high;
   }
 
+  // the low 4 bits are the segment index and ERDP_EHB
   void setERDPLow(uint32_t interrupter_id, uint32_t low) {
-    assert((low & 0xF) == 0);
+    assert((low & 0x7) == 0);
     *(uint32_t*) ((uint8_t*) getRuntimeRegPtr(XHCIRuntimeRegOff::ERDP_LOW) + interrupter_id * INTERRUPTER_REGISTER_REGION_SIZE) = low;
   }
 
@@ -425,6 +528,10 @@ class XHCIDriver : public USBControllerDriver {
   }
  private:
   void bulkTransfer(USBDevice<XHCIDriver>* device, const EndpointDescriptor& desc, const uint8_t* buf, int bufsize);
+  // add comp to the pending list. Must be done before ringing the doorbell.
+  void submit(XHCICompletion* comp);
+  // return the pending completion event_trb is for and remove it from the list
+  XHCICompletion* takeCompletion(const TRBTemplate& event_trb);
 
   void* getCapRegPtr(XHCICapRegOff off) {
     return (void *) (membar_.get_addr() + (int) off);
@@ -440,10 +547,18 @@ class XHCIDriver : public USBControllerDriver {
 
  private:
   void initEndpoint0Context(InputContext& input_context, int max_packet_size);
-  void initEndpointContext(InputContext& input_context, EndpointDescriptor& endpoint_descriptor);
+  void updateEndpoint0MaxPacketSize(USBDevice<XHCIDriver>* dev, int max_packet_size);
+  void initEndpointContext(InputContext& input_context, const EndpointDescriptor& endpoint_descriptor, const SuperSpeedEndpointCompanionDescriptor& companion, uint32_t nstreams = 0);
   // send command to command ring and check the status in event ring
-  void sendCommand(TRBTemplate req);
+  CommandCompletionEventTRB sendCommand(TRBTemplate req);
   Bar membar_;
   void *opRegBase_;
   void *runtimeRegBase_;
+  // the event ring is drained by the IRQ handler. False if the controller
+  // has no usable IRQ line; the waiters poll the event ring then.
+  bool irq_enabled_ = false;
+  // completions not signaled yet in submission order
+  XHCICompletion* pending_ = nullptr;
+  // program the max burst size of SuperSpeed endpoints
+  bool use_burst_ = true;
 };
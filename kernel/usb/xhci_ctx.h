@@ -59,6 +59,31 @@ enum EndpointType {
   INTERRUPT_IN = 7,
 };
 
+// An entry of a stream context array. Check xhci spec 6.2.4.1
+// NOTE: the controller saves the dequeue pointer of a stream here when it
+// switches streams, so this does not tell the address of the ring.
+class StreamContext {
+ public:
+  // the stream uses the transfer ring at addr
+  void set_tr_dequeue_pointer(uint32_t addr) {
+    assert((addr & 0xF) == 0);
+    dcs = 1;
+    sct = 1; // primary transfer ring
+    tr_dequeue_pointer_low_28 = (addr >> 4);
+    tr_dequeue_pointer_hi = 0;
+  }
+
+  uint32_t dcs : 1; // dequeue cycle state
+  uint32_t sct : 3; // stream context type
+  uint32_t tr_dequeue_pointer_low_28 : 28;
+  uint32_t tr_dequeue_pointer_hi;
+  uint32_t stopped_edtla : 24;
+  uint32_t rsvd : 8;
+  uint32_t rsvd2;
+};
+
+static_assert(sizeof(StreamContext) == 16);
+
 class EndpointContext {
  public:
   void set_tr_dequeue_pointer(uint32_t addr) {
@@ -72,9 +97,18 @@ class EndpointContext {
   //       For input context, this field is not changed by the controller.
   ProducerTRBRing& get_tr_dequeue_pointer() {
     assert(tr_dequeue_pointer_hi == 0);
+    assert(max_pstreams == 0);
     return *(ProducerTRBRing*) (tr_dequeue_pointer_low_28 << 4);
   }
 
+  // an endpoint with streams points to a stream context array instead of a
+  // transfer ring. Stream 0 is reserved.
+  StreamContext* get_stream_ctx_array() {
+    assert(tr_dequeue_pointer_hi == 0);
+    assert(max_pstreams > 0 && lsa);
+    return (StreamContext*) (tr_dequeue_pointer_low_28 << 4);
+  }
+
   // workd0
   uint32_t ep_state : 3;
   uint32_t rsvd0 : 5;
@@ -99,7 +133,11 @@ class EndpointContext {
   uint32_t tr_dequeue_pointer_low_28 : 28;
   uint32_t tr_dequeue_pointer_hi;
 
-  uint32_t dummy[4];
+  // word4
+  uint32_t average_trb_length : 16;
+  uint32_t max_esit_payload_lo : 16;
+
+  uint32_t dummy[3];
 };
 
 static_assert(sizeof(EndpointContext) == 32);
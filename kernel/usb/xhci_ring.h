@@ -1,7 +1,7 @@
 #pragma once
 
+#include <string.h>
 #include <kernel/usb/xhci_trb.h>
-#include <kernel/sleep.h>
 
 // All TRB (except LinkTRB) on the list contains all 0 initially. This is archieved by the
 // TRBCommon ctor.
@@ -65,6 +65,9 @@ class ProducerTRBRing : public TRBRing {
       // advance pertential link trb
       LinkTRB* link_trb = enqueue_ptr_->to_trb_type<LinkTRB>();
       if (link_trb) {
+        // the link TRB is part of the TD if the TD continues after it. Check
+        // xHCI spec 4.11.5.1
+        link_trb->ch = in_td_;
         link_trb->c = producer_cycle_state_;
         if (link_trb->tc) {
           producer_cycle_state_ = !producer_cycle_state_;
@@ -80,9 +83,20 @@ class ProducerTRBRing : public TRBRing {
     *enqueue_ptr_ = trb;
 
     enqueue_ptr_ = next_trb;
+    // bit 4 of the control dword is the chain bit for the transfer TRBs
+    in_td_ = (trb.others >> 2) & 1;
     return ret;
   }
 
+  // the number of TRBs that can be enqueued before the ring overflows. The
+  // TRB shadow_dequeue_ptr_ points to is not reusable yet.
+  int available() const {
+    int nslot = trb_capacity() - 1; // excluding the link TRB
+    int enq = (enqueue_ptr_ - trb_ring_) % nslot;
+    int deq = shadow_dequeue_ptr_ - trb_ring_;
+    return (deq - enq - 1 + nslot) % nslot;
+  }
+
   // Only producer ring uses link trb. Wrap around for ConsumderRing/event ring
   // is easier to handle.
   static TRBTemplate* get_next_trb(TRBTemplate* cur) {
@@ -93,6 +107,16 @@ class ProducerTRBRing : public TRBRing {
     }
   }
 
+  // start over from the first TRB. Only for an idle ring of an endpoint being
+  // reconfigured. The endpoint context should point to get_addr() with DCS 1.
+  void reset() {
+    memset(trb_ring_, 0, sizeof(trb_ring_));
+    trb_ring_[trb_capacity() - 1] = LinkTRB(get_addr()).toTemplate();
+    shadow_dequeue_ptr_ = enqueue_ptr_ = trb_ring_;
+    producer_cycle_state_ = true;
+    in_td_ = false;
+  }
+
   // TODO: in theory we could set shadow_dequeue_ptr_ to next(ptr_in_event_trb)?
   void update_shadow_dequeue_ptr(TRBTemplate *ptr_in_event_trb) {
     shadow_dequeue_ptr_ = ptr_in_event_trb;
@@ -105,6 +129,8 @@ class ProducerTRBRing : public TRBRing {
   TRBTemplate* shadow_dequeue_ptr_;
   TRBTemplate* enqueue_ptr_;
   bool producer_cycle_state_;
+  // the last enqueued TRB has the chain bit set
+  bool in_td_ = false;
 };
 
 // update the host controller's copy of the event ring dequeue ptr.
@@ -117,11 +143,10 @@ class ConsumerTRBRing : public TRBRing {
     TRBRing(false),
     dequeue_ptr_(trb_ring_) { }
 
+  // the caller should check hasItem first. The host controller's copy of the
+  // dequeue ptr is not updated here. XHCIDriver::handleEvents does that once
+  // after draining a batch of events.
   TRBTemplate dequeue() {
-    // TODO: this is a blocking call right now
-    while (!hasItem()) {
-      dumbsleep(1);
-    }
     assert(hasItem());
     TRBTemplate item = *dequeue_ptr_++;
 
@@ -129,8 +154,6 @@ class ConsumerTRBRing : public TRBRing {
       dequeue_ptr_ = trb_ring_;
       consumer_cycle_state_ = !consumer_cycle_state_;
     }
-
-    update_hc_event_ring_dequeue_ptr(dequeue_ptr_);
     return item;
   }
 
@@ -138,11 +161,8 @@ class ConsumerTRBRing : public TRBRing {
     return dequeue_ptr_->c == consumer_cycle_state_;
   }
 
-  void skip_queued_trbs() {
-    while (hasItem()) {
-      TRBTemplate item = dequeue();
-      printf("Skip event trb %d (%s)\n", item.trb_type, trb_type_str((TRBType) item.trb_type));
-    }
+  TRBTemplate* dequeue_ptr() const {
+    return dequeue_ptr_;
   }
  private:
   TRBTemplate* dequeue_ptr_;
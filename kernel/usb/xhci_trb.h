@@ -13,6 +13,7 @@ enum TRBType {
   ENABLE_SLOT_COMMAND = 9,
   ADDRESS_DEVICE_COMMAND = 11,
   CONFIGURE_ENDPOINT_COMMAND = 12,
+  EVALUATE_CONTEXT_COMMAND = 13,
   TRANSFER_EVENT = 32,
   COMMAND_COMPLETION_EVENT = 33,
   PORT_STATUS_CHANGE_EVENT = 34,
@@ -234,6 +235,28 @@ class ConfigureEndpointCommandTRB : public TRBCommon {
 
 static_assert(sizeof(ConfigureEndpointCommandTRB) == 16);
 
+// update the max packet size of ep0 among others. Check xhci spec 4.6.7
+class EvaluateContextCommandTRB : public TRBCommon {
+ public:
+  explicit EvaluateContextCommandTRB(uint64_t _input_context_pointer, uint32_t _slot_id)
+    : input_context_pointer(_input_context_pointer),
+      slot_id(_slot_id) {
+    assert((input_context_pointer & 0xF) == 0 && "Requirs 16 bytes alignment");
+    trb_type = EVALUATE_CONTEXT_COMMAND;
+  }
+ public:
+  uint64_t input_context_pointer;
+  uint32_t rsvd;
+  uint32_t c : 1;
+  uint32_t rsvd2 : 8;
+  uint32_t bsr : 1;
+  uint32_t trb_type : 6;
+  uint32_t rsvd3 : 8;
+  uint32_t slot_id : 8;
+};
+
+static_assert(sizeof(EvaluateContextCommandTRB) == 16);
+
 class NoOpTRB : public TRBCommon {
  public:
   explicit NoOpTRB() {
@@ -367,6 +390,7 @@ enum TRBCompletionCode {
   BABBLE_DETECTED_ERROR = 3,
   USB_TRANSACTION_ERROR = 4,
   NO_SLOTS_AVAILABLE_ERROR = 9,
+  SHORT_PACKET = 13,
   EVENT_RING_FULL_ERROR = 21,
 };
 
@@ -380,6 +404,8 @@ static const char* completion_code_to_str(int code) {
     return "usb_transaction_error";
   case NO_SLOTS_AVAILABLE_ERROR:
     return "no_slots_available_error";
+  case SHORT_PACKET:
+    return "short_packet";
   case EVENT_RING_FULL_ERROR:
     return "event_ring_full_error";
   default:
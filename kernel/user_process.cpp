@@ -62,6 +62,7 @@ UserProcess* UserProcess::allocate() {
 
       g_process_list[i].wait_for_child_ = nullptr;
       g_process_list[i].wait_for_pstatus_ = nullptr;
+      g_process_list[i].ioring_ = nullptr;
 
       assert(g_process_list[i].cwd_ == nullptr);
 
@@ -173,21 +174,13 @@ int UserProcess::allocFd(FileDescBase* fdptr, bool checkall) {
   return fd;
 }
 
-// TODO: we should cache DirEnt to avoid traverse the path everytime when accessing the
-// file.
-int UserProcess::allocFd(const char* path, int rwflags, bool checkall) {
+int UserProcess::allocFd(Inode* inode, int rwflags, bool checkall) {
 	FileDesc* fdptr = alloc_file_desc();
 	if (!fdptr) {
 		return -1; // out of file desc
 	}
 
-	if (fdptr->init(path, rwflags) < 0) {
-		// we should release the allocated resource if failure happens
-    if (fdptr->refcount_ > 0) {
-      fdptr->decref();
-    }
-		return -1;
-	}
+	fdptr->init(inode, rwflags);
 
   int fd = allocFd(fdptr, checkall);
   if (fd < 0) {
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <kernel/idt.h>
 #include <kernel/file_desc.h>
+#include <kernel/mmap.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -13,6 +14,8 @@ extern "C" {
 #define MAX_OPEN_FILE 64
 #define MAX_PROC_NAME 16
 
+struct ioring;
+
 class UserProcess {
  public:
   void resume();
@@ -50,12 +53,12 @@ class UserProcess {
   // The API does the following things:
   // 1. Find a free filetab_ slot
   // 2. assign an available FileDesc to it
-  // 3. setup the FileDesc using path and rwflags
+  // 3. setup the FileDesc using inode and rwflags
   // 4. return the index to the filetab_.
   //
   // If checkall is true, the API will also check slot 0/1/2 (stdin/stdout,stderr)
   // for available slots.
-  int allocFd(const char* path, int rwflags, bool checkall=false);
+  int allocFd(Inode* inode, int rwflags, bool checkall=false);
   // the refcount for the file descriptor has already been increased before calling.
   int allocFd(FileDescBase* fdptr, bool checkall=false);
 
@@ -160,6 +163,8 @@ class UserProcess {
   // does.
   FileDescBase* filetab_[MAX_OPEN_FILE] = {nullptr};
   char* cwd_ = nullptr; // current working directory
+  MmapRegion mmaps_[MAX_MMAP_REGION] = {};
+  ioring* ioring_ = nullptr; // registered by ioring_setup. Check kernel/ioring.h
   char name[MAX_PROC_NAME] = {0};
 };
 
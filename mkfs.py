@@ -7,7 +7,7 @@ The code here must match the format defined in kernel/simfs.h .
 import argparse
 from dataclasses import dataclass
 import os
-from typing import List, BinaryIO
+from typing import List, BinaryIO, Tuple
 import re
 
 BLOCK_SIZE = 4096
@@ -19,6 +19,23 @@ IND_BLOCK_IDX_1 = N_DIRECT_BLOCK
 IND_BLOCK_IDX_2 = 11
 BLOCK_ID_SIZE = 4  # each block id takes 4 bytes
 NUM_BLOCK_IDS_PER_BLOCK = BLOCK_SIZE // BLOCK_ID_SIZE
+BITS_PER_BLOCK = BLOCK_SIZE * 8
+
+# SuperBlock::flags
+SB_FLAG_BITMAP = 1
+SB_FLAG_EXTENT = 2
+SB_FLAG_DIRINDEX = 4
+SB_FLAG_JOURNAL = 8
+SB_FLAG_INLINE = 16
+
+# inline files. Check DIRENT_INLINE_SIZE in kernel/simfs.h
+DIRENT_INLINE_SIZE = (IND_BLOCK_IDX_2 + 1) * BLOCK_ID_SIZE
+DIRENT_FLAG_INLINE = 1
+
+# extent format. Check struct ExtentHeader in kernel/simfs.h
+N_INLINE_EXTENT = 5
+EXTENT_SIZE = 8
+N_EXTENT_PER_BLOCK = (BLOCK_SIZE - 8) // EXTENT_SIZE
 
 @dataclass
 class MkfsCtx:
@@ -26,6 +43,8 @@ class MkfsCtx:
     tot_block: int
     img_file_fd: BinaryIO
     entry_to_skip: str  # check --entry-to-skip
+    use_extent: bool = False  # check --extent
+    use_inline: bool = False  # check --inline
 
     def allocate_block(self, nblock: int) -> List[int]:
         prev = self.next_free_block
@@ -59,11 +78,58 @@ class MkfsCtx:
             head = blkid
         return head
 
+    def setup_bitmap(self, bitmap_start: int, bitmap_nblocks: int):
+        r"""
+        Mark all the blocks allocated so far as used. That includes the super
+        block and the bitmap itself.
+        """
+        nused = self.next_free_block
+        bitmap = bytearray(bitmap_nblocks * BLOCK_SIZE)
+        bitmap[:nused // 8] = b"\xff" * (nused // 8)
+        for blkid in range(nused // 8 * 8, nused):
+            bitmap[blkid // 8] |= 1 << (blkid % 8)
+        self.write_to_blocks(list(range(bitmap_start, bitmap_start + bitmap_nblocks)), bytes(bitmap))
+
     def should_skip_entry(self, path: str) -> bool:
         if not self.entry_to_skip:
             return False
         return bool(re.search(self.entry_to_skip, path))
 
+def blocks_to_extents(blocklist: List[int]) -> List[Tuple[int, int]]:
+    extents = []
+    for blkid in blocklist:
+        if extents and extents[-1][0] + extents[-1][1] == blkid:
+            extents[-1] = (extents[-1][0], extents[-1][1] + 1)
+        else:
+            extents.append((blkid, 1))
+    return extents
+
+def write_extent_table(ctx: MkfsCtx, blocklist: List[int]) -> List[Tuple[int, bytes]]:
+    r"""
+    Write the ExtentHeader at the current position. Return the overflow blocks
+    to be written as a list of (blkid, payload).
+    """
+    extents = blocks_to_extents(blocklist)
+    overflow = extents[N_INLINE_EXTENT:]
+    chunks = [overflow[i: i + N_EXTENT_PER_BLOCK] for i in range(0, len(overflow), N_EXTENT_PER_BLOCK)]
+    overflow_blocks = ctx.allocate_block(len(chunks)) if chunks else []
+
+    ctx.writeint(len(extents))
+    ctx.writeint(overflow_blocks[0] if overflow_blocks else 0)
+    for i in range(N_INLINE_EXTENT):
+        start, length = extents[i] if i < len(extents) else (0, 0)
+        ctx.writeint(start)
+        ctx.writeint(length)
+
+    extra_blocks_to_set = []
+    for i, chunk in enumerate(chunks):
+        nextblk = overflow_blocks[i + 1] if i + 1 < len(overflow_blocks) else 0
+        payload = len(chunk).to_bytes(4, "little") + nextblk.to_bytes(4, "little")
+        for start, length in chunk:
+            payload += start.to_bytes(4, "little") + length.to_bytes(4, "little")
+        extra_blocks_to_set.append((overflow_blocks[i], payload))
+    return extra_blocks_to_set
+
 def write_dirent(ctx: MkfsCtx, dirent_loc: int, name: str, size: int, blocklist: List[int], isdir: bool):
     ctx.seek(dirent_loc)
     bin_name = name.encode("utf-8")
@@ -71,6 +137,13 @@ def write_dirent(ctx: MkfsCtx, dirent_loc: int, name: str, size: int, blocklist:
     bin_name = bin_name + b"\0" * (MAX_FILE_NAME - len(bin_name))
     ctx.img_file_fd.write(bin_name)
     ctx.writeint(size)
+
+    if ctx.use_extent:
+        extra_blocks = write_extent_table(ctx, blocklist)
+        ctx.writeint(isdir, 1)
+        for blkid, payload in extra_blocks:
+            ctx.write_to_blocks([blkid], payload)
+        return
   
     extra_blocks_to_set = []
     if len(blocklist) <= N_DIRECT_BLOCK:
@@ -80,8 +153,19 @@ def write_dirent(ctx: MkfsCtx, dirent_loc: int, name: str, size: int, blocklist:
         blocktbl = blocklist[:N_DIRECT_BLOCK] + [indirect_blk_id, 0]
         extra_blocks_to_set.append((indirect_blk_id, blocklist[N_DIRECT_BLOCK:]))
     else:
-        # TODO: handle large file that needs level-2 indirect blocks
-        assert False, "Can not support large file that needs level-2 indirect blocks yet"
+        ind2_blocklist = blocklist[N_DIRECT_BLOCK + NUM_BLOCK_IDS_PER_BLOCK:]
+        assert len(ind2_blocklist) <= NUM_BLOCK_IDS_PER_BLOCK * NUM_BLOCK_IDS_PER_BLOCK, "File too large"
+        indirect_blk_id = ctx.allocate_block(1)[0]
+        extra_blocks_to_set.append((indirect_blk_id, blocklist[N_DIRECT_BLOCK:N_DIRECT_BLOCK + NUM_BLOCK_IDS_PER_BLOCK]))
+
+        # the level-2 indirect block points to blocks of block ids
+        nl2 = (len(ind2_blocklist) + NUM_BLOCK_IDS_PER_BLOCK - 1) // NUM_BLOCK_IDS_PER_BLOCK
+        ind2_blk_id = ctx.allocate_block(1)[0]
+        l2_blk_ids = ctx.allocate_block(nl2)
+        extra_blocks_to_set.append((ind2_blk_id, l2_blk_ids))
+        for i, l2_blk_id in enumerate(l2_blk_ids):
+            extra_blocks_to_set.append((l2_blk_id, ind2_blocklist[i * NUM_BLOCK_IDS_PER_BLOCK:(i + 1) * NUM_BLOCK_IDS_PER_BLOCK]))
+        blocktbl = blocklist[:N_DIRECT_BLOCK] + [indirect_blk_id, ind2_blk_id]
 
     for bid in blocktbl:
         ctx.writeint(bid)
@@ -97,6 +181,22 @@ def write_dirent(ctx: MkfsCtx, dirent_loc: int, name: str, size: int, blocklist:
             val = payload[i] if i < len(payload) else 0
             ctx.writeint(val, 4)
 
+def write_inline_dirent(ctx: MkfsCtx, dirent_loc: int, name: str, content: bytes):
+    r"""
+    Write the DirEnt of a small file with the content stored in place of the
+    block table.
+    """
+    assert 0 < len(content) <= DIRENT_INLINE_SIZE
+    ctx.seek(dirent_loc)
+    bin_name = name.encode("utf-8")
+    assert len(bin_name) < MAX_FILE_NAME
+    ctx.img_file_fd.write(bin_name + b"\0" * (MAX_FILE_NAME - len(bin_name)))
+    ctx.writeint(len(content))
+    ctx.img_file_fd.write(content + b"\0" * (DIRENT_INLINE_SIZE - len(content)))
+    ctx.writeint(False, 1)  # ent_type
+    ctx.writeint(0)  # index_blk
+    ctx.writeint(DIRENT_FLAG_INLINE, 1)
+
 def handle_file(ctx: MkfsCtx, dirent_loc: int, curname: str, curpath: str):
     r"""
     Check the docstring for dfs
@@ -105,6 +205,11 @@ def handle_file(ctx: MkfsCtx, dirent_loc: int, curname: str, curpath: str):
     print(f"Handle file {curpath}")
     filesize = os.path.getsize(curpath)
 
+    if ctx.use_inline and 0 < filesize <= DIRENT_INLINE_SIZE:
+        with open(curpath, "rb") as f:
+            write_inline_dirent(ctx, dirent_loc, curname, f.read())
+        return
+
     nalloc = (filesize + BLOCK_SIZE - 1) // BLOCK_SIZE  
     blocks = ctx.allocate_block(nalloc)
     write_dirent(ctx, dirent_loc, curname, filesize, blocks, False)
@@ -153,8 +258,34 @@ def mkfs(args: argparse.Namespace):
             tot_block=args.nblocks,
             img_file_fd=img_file_fd,
             entry_to_skip=args.entry_to_skip,
+            use_extent=args.extent,
+            use_inline=args.inline,
         )
 
+        flags = 0
+        if args.extent:
+            flags |= SB_FLAG_EXTENT
+        if args.inline:
+            flags |= SB_FLAG_INLINE
+        if args.dirindex:
+            # directories are indexed by the kernel once they grow large
+            flags |= SB_FLAG_DIRINDEX
+        bitmap_start = 0
+        bitmap_nblocks = 0
+        if args.bitmap:
+            # the bitmap follows the super block
+            flags |= SB_FLAG_BITMAP
+            bitmap_nblocks = (args.nblocks + BITS_PER_BLOCK - 1) // BITS_PER_BLOCK
+            bitmap_start = ctx.allocate_block(bitmap_nblocks)[0]
+        journal_start = 0
+        if args.journal > 0:
+            # the journal follows the bitmap. The blocks are all zero so
+            # there is nothing to replay.
+            assert args.bitmap, "--journal requires --bitmap"
+            assert args.journal >= 2, "the journal needs a header block and at least one log block"
+            flags |= SB_FLAG_JOURNAL
+            journal_start = ctx.allocate_block(args.journal)[0]
+
         # preallocate the file size
         ctx.seek(args.nblocks * BLOCK_SIZE - 1)
         ctx.writeint(0, length=1)
@@ -163,12 +294,21 @@ def mkfs(args: argparse.Namespace):
         assert os.path.isdir(args.rootdir)
         dfs(ctx, 0, "", args.rootdir)
 
-        # setup freelist and superblock. The dirent for rootdir has already been
-        # set by dfs(...)
-        freelist = ctx.setup_freelist()
+        # setup freelist (or bitmap) and superblock. The dirent for rootdir has
+        # already been set by dfs(...)
+        freelist = 0
+        if args.bitmap:
+            ctx.setup_bitmap(bitmap_start, bitmap_nblocks)
+        else:
+            freelist = ctx.setup_freelist()
         ctx.seek(DIRENT_SIZE)
         ctx.writeint(freelist, 4)
         ctx.writeint(args.nblocks, 4)
+        ctx.writeint(flags, 4)
+        ctx.writeint(bitmap_start, 4)
+        ctx.writeint(bitmap_nblocks, 4)
+        ctx.writeint(journal_start, 4)
+        ctx.writeint(args.journal, 4)
 
 def main():
     parser = argparse.ArgumentParser(
@@ -179,6 +319,11 @@ def main():
     # by default create 16M size of image, which translate to 4096 blocks
     parser.add_argument("--nblocks", type=int, default=4096, help="The number of blocks the filesystem will have. Block size 4096.")
     parser.add_argument("--entry-to-skip", type=str, default="", help="A regular expression. Skip directory entries containing this pattern")
+    parser.add_argument("--bitmap", action="store_true", help="Track free blocks with a bitmap rather than a free list.")
+    parser.add_argument("--extent", action="store_true", help="Use the v2 format which maps files with extents. Works best together with --bitmap.")
+    parser.add_argument("--dirindex", action="store_true", help="Let the kernel index large directories by name hash.")
+    parser.add_argument("--inline", action="store_true", help="Store files of at most 48 bytes inside their directory entry.")
+    parser.add_argument("--journal", type=int, default=0, help="The number of blocks for the metadata journal. 0 to disable it. Requires --bitmap.")
     parser.add_argument("--skip-prompt", action="store_true", help="Whether to skip prompt. Make it hard to erase the existing image by mistake.")
     args = parser.parse_args()
 
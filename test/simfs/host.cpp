@@ -0,0 +1,47 @@
+/*
+ * The kernel services SimFs relies on, implemented on the host OS.
+ */
+#include <kernel/simfs.h>
+#include <kernel/phys_page.h>
+#include <kernel/idt.h>
+#include <unistd.h>
+
+HostBlockDevice host_dev;
+
+void HostBlockDevice::read(uint8_t* buf, int startSectorNo, int nSector) {
+  ssize_t len = (ssize_t) nSector * SECTOR_SIZE;
+  ssize_t got = pread(fd_, buf, len, (off_t) startSectorNo * SECTOR_SIZE);
+  assert(got == len && "short read from the image");
+  ++stats_.read_cmds;
+  stats_.read_sectors += nSector;
+}
+
+void HostBlockDevice::write(const uint8_t* buf, int startSectorNo, int nSector) {
+  if (before_write_) {
+    before_write_(buf, startSectorNo, nSector);
+  }
+  ssize_t len = (ssize_t) nSector * SECTOR_SIZE;
+  ssize_t put = pwrite(fd_, buf, len, (off_t) startSectorNo * SECTOR_SIZE);
+  assert(put == len && "short write to the image");
+  ++stats_.write_cmds;
+  stats_.write_sectors += nSector;
+}
+
+// Time does not pass for the buffer cache so the periodic flush never kicks
+// in and the block I/O counts only depend on the workload.
+int64_t getTick() {
+  return 0;
+}
+
+phys_addr_t alloc_phys_page() {
+  void* page = aligned_alloc(4096, 4096);
+  assert(page);
+  return (phys_addr_t) page;
+}
+
+void free_phys_page(phys_addr_t phys_addr) {
+  free((void*) phys_addr);
+}
+
+// only used by mmap which is not exercised on the host
+PhysPageStat* phys_page_stats = nullptr;
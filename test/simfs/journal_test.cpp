@@ -0,0 +1,214 @@
+/*
+ * Pull the plug in the middle of a journal commit and check that
+ * SimFs::init recovers the metadata to either before or after the group.
+ *
+ * Usage: journal_test <fs image>
+ *
+ * The image must have a journal. Each case runs the workload in a child
+ * process on a copy of the image and stops it at one point of the commit:
+ * - before the header is written: nothing to replay, the group is lost
+ * - after the header is written but before the checkpoint: the group is
+ *   replayed
+ * - after the header is written, with a logged block torn: the checksum does
+ *   not match and the group is discarded
+ * Another child then mounts the copy, which runs the replay, and checks that
+ * the entries created and removed by the group are all there or all gone.
+ */
+#include <kernel/simfs.h>
+#include <kernel/inode.h>
+#include <kernel/journal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define NOLD 10 // files committed before the crash
+#define NREMOVE 5 // of which the group removes this many
+#define NNEW 20 // files created by the group
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  } \
+} while (0)
+
+enum CrashPoint {
+  BEFORE_HEADER,
+  AFTER_HEADER,
+  TORN_LOG,
+};
+
+static const char* crash_point_names[] = {"before header", "after header", "torn log"};
+
+static CrashPoint crash_point;
+static bool armed; // the workload has started the group
+static bool header_written;
+
+static void copy_file(const char* from, const char* to) {
+  int in = open(from, O_RDONLY);
+  CHECK(in >= 0);
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK(out >= 0);
+  static uint8_t buf[1 << 16];
+  ssize_t n;
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    CHECK(write(out, buf, n) == n);
+  }
+  close(in);
+  close(out);
+}
+
+// a header with blocks to replay. The layout follows JournalHeader.
+static bool is_commit_header(const uint8_t* buf) {
+  const uint32_t* words = (const uint32_t*) buf;
+  return words[0] == JOURNAL_MAGIC && words[2] > 0;
+}
+
+static void crash_hook(const uint8_t* buf, int startSectorNo, int nSector) {
+  if (!armed) {
+    return;
+  }
+  if (header_written || (crash_point == BEFORE_HEADER && is_commit_header(buf))) {
+    // the power goes out before this write reaches the device
+    _exit(0);
+  }
+  if (is_commit_header(buf)) {
+    // stop at the next write, the first block of the checkpoint
+    header_written = true;
+  }
+}
+
+static void name_of(char* path, const char* dir, int i) {
+  sprintf(path, "%s/f%d", dir, i);
+}
+
+static void create_files(const char* dir, int n) {
+  CHECK(SimFs::get().mkdir(dir) >= 0);
+  char path[64];
+  for (int i = 0; i < n; ++i) {
+    name_of(path, dir, i);
+    Inode* ino = SimFs::get().createFile(path);
+    CHECK(ino);
+    ino->decref();
+  }
+}
+
+static bool exists(const char* path) {
+  Inode* ino = SimFs::get().lookupInode(path);
+  if (ino) {
+    ino->decref();
+  }
+  return ino;
+}
+
+// SimFs keeps a copy of host_dev, so set the hook before the init
+static void mount(const char* img, bool hook) {
+  int fd = open(img, O_RDWR);
+  CHECK(fd >= 0);
+  host_dev = HostBlockDevice(fd);
+  if (hook) {
+    host_dev.before_write_ = crash_hook;
+  }
+  SimFs::get().init();
+}
+
+// run in a child process. Does not return.
+static void run_workload(const char* img) {
+  mount(img, true);
+  create_files("/old", NOLD);
+  SimFs::get().sync();
+
+  // a single group: create a directory with files and remove some old ones
+  armed = true;
+  create_files("/new", NNEW);
+  char path[64];
+  for (int i = 0; i < NREMOVE; ++i) {
+    name_of(path, "/old", i);
+    CHECK(SimFs::get().unlink(path) == 0);
+  }
+  SimFs::get().sync();
+  fprintf(stderr, "the commit did not reach the crash point\n");
+  exit(1);
+}
+
+// flip a byte of the first logged block after the committed header
+static void tear_log(const char* img) {
+  int fd = open(img, O_RDWR);
+  CHECK(fd >= 0);
+  uint8_t buf[BLOCK_SIZE];
+  off_t off = 0;
+  while (pread(fd, buf, BLOCK_SIZE, off) == BLOCK_SIZE && !is_commit_header(buf)) {
+    off += BLOCK_SIZE;
+  }
+  CHECK(is_commit_header(buf));
+  CHECK(pread(fd, buf, BLOCK_SIZE, off + BLOCK_SIZE) == BLOCK_SIZE);
+  buf[100] ^= 0xFF;
+  CHECK(pwrite(fd, buf, BLOCK_SIZE, off + BLOCK_SIZE) == BLOCK_SIZE);
+  close(fd);
+}
+
+// run in a child process
+static void check_recovery(const char* img, bool committed) {
+  mount(img, false);
+  char path[64];
+  CHECK(exists("/new") == committed);
+  for (int i = 0; committed && i < NNEW; ++i) {
+    name_of(path, "/new", i);
+    CHECK(exists(path));
+  }
+  for (int i = 0; i < NOLD; ++i) {
+    name_of(path, "/old", i);
+    bool removed = committed && i < NREMOVE;
+    CHECK(exists(path) == !removed);
+  }
+  // the recovered metadata is usable
+  create_files("/after", 3);
+  for (int i = 0; i < NOLD; ++i) {
+    name_of(path, "/old", i);
+    if (exists(path)) {
+      CHECK(SimFs::get().unlink(path) == 0);
+    }
+  }
+  SimFs::get().sync();
+  exit(0);
+}
+
+// run f in a child process and return whether it succeeded
+static bool in_child(void (*f)(const char*, bool), const char* img, bool arg) {
+  fflush(stdout);
+  pid_t pid = fork();
+  CHECK(pid >= 0);
+  if (pid == 0) {
+    f(img, arg);
+  }
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void workload_child(const char* img, bool) {
+  run_workload(img);
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <fs image>\n", argv[0]);
+    return 1;
+  }
+  char img[256];
+  snprintf(img, sizeof(img), "%s.crash", argv[1]);
+  int nfail = 0;
+  for (int cp = BEFORE_HEADER; cp <= TORN_LOG; ++cp) {
+    crash_point = (CrashPoint) cp;
+    copy_file(argv[1], img);
+    bool ok = in_child(workload_child, img, false);
+    if (ok && cp == TORN_LOG) {
+      tear_log(img);
+    }
+    ok = ok && in_child(check_recovery, img, cp == AFTER_HEADER);
+    printf("crash %s: %s\n", crash_point_names[cp], ok ? "PASS" : "FAIL");
+    nfail += !ok;
+  }
+  unlink(img);
+  return nfail ? 1 : 0;
+}
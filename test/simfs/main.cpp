@@ -0,0 +1,342 @@
+/*
+ * Run reproducible workloads against SimFs on a file image and report the
+ * latency of each operation and the block I/O the workload causes.
+ *
+ * Usage: a.out <fs image> [workload ...]
+ *
+ * All the workloads are run in order if none is specified. Later workloads use
+ * the files created by earlier ones. Each workload ends with SimFs::sync so the
+ * I/O counts include the writes it leaves in the buffer cache.
+ */
+#include <kernel/simfs.h>
+#include <kernel/file_desc.h>
+#include <kernel/inode.h>
+#include <kernel/dcache.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define NSMALL 2000 // files created by the create workload
+#define SMALL_MAX_SIZE 4000
+#define NTINY 2000 // config sized files created by the tiny workload
+#define TINY_MAX_SIZE 100
+#define DEPTH 16 // levels of directories for the lookup workload
+#define NLOOKUP 10000
+#define BIG_PATH "/big"
+#define BIG_SIZE (32 << 20)
+#define BIG_CHUNK (64 << 10)
+#define NRANDREAD 2000
+#define LOG_PATH "/log"
+#define NLOGLINE 20000
+#define RANDREAD_SIZE 4096
+
+#define MAX_OPS 20000
+
+static uint64_t lat_ns[MAX_OPS];
+static int nops;
+static uint8_t iobuf[BIG_CHUNK] __attribute__((aligned(4096)));
+
+// xorshift32. The workloads use a fixed seed to be reproducible.
+static uint32_t rand_state;
+
+static uint32_t next_rand() {
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return rand_state;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the content of the byte at off of the big file
+static uint8_t big_byte(int off) {
+  return (uint8_t) (off * 7 + (off >> 12));
+}
+
+static void small_path(char* path, int i) {
+  sprintf(path, "/small/f%d", i);
+}
+
+// like file_open but without a process
+static FileDesc* open_file(const char* path, int flags) {
+  Inode* ino = SimFs::get().lookupInode(path);
+  if (!ino && (flags & FD_FLAG_WR)) {
+    ino = SimFs::get().createFile(path);
+  }
+  if (!ino) {
+    return nullptr;
+  }
+  if ((flags & FD_FLAG_TRUNC) && ino->dirent_.file_size > 0) {
+    JournalTx tx;
+    ino->dirent_.truncate();
+    ino->flush();
+    PageCache::get().truncate(ino, 0);
+  }
+  FileDesc* fd = alloc_file_desc();
+  fd->init(ino, flags & FD_FLAG_RW);
+  ino->decref();
+  return fd;
+}
+
+// unlike assert, still checks when built with -DNDEBUG
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    abort(); \
+  } \
+} while (0)
+
+// time stmt. It stores the results in locals; check them after TIME_OP so
+// the checks are not timed.
+#define TIME_OP(stmt) do { \
+  CHECK(nops < MAX_OPS); \
+  uint64_t _start = now_ns(); \
+  stmt; \
+  lat_ns[nops++] = now_ns() - _start; \
+} while (0)
+
+// open path, write size bytes of iobuf to it and close it. Return the number
+// of bytes written or -1 if the file can not be opened.
+static int write_file(const char* path, int size) {
+  FileDesc* fd = open_file(path, FD_FLAG_WR);
+  if (!fd) {
+    return -1;
+  }
+  int ret = fd->write(iobuf, size);
+  fd->decref();
+  return ret;
+}
+
+static void wl_create() {
+  CHECK(SimFs::get().mkdir("/small") >= 0);
+  char path[64];
+  for (int i = 0; i < NSMALL; ++i) {
+    small_path(path, i);
+    int size = 64 + next_rand() % (SMALL_MAX_SIZE - 64);
+    memset(iobuf, 'a' + i % 26, size);
+    int written;
+    TIME_OP(written = write_file(path, size));
+    CHECK(written == size);
+  }
+}
+
+// small enough to be stored inline on SB_FLAG_INLINE images for the most part
+static void wl_tiny() {
+  CHECK(SimFs::get().mkdir("/tiny") >= 0);
+  char path[64];
+  for (int i = 0; i < NTINY; ++i) {
+    sprintf(path, "/tiny/f%d", i);
+    int size = 1 + next_rand() % TINY_MAX_SIZE;
+    memset(iobuf, 'a' + i % 26, size);
+    int written;
+    TIME_OP(written = write_file(path, size));
+    CHECK(written == size);
+  }
+  for (int i = 0; i < NTINY; ++i) {
+    sprintf(path, "/tiny/f%d", i);
+    int nread = -1;
+    TIME_OP({
+      FileDesc* fd = open_file(path, FD_FLAG_RD);
+      if (fd) {
+        nread = fd->read(iobuf, TINY_MAX_SIZE);
+        fd->decref();
+      }
+    });
+    CHECK(nread > 0);
+    CHECK(iobuf[0] == 'a' + i % 26);
+  }
+}
+
+static void deep_dir(char* path, int depth) {
+  int len = 0;
+  for (int i = 0; i < depth; ++i) {
+    len += sprintf(path + len, "/dir%d", i);
+  }
+  path[len] = '\0';
+}
+
+static void wl_lookup() {
+  char path[256];
+  // build the tree with one file at each level. Not timed.
+  for (int d = 1; d <= DEPTH; ++d) {
+    deep_dir(path, d);
+    CHECK(SimFs::get().mkdir(path) >= 0);
+    strcat(path, "/file");
+    CHECK(write_file(path, 0) == 0);
+  }
+  for (int i = 0; i < NLOOKUP; ++i) {
+    deep_dir(path, 1 + next_rand() % DEPTH);
+    strcat(path, "/file");
+    Inode* ino;
+    TIME_OP(ino = SimFs::get().lookupInode(path));
+    CHECK(ino);
+    ino->decref();
+  }
+}
+
+static void wl_seqwrite() {
+  FileDesc* fd = open_file(BIG_PATH, FD_FLAG_WR | FD_FLAG_TRUNC);
+  CHECK(fd);
+  for (int off = 0; off < BIG_SIZE; off += BIG_CHUNK) {
+    for (int i = 0; i < BIG_CHUNK; ++i) {
+      iobuf[i] = big_byte(off + i);
+    }
+    int written;
+    TIME_OP(written = fd->write(iobuf, BIG_CHUNK));
+    CHECK(written == BIG_CHUNK);
+  }
+  fd->decref();
+}
+
+static void wl_seqread() {
+  FileDesc* fd = open_file(BIG_PATH, FD_FLAG_RD);
+  CHECK(fd);
+  for (int off = 0; off < BIG_SIZE; off += BIG_CHUNK) {
+    int nread;
+    TIME_OP(nread = fd->read(iobuf, BIG_CHUNK));
+    CHECK(nread == BIG_CHUNK);
+    CHECK(iobuf[BIG_CHUNK - 1] == big_byte(off + BIG_CHUNK - 1));
+  }
+  fd->decref();
+}
+
+static void wl_randread() {
+  FileDesc* fd = open_file(BIG_PATH, FD_FLAG_RD);
+  CHECK(fd);
+  for (int i = 0; i < NRANDREAD; ++i) {
+    int off = next_rand() % (BIG_SIZE - RANDREAD_SIZE);
+    int nread;
+    TIME_OP({
+      fd->off_ = off;
+      nread = fd->read(iobuf, RANDREAD_SIZE);
+    });
+    CHECK(nread == RANDREAD_SIZE);
+    CHECK(iobuf[0] == big_byte(off));
+  }
+  fd->decref();
+}
+
+// a log line per write like a printf-heavy program
+static void wl_append() {
+  FileDesc* fd = open_file(LOG_PATH, FD_FLAG_WR | FD_FLAG_TRUNC);
+  CHECK(fd);
+  char line[128];
+  int size = 0;
+  for (int i = 0; i < NLOGLINE; ++i) {
+    int len = sprintf(line, "line %d: value %u\n", i, next_rand() % 100000);
+    int written;
+    TIME_OP(written = fd->write(line, len));
+    CHECK(written == len);
+    size += len;
+  }
+  fd->decref();
+  CHECK(SimFs::get().walkPath(LOG_PATH).file_size == size);
+}
+
+static void wl_unlink() {
+  static int order[NSMALL];
+  for (int i = 0; i < NSMALL; ++i) {
+    order[i] = i;
+  }
+  // unlink in random order
+  for (int i = NSMALL - 1; i > 0; --i) {
+    int j = next_rand() % (i + 1);
+    int tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  char path[64];
+  for (int i = 0; i < NSMALL; ++i) {
+    small_path(path, order[i]);
+    int ret;
+    TIME_OP(ret = SimFs::get().unlink(path));
+    CHECK(ret == 0);
+  }
+}
+
+struct Workload {
+  const char* name;
+  void (*run)();
+};
+
+static Workload workloads[] = {
+  {"create", wl_create},
+  {"tiny", wl_tiny},
+  {"lookup", wl_lookup},
+  {"seqwrite", wl_seqwrite},
+  {"seqread", wl_seqread},
+  {"randread", wl_randread},
+  {"append", wl_append},
+  {"unlink", wl_unlink},
+};
+
+#define NWORKLOAD (sizeof(workloads) / sizeof(workloads[0]))
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+static void run_workload(const Workload& wl) {
+  HostBlockDeviceStats before = SimFs::get().dev().stats();
+  nops = 0;
+  rand_state = 2463534242U;
+  uint64_t start = now_ns();
+  wl.run();
+  uint64_t sync_start = now_ns();
+  SimFs::get().sync();
+  uint64_t end = now_ns();
+  HostBlockDeviceStats after = SimFs::get().dev().stats();
+
+  qsort(lat_ns, nops, sizeof(lat_ns[0]), cmp_u64);
+  uint64_t sum = 0;
+  for (int i = 0; i < nops; ++i) {
+    sum += lat_ns[i];
+  }
+  printf("%-9s %6d %9.1f %8.1f %8.1f %8.1f %9.1f %8.1f %8u %8u %8u %8u\n",
+    wl.name, nops, (end - start) / 1e6,
+    sum / 1e3 / nops, lat_ns[nops / 2] / 1e3, lat_ns[nops * 99 / 100] / 1e3,
+    lat_ns[nops - 1] / 1e3, (end - sync_start) / 1e6,
+    after.read_cmds - before.read_cmds,
+    (after.read_sectors - before.read_sectors) * SECTOR_SIZE / 1024,
+    after.write_cmds - before.write_cmds,
+    (after.write_sectors - before.write_sectors) * SECTOR_SIZE / 1024);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <fs image> [workload ...]\n", argv[0]);
+    return 1;
+  }
+  int fd = open(argv[1], O_RDWR);
+  if (fd < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  host_dev = HostBlockDevice(fd);
+  SimFs::get().init();
+
+  printf("%-9s %6s %9s %8s %8s %8s %9s %8s %8s %8s %8s %8s\n",
+    "workload", "ops", "total(ms)", "avg(us)", "p50(us)", "p99(us)", "max(us)",
+    "sync(ms)", "rd cmds", "rd KB", "wr cmds", "wr KB");
+  for (int i = 0; i < NWORKLOAD; ++i) {
+    bool selected = argc == 2;
+    for (int j = 2; j < argc; ++j) {
+      selected |= strcmp(argv[j], workloads[i].name) == 0;
+    }
+    if (selected) {
+      run_workload(workloads[i]);
+    }
+  }
+  printf("\n");
+  SimFs::get().bufCache().stats().print();
+  DentryCache::get().stats().print();
+  SimFs::get().journal().stats().print();
+  close(fd);
+  return 0;
+}
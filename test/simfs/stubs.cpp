@@ -0,0 +1,24 @@
+/*
+ * There is no console or pipe on the host. Kept apart from host.cpp since
+ * kernel/pipe.h conflicts with unistd.h.
+ */
+#include <kernel/keyboard.h>
+#include <kernel/pipe.h>
+
+char keyboardGetChar(bool blocking) {
+  return 0;
+}
+
+void keyboardPutback(char ch) {
+}
+
+int PipeFileDesc::read(void* buf, int nbyte) {
+  return -1;
+}
+
+int PipeFileDesc::write(const void* buf, int nbyte) {
+  return -1;
+}
+
+void PipeFileDesc::freeme() {
+}
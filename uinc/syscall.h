@@ -9,14 +9,45 @@ int pipe(int fds[2]);
 int getpid();
 int open(const char*path, int oflags);
 int read(int fd, void *buf, int nbyte);
+// whence is one of SEEK_* in stdio.h. Seeking past the end and writing there
+// leaves a hole that reads as zeros and takes no disk block. Return the new
+// offset or -1 on error.
+int lseek(int fd, int off, int whence);
 int close(int fd);
+// write the data of the file to the disk. Return 0 on success or -1 if fd is
+// not a file.
+int fsync(int fd);
+// write all the modified data to the disk. Dirty data is also flushed
+// periodically by the kernel.
+int sync();
 int waitpid(int pid, int *pstatus, int /* options */);
 
 struct dirent;
-int readdir(const char*path, struct dirent* entlist, int capa);
+// fill up to capa entries starting from entry off. Return the number of
+// entries filled, which is 0 after the last entry, or -1 on error.
+int readdir(const char*path, struct dirent* entlist, int capa, int off);
 int mkdir(const char* path);
 char* getcwd(char* path, int len);
 int chdir(const char* path);
 int unlink(const char* path);
 // remove an empty directory
 int rmdir(const char* path);
+// addr is ignored; the kernel picks the address. Return MAP_FAILED on error.
+// Check mman.h for prot and flags.
+void* mmap(void* addr, int len, int prot, int flags, int fd, int off);
+int munmap(void* addr, int len);
+
+// Check ioring.h for the ring layout. The ring must be empty when it's set up.
+struct ioring;
+int ioring_setup(struct ioring* ring);
+// run up to to_submit queued entries. Return how many are consumed.
+int ioring_enter(int to_submit);
+
+// Move data between file descriptors without copying it to user space. Return
+// the number of bytes moved, 0 at the end of the input, EAGAIN (check
+// errno.h) if the pipe is full or empty, or -1 on error.
+// in_fd must be a file. Read from off and keep the offset of in_fd unless off
+// is -1.
+int sendfile(int out_fd, int in_fd, int off, int count);
+// exactly one of in_fd and out_fd must be a pipe
+int splice(int in_fd, int out_fd, int count);
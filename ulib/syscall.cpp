@@ -91,8 +91,8 @@ int waitpid(int pid, int *pstatus, int /* options */) {
   return syscall(SC_WAITPID, pid, (int) pstatus, PHARG, PHARG, PHARG);
 }
 
-int readdir(const char*path, struct dirent* entlist, int capa) {
-  return syscall(SC_READDIR, (int) path, (int) entlist, capa, PHARG, PHARG);
+int readdir(const char*path, struct dirent* entlist, int capa, int off) {
+  return syscall(SC_READDIR, (int) path, (int) entlist, capa, off, PHARG);
 }
 
 int mkdir(const char* path) {
@@ -119,3 +119,40 @@ int unlink(const char* path) {
 int rmdir(const char* path) {
   return syscall(SC_RMDIR, (int) (path), PHARG, PHARG, PHARG, PHARG);
 }
+
+void* mmap(void* /* addr */, int len, int prot, int flags, int fd, int off) {
+  // the kernel picks the address
+  return (void*) syscall(SC_MMAP, len, prot, flags, fd, off);
+}
+
+int munmap(void* addr, int len) {
+  return syscall(SC_MUNMAP, (int) addr, len, PHARG, PHARG, PHARG);
+}
+
+int ioring_setup(struct ioring* ring) {
+  return syscall(SC_IORING_SETUP, (int) ring, PHARG, PHARG, PHARG, PHARG);
+}
+
+int ioring_enter(int to_submit) {
+  return syscall(SC_IORING_ENTER, to_submit, PHARG, PHARG, PHARG, PHARG);
+}
+
+int sendfile(int out_fd, int in_fd, int off, int count) {
+  return syscall(SC_SENDFILE, out_fd, in_fd, off, count, PHARG);
+}
+
+int splice(int in_fd, int out_fd, int count) {
+  return syscall(SC_SPLICE, in_fd, out_fd, count, PHARG, PHARG);
+}
+
+int lseek(int fd, int off, int whence) {
+  return syscall(SC_LSEEK, fd, off, whence, PHARG, PHARG);
+}
+
+int fsync(int fd) {
+  return syscall(SC_FSYNC, fd, PHARG, PHARG, PHARG, PHARG);
+}
+
+int sync() {
+  return syscall(SC_SYNC, PHARG, PHARG, PHARG, PHARG, PHARG);
+}
@@ -2,7 +2,7 @@
 #include <syscall.h>
 #include <dirent.h>
 
-struct dirent entlist[1024];
+struct dirent entlist[64];
 
 int main(int argc, char **argv) {
   printf("Enter ls\n");
@@ -17,18 +17,22 @@ int main(int argc, char **argv) {
     path = argv[1];
   }
 
-  int r = readdir(path, entlist, sizeof(entlist) / sizeof(entlist[0]));
+  // read the entries a batch at a time
+  int off = 0;
+  int r;
+  while ((r = readdir(path, entlist, sizeof(entlist) / sizeof(entlist[0]), off)) > 0) {
+    for (int i = 0; i < r; ++i) {
+      struct dirent* curEnt = &entlist[i];
+      printf("  %s - type %s - %d bytes\n", curEnt->name, dirent_typestr(curEnt->ent_type), curEnt->file_size);
+    }
+    off += r;
+  }
   if (r < 0) {
     printf("Fail to readdir for '%s'\n", path);
     return -1;
   }
-  if (r == 0) {
+  if (off == 0) {
     printf("Empty dir\n");
-    return 0;
-  }
-  for (int i = 0; i < r; ++i) {
-    struct dirent* curEnt = &entlist[i];
-    printf("  %s - type %s - %d bytes\n", curEnt->name, dirent_typestr(curEnt->ent_type), curEnt->file_size);
   }
 
   return 0;
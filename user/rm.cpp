@@ -13,12 +13,7 @@ int rmdirRecursively(const char* path) {
 
   // TODO take care of stack overflow for the recursive calls.
 
-  struct dirent entlist[32]; // TODO does not work if a directory contains more than 32 entries.
-  int cnt = readdir(path, entlist, sizeof(entlist) / sizeof(*entlist));
-  if (cnt < 0) {
-    return cnt;
-  }
-
+  struct dirent entlist[32];
   char fullpath[256]; // TODO use malloc to handle longer path
 
   int pathlen = strlen(path);
@@ -26,26 +21,34 @@ int rmdirRecursively(const char* path) {
   strcpy(fullpath, path);
   fullpath[pathlen++] = '/';
   int r;
-  for (int i = 0; i < cnt; ++i) {
-    struct dirent* ent = &entlist[i];
-    int entlen = strlen(ent->name);
-    assert(pathlen + entlen < sizeof(fullpath) / sizeof(*fullpath));
-    strcpy(fullpath + pathlen, ent->name);
+  int cnt;
+  // all the entries read are removed and the removal moves the remaining
+  // entries around, so always read from the first entry.
+  while ((cnt = readdir(path, entlist, sizeof(entlist) / sizeof(*entlist), 0)) > 0) {
+    for (int i = 0; i < cnt; ++i) {
+      struct dirent* ent = &entlist[i];
+      int entlen = strlen(ent->name);
+      assert(pathlen + entlen < sizeof(fullpath) / sizeof(*fullpath));
+      strcpy(fullpath + pathlen, ent->name);
 
-    if (ent->ent_type == ET_DIR) {
-      r = rmdirRecursively(fullpath);
-      if (r < 0) {
-        return r;
+      if (ent->ent_type == ET_DIR) {
+        r = rmdirRecursively(fullpath);
+        if (r < 0) {
+          return r;
+        }
+      } else if (ent->ent_type == ET_FILE) {
+        r = unlink(fullpath);
+        if (r < 0) {
+          return r;
+        }
+      } else {
+        assert(false && "invalid ent type");
       }
-    } else if (ent->ent_type == ET_FILE) {
-      r = unlink(fullpath);
-      if (r < 0) {
-        return r;
-      }
-    } else {
-      assert(false && "invalid ent type");
     }
   }
+  if (cnt < 0) {
+    return cnt;
+  }
 
   // remove the empty directory here
   return rmdir(path);
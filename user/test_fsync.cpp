@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <syscall.h>
+
+int main(void) {
+  int fd = open("/fsyncfile", O_RDWR | O_TRUNC);
+  assert(fd >= 0);
+  // small appends stay in the write-behind buffer until fsync
+  const char* line = "a log line\n";
+  int len = strlen(line);
+  for (int i = 0; i < 10; ++i) {
+    assert(write(fd, line, len) == len);
+  }
+  assert(fsync(fd) == 0);
+  assert(lseek(fd, 0, SEEK_END) == len * 10);
+
+  assert(write(fd, line, len) == len);
+  assert(sync() == 0);
+  char buf[64];
+  assert(lseek(fd, len * 10, SEEK_SET) == len * 10);
+  assert(read(fd, buf, sizeof(buf)) == len);
+  assert(memcmp(buf, line, len) == 0);
+  close(fd);
+
+  // nothing to sync for a pipe
+  int fds[2];
+  assert(pipe(fds) == 0);
+  assert(fsync(fds[0]) == -1);
+  close(fds[0]);
+  close(fds[1]);
+  assert(fsync(fd) == -1);
+  printf("test_fsync bye!\n");
+  return 0;
+}
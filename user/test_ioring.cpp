@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ioring.h>
+#include <syscall.h>
+
+#define NLINE 200
+#define LINE_LEN 16
+
+static struct ioring ring;
+static char lines[NLINE][LINE_LEN];
+
+static struct ioring_sqe* next_sqe(int opcode, int user_data) {
+  struct ioring_sqe* sqe = ioring_get_sqe(&ring);
+  assert(sqe);
+  sqe->opcode = opcode;
+  sqe->user_data = user_data;
+  return sqe;
+}
+
+// "line 000000042\n"
+static void fill_line(char* line, int no) {
+  memmove(line, "line ", 5);
+  for (int i = LINE_LEN - 3; i >= 5; --i) {
+    line[i] = '0' + no % 10;
+    no /= 10;
+  }
+  line[LINE_LEN - 2] = '\n';
+  line[LINE_LEN - 1] = '\0';
+}
+
+// submit all the queued entries with one ioring_enter and return the result of
+// the last one
+static int submit_all(int n) {
+  assert(ioring_enter(n) == n);
+  int res = 0;
+  for (int i = 0; i < n; ++i) {
+    struct ioring_cqe* cqe = ioring_peek_cqe(&ring);
+    assert(cqe);
+    // completions come in the submission order
+    assert(cqe->user_data == i);
+    res = cqe->res;
+    ioring_advance_cq(&ring);
+  }
+  assert(!ioring_peek_cqe(&ring));
+  return res;
+}
+
+int main(void) {
+  assert(ioring_setup(&ring) == 0);
+
+  struct ioring_sqe* sqe = next_sqe(IORING_OP_OPEN, 0);
+  sqe->path = (uint32_t) "/ioring_log";
+  sqe->flags = O_WRONLY | O_TRUNC;
+  ioring_advance_sq(&ring);
+  int fd = submit_all(1);
+  assert(fd >= 0);
+
+  // a batch of log lines in a single kernel entry
+  for (int i = 0; i < NLINE; ++i) {
+    fill_line(lines[i], i);
+    sqe = next_sqe(IORING_OP_WRITE, i);
+    sqe->fd = fd;
+    sqe->addr = (uint32_t) lines[i];
+    sqe->len = LINE_LEN - 1;
+    ioring_advance_sq(&ring);
+  }
+  assert(submit_all(NLINE) == LINE_LEN - 1);
+
+  sqe = next_sqe(IORING_OP_CLOSE, 0);
+  sqe->fd = fd;
+  ioring_advance_sq(&ring);
+  assert(submit_all(1) == 1);
+
+  // read it back and list the root directory in one batch
+  fd = open("/ioring_log", O_RDONLY);
+  assert(fd >= 0);
+  static char buf[NLINE * LINE_LEN];
+  static struct dirent ents[64];
+  sqe = next_sqe(IORING_OP_READ, 0);
+  sqe->fd = fd;
+  sqe->addr = (uint32_t) buf;
+  sqe->len = sizeof(buf);
+  ioring_advance_sq(&ring);
+  sqe = next_sqe(IORING_OP_READDIR, 1);
+  sqe->path = (uint32_t) "/";
+  sqe->addr = (uint32_t) ents;
+  sqe->len = 64;
+  ioring_advance_sq(&ring);
+  assert(ioring_enter(2) == 2);
+
+  struct ioring_cqe* cqe = ioring_peek_cqe(&ring);
+  assert(cqe->user_data == 0 && cqe->res == NLINE * (LINE_LEN - 1));
+  ioring_advance_cq(&ring);
+  for (int i = 0; i < NLINE; ++i) {
+    assert(memcmp(buf + i * (LINE_LEN - 1), lines[i], LINE_LEN - 1) == 0);
+  }
+  cqe = ioring_peek_cqe(&ring);
+  assert(cqe->user_data == 1 && cqe->res > 0);
+  bool found = false;
+  for (int i = 0; i < cqe->res; ++i) {
+    found |= strcmp(ents[i].name, "ioring_log") == 0;
+  }
+  assert(found);
+  ioring_advance_cq(&ring);
+  close(fd);
+
+  // a bad fd fails the entry only
+  sqe = next_sqe(IORING_OP_READ, 0);
+  sqe->fd = 50;
+  sqe->addr = (uint32_t) buf;
+  sqe->len = 1;
+  ioring_advance_sq(&ring);
+  assert(submit_all(1) == -1);
+
+  printf("test_ioring bye!\n");
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <mman.h>
+#include <syscall.h>
+
+#define FILE_SIZE (4096 * 3 + 100)
+
+static char expected(int off) {
+  return 'a' + (off % 26);
+}
+
+static void check_mapping(const char* p) {
+  for (int i = 0; i < FILE_SIZE; ++i) {
+    assert(p[i] == expected(i));
+  }
+  // the rest of the last page is zero
+  for (int i = FILE_SIZE; i < 4096 * 4; ++i) {
+    assert(p[i] == 0);
+  }
+}
+
+int main(void) {
+  int fd = open("/mmapfile", O_WRONLY | O_TRUNC);
+  assert(fd >= 0);
+  char buf[4096];
+  for (int off = 0; off < FILE_SIZE; off += sizeof(buf)) {
+    int n = FILE_SIZE - off < sizeof(buf) ? FILE_SIZE - off : sizeof(buf);
+    for (int i = 0; i < n; ++i) {
+      buf[i] = expected(off + i);
+    }
+    assert(write(fd, buf, n) == n);
+  }
+  close(fd);
+
+  fd = open("/mmapfile", O_RDWR);
+  assert(fd >= 0);
+  char* shared = (char*) mmap(nullptr, FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  assert(shared != MAP_FAILED);
+  check_mapping(shared);
+  // writable shared mappings are not supported
+  assert(mmap(nullptr, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) == MAP_FAILED);
+
+  // the child maps the same pages
+  int pid = fork();
+  if (pid == 0) {
+    check_mapping(shared);
+    int cfd = open("/mmapfile", O_RDONLY);
+    char* p = (char*) mmap(nullptr, 4096, PROT_READ, MAP_SHARED, cfd, 4096);
+    assert(p != MAP_FAILED);
+    assert(p[0] == expected(4096));
+    assert(munmap(p, 4096) == 0);
+    printf("test_mmap child bye!\n");
+    return 0;
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(status == 0);
+
+  // writes to a private mapping go to a copy
+  char* priv = (char*) mmap(nullptr, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  assert(priv != MAP_FAILED);
+  priv[1] = 'X';
+  assert(priv[1] == 'X');
+  assert(shared[1] == expected(1));
+  assert(read(fd, buf, 2) == 2);
+  assert(buf[1] == expected(1));
+
+  // write() shows up in the shared mapping. fd is at offset 2 now.
+  buf[0] = 'Y';
+  assert(write(fd, buf, 1) == 1);
+  assert(shared[2] == 'Y');
+
+  // so do truncation and the writes after it
+  int tfd = open("/mmapfile", O_WRONLY | O_TRUNC);
+  assert(tfd >= 0);
+  assert(shared[0] == 0 && shared[4096] == 0);
+  assert(write(tfd, "new", 3) == 3);
+  close(tfd);
+  assert(!memcmp(shared, "new", 3) && shared[3] == 0);
+
+  assert(munmap(priv, FILE_SIZE) == 0);
+  assert(munmap(shared, FILE_SIZE) == 0);
+  close(fd);
+  printf("test_mmap bye!\n");
+  return 0;
+}
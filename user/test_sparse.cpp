@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <syscall.h>
+
+#define HOLE_END (4096 * 300 + 100)
+
+int main(void) {
+  int fd = open("/sparsefile", O_RDWR | O_TRUNC);
+  assert(fd >= 0);
+  assert(write(fd, "head", 4) == 4);
+  // an empty write past the end does not grow the file
+  assert(lseek(fd, HOLE_END, SEEK_SET) == HOLE_END);
+  assert(write(fd, "", 0) == 0);
+  assert(lseek(fd, 0, SEEK_END) == 4);
+  // leave a hole
+  assert(lseek(fd, HOLE_END, SEEK_SET) == HOLE_END);
+  assert(write(fd, "tail", 4) == 4);
+  assert(lseek(fd, 0, SEEK_END) == HOLE_END + 4);
+
+  // the hole starts right after the first block
+  assert(lseek(fd, 0, SEEK_DATA) == 0);
+  assert(lseek(fd, 0, SEEK_HOLE) == 4096);
+  assert(lseek(fd, 4096, SEEK_DATA) == HOLE_END / 4096 * 4096);
+  assert(lseek(fd, HOLE_END, SEEK_HOLE) == HOLE_END + 4);
+  assert(lseek(fd, HOLE_END + 4, SEEK_DATA) == -1);
+
+  char buf[4096];
+  assert(lseek(fd, 4096 * 100, SEEK_SET) == 4096 * 100);
+  assert(read(fd, buf, sizeof(buf)) == sizeof(buf));
+  for (int i = 0; i < sizeof(buf); ++i) {
+    assert(buf[i] == 0);
+  }
+  assert(lseek(fd, HOLE_END - 2, SEEK_SET) == HOLE_END - 2);
+  assert(read(fd, buf, sizeof(buf)) == 6);
+  assert(buf[0] == 0 && buf[1] == 0 && !memcmp(buf + 2, "tail", 4));
+
+  // fill part of the hole
+  assert(lseek(fd, 4096 * 100 + 10, SEEK_SET) == 4096 * 100 + 10);
+  assert(write(fd, "mid", 3) == 3);
+  assert(lseek(fd, 4096, SEEK_DATA) == 4096 * 100);
+  assert(lseek(fd, 4096 * 100, SEEK_HOLE) == 4096 * 101);
+  assert(lseek(fd, -13, SEEK_CUR) == 4096 * 100);
+  assert(read(fd, buf, 16) == 16);
+  assert(buf[9] == 0 && !memcmp(buf + 10, "mid", 3) && buf[13] == 0);
+  close(fd);
+
+  // pipes can't seek
+  int fds[2];
+  assert(pipe(fds) == 0);
+  assert(lseek(fds[0], 0, SEEK_SET) == -1);
+  close(fds[0]);
+  close(fds[1]);
+  assert(unlink("/sparsefile") == 0);
+  printf("test_sparse bye!\n");
+  return 0;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syscall.h>
+
+#define FILE_SIZE (4096 * 5 + 123)
+
+static char expected(int off) {
+  return 'a' + (off * 7 % 26);
+}
+
+static void check_file(const char* path) {
+  int fd = open(path, O_RDONLY);
+  assert(fd >= 0);
+  static char buf[FILE_SIZE + 1];
+  int tot = 0;
+  int r;
+  while ((r = read(fd, buf + tot, sizeof(buf) - tot)) > 0) {
+    tot += r;
+  }
+  assert(tot == FILE_SIZE);
+  for (int i = 0; i < FILE_SIZE; ++i) {
+    assert(buf[i] == expected(i));
+  }
+  close(fd);
+}
+
+int main(void) {
+  static char buf[FILE_SIZE];
+  for (int i = 0; i < FILE_SIZE; ++i) {
+    buf[i] = expected(i);
+  }
+  int fd = open("/splice_src", O_WRONLY | O_TRUNC);
+  assert(fd >= 0);
+  assert(write(fd, buf, FILE_SIZE) == FILE_SIZE);
+  close(fd);
+
+  // file to file through sendfile. off does not move the offset of in_fd.
+  int in = open("/splice_src", O_RDONLY);
+  int out = open("/splice_copy", O_WRONLY | O_TRUNC);
+  assert(in >= 0 && out >= 0);
+  assert(sendfile(out, in, 0, FILE_SIZE) == FILE_SIZE);
+  assert(sendfile(out, in, FILE_SIZE, 10) == 0);
+  char c;
+  assert(read(in, &c, 1) == 1 && c == expected(0));
+  close(in);
+  close(out);
+  check_file("/splice_copy");
+
+  // file -> pipe -> file across processes
+  int fds[2];
+  assert(pipe(fds) == 0);
+  int pid = fork();
+  if (pid == 0) {
+    close(fds[1]);
+    out = open("/splice_dst", O_WRONLY | O_TRUNC);
+    assert(out >= 0);
+    int tot = 0;
+    int r;
+    while ((r = splice(fds[0], out, FILE_SIZE)) != 0) {
+      if (r == EAGAIN) {
+        continue;
+      }
+      assert(r > 0);
+      tot += r;
+    }
+    assert(tot == FILE_SIZE);
+    close(out);
+    close(fds[0]);
+    return 0;
+  }
+  close(fds[0]);
+  in = open("/splice_src", O_RDONLY);
+  assert(in >= 0);
+  int r;
+  while ((r = sendfile(fds[1], in, -1, FILE_SIZE)) != 0) {
+    assert(r > 0 || r == EAGAIN);
+  }
+  close(in);
+  close(fds[1]);
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(status == 0);
+  check_file("/splice_dst");
+
+  printf("test_splice bye!\n");
+  return 0;
+}
@@ -33,6 +33,15 @@ int main(void) {
     assert(buf3[i] == (i % 26) + 'a');
   }
   assert(read(fd_read, buf3, sizeof(buf3)) == 0); // no more left
+
+  // a write through another FileDesc shows up in the next read
+  assert(lseek(fd_read, 0, SEEK_SET) == 0);
+  assert(read(fd_read, buf3, 1) == 1 && buf3[0] == 'a');
+  fd2 = open("/largefile", O_WRONLY);
+  assert(fd2 >= 0);
+  assert(write(fd2, "XY", 2) == 2);
+  close(fd2);
+  assert(read(fd_read, buf3, 2) == 2 && buf3[0] == 'Y' && buf3[1] == 'c');
   close(fd_read);
   printf("test_writefile bye!\n");
   return 0;